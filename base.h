@@ -1,11 +1,15 @@
 #ifndef MILK_BASE_H
 #define MILK_BASE_H
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
 #include "init.h"
 #include "update.h"
 #include "utils/shape.h"
 #include "utils/dag.h"
+#include "utils/pack.h"
+#include "utils/pool.h"
 
 namespace milk {
 
@@ -15,21 +19,25 @@ using namespace mshadow::expr;
 template <typename xpu>
 class Data {
   public:
-    static Stream<xpu>* s;
+    static thread_local Stream<xpu>* s; // one per thread, see hogwild_trainer
 
     std::shared_ptr<MatrixContainer<xpu>> w;    // value
     std::shared_ptr<MatrixContainer<xpu>> grad; // gradient
     std::shared_ptr<Data<xpu>> out = nullptr; // outside of time-range
     uint batch_size = 1;
     std::shared_ptr<sdag> dag = nullptr; // structure info for recursive nets
+    std::shared_ptr<packing> pack = nullptr; // for packed sequence batches
 
     Data<xpu>();
     Data<xpu>(uint rows, uint cols);
 
     uint len() {
+      if (pack) return pack->len();
       assert((w->size(0) % batch_size) == 0);
       return w->size(0) / batch_size;
     }
+    // number of rows in time slice t (t < len())
+    uint batch_size_at(uint t) { return pack ? pack->sizes[t] : batch_size; }
 
     virtual Matrix<xpu>& operator()() { return *w; }
     virtual Matrix<xpu>& d()          { return *grad; }
@@ -39,22 +47,33 @@ class Data {
 
     virtual void init(uint rows, uint cols);
     virtual void reset_grad();
+    virtual void free_grad(); // drop the gradient buffer (inference only)
 
     virtual bool has_grad() { return grad != nullptr; } // used for truncated bprop
     virtual void clone_info(const Data& other) {
       batch_size = other.batch_size;
       dag = other.dag;
+      pack = other.pack;
     }
 };
 
 template <typename xpu>
-Stream<xpu>* Data<xpu>::s = NewStream<xpu>();
+thread_local Stream<xpu>* Data<xpu>::s = NewStream<xpu>();
 
 template <typename xpu>
 std::shared_ptr<MatrixContainer<xpu>> make_MC(uint rows, uint cols,
-                                              Real init_val = 0.) {
-  auto x = std::make_shared<MatrixContainer<xpu>>(Shape2(rows,cols), init_val);
+                                              Real init_val) {
+  auto x = pool<xpu>::get().acquire(rows, cols);
   x->set_stream(Data<xpu>::s);
+  *x = init_val;
+  return x;
+}
+
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> make_MC(const std::vector<Real>& v) {
+  auto x = make_MC<xpu>(1, v.size());
+  Copy(*x, Matrix<cpu>(const_cast<Real*>(v.data()), Shape2(1, v.size())),
+       Data<xpu>::s);
   return x;
 }
 
@@ -69,16 +88,18 @@ Matrix<xpu> Data<xpu>::operator()(uint t) {
   if (t >= len()) {
     if (!out or out->w->shape_ != Shape2(batch_size, w->size(1))) {
       out = std::make_shared<Data<xpu>>(batch_size, w->size(1));
-      out->reset_grad();
+      if (has_grad()) out->reset_grad();
     }
     return (*out)();
   }
+  if (pack) return middle_rows(*w, pack->offsets[t], pack->sizes[t]);
   return middle_rows(*w, t*batch_size, batch_size);
 }
 
 template <typename xpu>
 Matrix<xpu> Data<xpu>::d(uint t) {
   if (t >= len()) return out->d();
+  if (pack) return middle_rows(*grad, pack->offsets[t], pack->sizes[t]);
   return middle_rows(*grad, t*batch_size, batch_size);
 }
 
@@ -86,8 +107,12 @@ template <typename xpu>
 void Data<xpu>::init(uint rows, uint cols) {
   if (w->size(0) == rows and w->size(1) == cols) { *w = 0; } // no need to alloc/realloc
   else {
-    w->Resize(Shape2(rows,cols), 0.);
-    if (grad) grad->Resize(Shape2(rows,cols), 0.);
+    pool<xpu>::get().resize(*w, rows, cols);
+    *w = 0.;
+    if (grad) {
+      pool<xpu>::get().resize(*grad, rows, cols);
+      *grad = 0.;
+    }
   }
 }
 
@@ -100,6 +125,12 @@ void Data<xpu>::reset_grad() {
   if (out) out->reset_grad();
 }
 
+template <typename xpu>
+void Data<xpu>::free_grad() {
+  grad = nullptr;
+  if (out) out->free_grad();
+}
+
 // Input is essentially a Data ptr with additional bookkeeping and
 // operators for convenience
 template <typename xpu>
@@ -131,16 +162,56 @@ class Weight : public Data<xpu> {
     Real la = defaults::la; // L2 regularizer penalty (shorthand for lambda)
 
     virtual void init(uint rows, uint cols) {
-      this->w = make_MC<xpu>(rows, cols);
+      alloc(rows, cols);
       assert(initer);
       initer(*(this->w));
+    }
+
+    // storage without running the initializer, e.g. to load values into
+    virtual void alloc(uint rows, uint cols) { adopt(make_MC<xpu>(rows, cols)); }
+
+    // use value as storage, gradient and updater state are made to match
+    virtual void adopt(std::shared_ptr<MatrixContainer<xpu>> value) {
+      this->w = value;
+      all_dirty = true;
       this->reset_grad();
       if (!u) u = std::make_shared<rmsprop<xpu>>();
-      u->init(rows, cols);
+      u->init(value->size(0), value->size(1));
       for (auto h : u->history()) h->stream_ = Data<xpu>::s; // TODO: this is prob. not the right place?
     }
 
-    virtual void update() { u->update(*(this->w), *(this->grad)); }
+    // use the storage and updater of other (no copy), with a gradient of our
+    // own, e.g. for replicas of a layer trained in parallel
+    virtual void share(Weight<xpu>& other) {
+      this->w = other.w;
+      u = other.u;
+      initer = other.initer;
+      la = other.la;
+      this->reset_grad();
+      mark_clean(); // tracks our own updates
+    }
+
+    virtual void update() { u->update(*(this->w), *(this->grad)); all_dirty = true; }
+    // update when the gradient is zero outside of rows, see updater::update_rows
+    virtual void update_rows(const std::vector<uint>& rows, Vector<xpu> index) {
+      u->update_rows(*(this->w), *(this->grad), rows, index);
+      if (u->sparse_rows()) mark_dirty(rows);
+      else all_dirty = true;
+    }
+
+    // rows changed (with their updater history) since the last checkpoint,
+    // sorted. all_dirty after dense updates and new storage. see save_delta.
+    bool all_dirty = true;
+    std::vector<uint> dirty;
+
+    void mark_dirty(const std::vector<uint>& rows) {
+      if (all_dirty or rows.empty()) return;
+      std::vector<uint> merged;
+      std::set_union(dirty.begin(), dirty.end(), rows.begin(), rows.end(),
+                     std::back_inserter(merged));
+      dirty.swap(merged);
+    }
+    void mark_clean() { all_dirty = false; dirty.clear(); }
 };
 
 } // end namespace milk
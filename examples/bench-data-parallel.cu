@@ -0,0 +1,73 @@
+#include "bench.h"
+
+using namespace milk;
+using namespace milk::factory;
+
+typedef replica_trainer<cpu>::maker maker;
+
+// training throughput in instances/s of data_parallel_trainer with 1, 2, 4
+// and (if more) as many replicas as cores, one thread each, against the
+// plain trainer, on the mnist ff and sstb lstm networks over synthetic data:
+//   bench-data-parallel [runs]
+// each run is an epoch; the reduction and the single update are included.
+void bench_scaling(const std::string& name, std::vector<Data<cpu>>& X,
+                   std::vector<Data<cpu>>& Y, maker make,
+                   const std::vector<uint>& replicas, uint runs) {
+  uint n = 0;
+  for (auto& y : Y) n += y().size(0);
+  std::vector<double> speed;
+
+  auto ds = datastream<cpu>(2);
+  trainer<cpu> t(ds, ds >> make());
+  speed.push_back(n / bench::best_of(runs, [&]() { t.train({&X, &Y}); }));
+
+  for (uint k : replicas) {
+    data_parallel_trainer<cpu> dp(datastream<cpu>(2), make, k, k);
+    speed.push_back(n / bench::best_of(runs, [&]() { dp.train({&X, &Y}); }));
+  }
+  bench::row(name, speed);
+}
+
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint runs = argc > 1 ? std::stoi(argv[1]) : 3;
+  std::srand(1);
+
+  std::vector<uint> replicas = {1, 2, 4};
+  uint cores = std::max(1u, std::thread::hardware_concurrency());
+  if (cores > 4) replicas.push_back(cores);
+  std::vector<std::string> columns = {"plain"};
+  for (uint k : replicas) columns.push_back(std::to_string(k));
+  std::cout << cores << " cores" << std::endl;
+  bench::header("train inst/s, replicas", columns);
+
+  // examples/mnist.cu, 10k rows in batches of 256
+  std::vector<Data<cpu>> X, Y;
+  bench::dense_data(&X, &Y, 10000, 784, 10, 256);
+  bench_scaling("mnist ff", X, Y, []() -> std::shared_ptr<layer::layer<cpu>> {
+    auto l = ff<cpu>(100, nonlin::tanh<cpu>()) >>
+             ff<cpu>(100, nonlin::tanh<cpu>()) >>
+             ff<cpu>(100, nonlin::tanh<cpu>()) >>
+             ff<cpu>(10, nonlin::id<cpu>()) >> smax_xent<cpu>();
+    l->set_updater<adam<cpu>>();
+    l->set_lr(1e-3);
+    return l;
+  }, replicas, runs);
+
+  // examples/sstb-lstm.cu, 2000 sentences of 5 to 40 words in batches of 64,
+  // padded since replicas cannot slice packed batches (see slice_batch)
+  uint V = 20000;
+  std::vector<Data<cpu>> S, L, Xs, Ys;
+  bench::sent_data(&S, &L, 2000, 5, 40, V, 5);
+  batch_seq_single_label(&Xs, &Ys, S, L, V, 64);
+  bench_scaling("sstb lstm", Xs, Ys, [V]() -> std::shared_ptr<layer::layer<cpu>> {
+    auto l = proj<cpu>(300, V+1) >> lstm<cpu>(50) >> tail<cpu>() >>
+             ff<cpu>(5, nonlin::id<cpu>()) >> smax_xent<cpu>();
+    l->set_updater<rmsprop<cpu>>();
+    l->set_lr(1e-3);
+    return l;
+  }, replicas, runs);
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
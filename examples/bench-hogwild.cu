@@ -0,0 +1,56 @@
+#include "bench.h"
+
+using namespace milk;
+using namespace milk::factory;
+
+// training throughput in instances/s of hogwild_trainer with 1, 2, 4 and (if
+// more) as many threads as cores against the plain trainer, on a net whose
+// work is mostly sparse proj lookups and row updates over synthetic ids:
+//   bench-hogwild [runs]
+// each run is an epoch of 4000 batches of 32 ids into a 100k row proj, with
+// adagrad, as hogwild_trainer takes no updater that counts steps.
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint runs = argc > 1 ? std::stoi(argv[1]) : 3;
+  std::srand(1);
+
+  uint V = 100000;
+  std::vector<Data<cpu>> X(4000), Y(4000);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(32, 1);
+    Y[j].init(32, 1);
+    for (uint i=0; i<32; i++) {
+      X[j]()[i][0] = std::rand() % V;
+      Y[j]()[i][0] = std::sin(X[j]()[i][0]);
+    }
+  }
+  uint n = X.size() * 32;
+  auto make = [V]() -> std::shared_ptr<layer::layer<cpu>> {
+    auto l = proj<cpu>(128, V) >> ff<cpu>(32) >>
+             ff<cpu>(1, nonlin::id<cpu>()) >> sqerr<cpu>();
+    l->set_updater<adagrad<cpu>>();
+    l->set_lr(0.01);
+    return l;
+  };
+
+  std::vector<uint> threads = {1, 2, 4};
+  uint cores = std::max(1u, std::thread::hardware_concurrency());
+  if (cores > 4) threads.push_back(cores);
+  std::vector<std::string> columns = {"plain"};
+  for (uint k : threads) columns.push_back(std::to_string(k));
+  std::cout << cores << " cores" << std::endl;
+  bench::header("train inst/s, threads", columns);
+
+  std::vector<double> speed;
+  auto ds = datastream<cpu>(2);
+  trainer<cpu> t(ds, ds >> make());
+  speed.push_back(n / bench::best_of(runs, [&]() { t.train({&X, &Y}); }));
+  for (uint k : threads) {
+    hogwild_trainer<cpu> h(datastream<cpu>(2), make, k);
+    speed.push_back(n / bench::best_of(runs, [&]() { h.train({&X, &Y}); }));
+  }
+  bench::row("proj(128, 100k) ff", speed);
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include "bench.h"
+
+using namespace milk;
+using namespace milk::factory;
+
+typedef std::function<std::shared_ptr<layer::layer<cpu>>(
+    std::shared_ptr<layer::datastream<cpu>>)> net_maker;
+
+// mean_error throughput and peak memory with and without activation
+// gradients, on the mnist and sstb-lstm networks over synthetic data:
+//   bench-inference [passes]
+// "test" is mean_error. "train-mode" runs the same forward passes in TRAIN
+// mode without backward, so every activation gradient is allocated and
+// zeroed, as mean_error did before TEST mode skipped them. Each row runs in
+// a process of its own; the peak includes data and weights, which both rows
+// share.
+void bench_modes(const std::string& name, std::function<void(
+                     std::vector<Data<cpu>>*, std::vector<Data<cpu>>*)> data,
+                 net_maker make, uint passes) {
+  for (Mode mode : {TEST, TRAIN}) {
+    bench::in_child([&]() {
+      std::srand(1);
+      std::vector<Data<cpu>> X, Y;
+      data(&X, &Y);
+      uint n = 0;
+      for (auto& y : Y) n += y().size(0);
+      auto ds = datastream<cpu>(2);
+      trainer<cpu> t(ds, make(ds));
+      double secs = bench::best_of(passes, [&]() {
+        t.run({&X, &Y}, mode, false);
+      });
+      bench::row(name + (mode == TEST ? " test" : " train-mode"),
+                 {n / secs, bench::peak_rss()});
+    });
+  }
+}
+
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint passes = argc > 1 ? std::stoi(argv[1]) : 3;
+
+  bench::header("net", {"inst/s", "peak MB"});
+
+  // examples/mnist.cu, 10k rows in batches of 1000
+  bench_modes("mnist ff", [](std::vector<Data<cpu>>* X,
+                             std::vector<Data<cpu>>* Y) {
+    bench::dense_data(X, Y, 10000, 784, 10, 1000);
+  }, [](std::shared_ptr<layer::datastream<cpu>> ds) {
+    return ds >> ff<cpu>(100, nonlin::tanh<cpu>()) >>
+                 ff<cpu>(100, nonlin::tanh<cpu>()) >>
+                 ff<cpu>(100, nonlin::tanh<cpu>()) >>
+                 ff<cpu>(10, nonlin::id<cpu>()) >> smax_xent<cpu>();
+  }, passes);
+
+  // examples/sstb-lstm.cu, 1000 sentences of 20 words in batches of 500
+  uint V = 20000;
+  bench_modes("sstb lstm", [V](std::vector<Data<cpu>>* X,
+                               std::vector<Data<cpu>>* Y) {
+    std::vector<Data<cpu>> S, L;
+    bench::sent_data(&S, &L, 1000, 20, 20, V, 5);
+    batch_seq_single_label(X, Y, S, L, V, 500);
+  }, [V](std::shared_ptr<layer::datastream<cpu>> ds) {
+    return ds >> proj<cpu>(300, V+1) >> lstm<cpu>(50) >> tail<cpu>()
+              >> ff<cpu>(5, nonlin::id<cpu>()) >> smax_xent<cpu>();
+  }, passes);
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <cstdio>
+#include "bench.h"
+
+using namespace milk;
+
+// text parsing throughput in MB/s of read_table, read_labeled_table and
+// load_wv_table against the sequential loops they replaced, kept below as
+// they were. files are written to dir first and removed after:
+//   bench-ingest [runs] [dir]
+
+void old_read_table(std::string fname, Matrix<cpu>* X) {
+  std::string line;
+  std::ifstream in(fname.c_str());
+  assert(in.is_open());
+  for (uint i=0; i<X->size(0); i++) {
+    std::getline(in, line);
+    auto v = split(line);
+    auto row = (*X)[i];
+    for (uint j=0; j<X->size(1); j++) row[j] = std::stod(v[j]);
+  }
+}
+
+// as examples/mnist.cu read its files
+void old_read_mnist(std::string fname, Matrix<cpu>* X, Matrix<cpu>* Y) {
+  std::ifstream in(fname.c_str());
+  assert(in.is_open());
+  for (uint i=0; i<X->size(0); i++) {
+    in >> (*Y)[i][0];
+    for (uint j=0; j<X->size(1); j++) in >> (*X)[i][j];
+  }
+}
+
+void old_load_wv_table(std::string fname, uint d, Matrix<cpu>* W,
+                       std::unordered_map<std::string,uint>& w2i) {
+  std::string line;
+  std::ifstream in(fname);
+  assert(in.is_open());
+  VectorContainer<cpu> tmp(Shape1(d));
+  while (std::getline(in, line)) {
+    auto v = split(line, ' ');
+    std::string w = v[0];
+    if (w2i.find(w) != w2i.end()) {
+      uint ix = w2i[w];
+      for (uint i=0; i<d; i++) tmp[i] = std::stod(v[i+1]);
+      Copy((*W)[ix], tmp);
+    }
+  }
+}
+
+double file_mb(const std::string& fname) {
+  std::ifstream in(fname, std::ios::binary | std::ios::ate);
+  return in.tellg() / 1e6;
+}
+
+// both readers must give the same values
+void same(Matrix<cpu> a, Matrix<cpu> b) {
+  Real d = 0;
+  for (uint i=0; i<a.size(0); i++)
+    for (uint j=0; j<a.size(1); j++) d = std::max(d, std::abs(a[i][j] - b[i][j]));
+  if (d > 0) std::cout << "  values differ by up to " << d << std::endl;
+}
+
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint runs = argc > 1 ? std::stoi(argv[1]) : 3;
+  std::string dir = argc > 2 ? argv[2] : "/tmp";
+  std::srand(1);
+
+  std::cout << thread_pool::get().size() + 1 << " threads" << std::endl;
+  bench::header("MB/s", {"MB", "old", "new"});
+
+  // 20k x 100 reals, as read_table takes them
+  std::string table = dir + "/milk_bench_table.txt";
+  {
+    std::ofstream out(table);
+    for (uint i=0; i<20000; i++)
+      for (uint j=0; j<100; j++)
+        out << (std::rand() / (Real)RAND_MAX - 0.5) * 10
+            << (j < 99 ? " " : "\n");
+  }
+  {
+    MatrixContainer<cpu> A(Shape2(20000, 100)), B(Shape2(20000, 100));
+    double mb = file_mb(table);
+    double t_old = bench::best_of(runs, [&]() { old_read_table(table, &A); });
+    double t_new = bench::best_of(runs, [&]() { read_table(table, &B); });
+    bench::row("read_table", {mb, mb / t_old, mb / t_new});
+    same(A, B);
+  }
+  std::remove(table.c_str());
+
+  // 20k rows of a label and 784 pixels, as the mnist files
+  std::string mnist = dir + "/milk_bench_mnist.txt";
+  {
+    std::ofstream out(mnist);
+    for (uint i=0; i<20000; i++) {
+      out << std::rand() % 10;
+      for (uint j=0; j<784; j++) out << " " << std::rand() % 256;
+      out << "\n";
+    }
+  }
+  {
+    MatrixContainer<cpu> XA(Shape2(20000, 784)), YA(Shape2(20000, 1)),
+                         XB(Shape2(20000, 784)), YB(Shape2(20000, 1));
+    double mb = file_mb(mnist);
+    double t_old = bench::best_of(runs, [&]() {
+      old_read_mnist(mnist, &XA, &YA);
+    });
+    double t_new = bench::best_of(runs, [&]() {
+      read_labeled_table(mnist, &XB, &YB);
+    });
+    bench::row("read_labeled_table", {mb, mb / t_old, mb / t_new});
+    same(XA, XB);
+    same(YA, YB);
+  }
+  std::remove(mnist.c_str());
+
+  // 40k words of 300 reals, half of them in the vocabulary
+  std::string wv = dir + "/milk_bench_wv.txt";
+  std::unordered_map<std::string,uint> w2i;
+  {
+    std::ofstream out(wv);
+    for (uint i=0; i<40000; i++) {
+      std::string w = "w" + std::to_string(i);
+      uint k = w2i.size();
+      if (i % 2 == 0) w2i[w] = k;
+      out << w;
+      for (uint j=0; j<300; j++)
+        out << " " << (std::rand() / (Real)RAND_MAX - 0.5);
+      out << "\n";
+    }
+  }
+  {
+    MatrixContainer<cpu> A(Shape2(w2i.size(), 300)), B(Shape2(w2i.size(), 300));
+    A = 0; B = 0;
+    double mb = file_mb(wv);
+    double t_old = bench::best_of(runs, [&]() {
+      old_load_wv_table(wv, 300, &A, w2i);
+    });
+    double t_new = bench::best_of(runs, [&]() {
+      load_wv_table<cpu>(wv, 300, &B, w2i);
+    });
+    bench::row("load_wv_table", {mb, mb / t_old, mb / t_new});
+    same(A, B);
+  }
+  std::remove(wv.c_str());
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
@@ -0,0 +1,142 @@
+#include "bench.h"
+
+using namespace milk;
+using namespace milk::factory;
+
+typedef std::shared_ptr<MatrixContainer<cpu>> MC;
+
+// forward+backward throughput of lstm (and recurrent) on cpu, in tokens/s:
+//   bench-lstm [runs]
+// besides the layers, the gemms of an lstm are timed on their own against
+// the schedules they replaced, apart from the elementwise work.
+
+// tokens/s of forward+backward of l (lstm or recurrent) over the batch X,
+// counting every row of X unless tokens is given
+template <typename L>
+double layer_speed(std::shared_ptr<L> l, Data<cpu>& X, uint runs,
+                   uint tokens = 0) {
+  l->x.connect_from(X);
+  double secs = bench::best_of(runs, [&]() {
+    l->forward();
+    l->h.d() = 1.;
+    l->backward();
+    l->reset_grad();
+  });
+  return (tokens ? tokens : X().size(0)) / secs;
+}
+
+// a padded batch of bs sequences of T steps, xdim features each
+Data<cpu> seq_batch(uint T, uint bs, uint xdim) {
+  Data<cpu> X(T*bs, xdim);
+  X.batch_size = bs;
+  mshadow::Random<cpu, Real>(0).SampleUniform(&(X()), -1., 1.);
+  return X;
+}
+
+// tokens/s of the gemms of an lstm forward+backward over T steps of bs rows.
+// fused: one input, one recurrent and one peephole weight of 4, 4 and 3
+// gates, otherwise one weight per gate (4 + 4 + 3) as before.
+// recurrent weight gradients are taken per step, or deferred to one gemm
+// over all steps.
+double gemm_speed(uint T, uint bs, uint xdim, uint dim, bool fused,
+                  bool deferred, uint runs) {
+  uint Tbs = T*bs;
+  MC X = make_MC<cpu>(Tbs, xdim, 0.1), dX = make_MC<cpu>(Tbs, xdim),
+     H = make_MC<cpu>(Tbs, dim, 0.1), dH = make_MC<cpu>(Tbs, dim),
+     C = make_MC<cpu>(Tbs, dim, 0.1), dC = make_MC<cpu>(Tbs, dim);
+  enum { INPUT, RECURRENT, PEEPHOLE };
+  std::vector<MC> W, dW, G, dG; // each weight and the gates it feeds
+  std::vector<uint> kind;
+  for (uint k : {INPUT, RECURRENT, PEEPHOLE}) {
+    uint gates = k == PEEPHOLE ? 3 : 4;
+    for (uint i=0; i < (fused ? 1 : gates); i++) {
+      uint in = k == INPUT ? xdim : dim, out = fused ? gates*dim : dim;
+      W.push_back(make_MC<cpu>(in, out, 0.01));
+      dW.push_back(make_MC<cpu>(in, out));
+      G.push_back(make_MC<cpu>(Tbs, out));
+      dG.push_back(make_MC<cpu>(Tbs, out, 0.01));
+      kind.push_back(k);
+    }
+  }
+
+  double secs = bench::best_of(runs, [&]() {
+    for (uint i=0; i<W.size(); i++)
+      if (kind[i] == INPUT) *G[i] = dot(*X, *W[i]);
+    for (uint t=1; t<T; t++)
+      for (uint i=0; i<W.size(); i++) {
+        if (kind[i] == INPUT) continue;
+        auto src = middle_rows<cpu>(kind[i] == RECURRENT ? *H : *C, (t-1)*bs, bs);
+        middle_rows<cpu>(*G[i], t*bs, bs) += dot(src, *W[i]);
+      }
+    for (uint t=T-1; t>0; t--)
+      for (uint i=0; i<W.size(); i++) {
+        if (kind[i] == INPUT) continue;
+        bool r = kind[i] == RECURRENT;
+        auto src = middle_rows<cpu>(r ? *H : *C, (t-1)*bs, bs);
+        auto dsrc = middle_rows<cpu>(r ? *dH : *dC, (t-1)*bs, bs);
+        auto dg = middle_rows<cpu>(*dG[i], t*bs, bs);
+        dsrc += dot(dg, W[i]->T());
+        if (!deferred) *dW[i] += dot(src.T(), dg);
+      }
+    for (uint i=0; i<W.size(); i++) {
+      if (kind[i] == INPUT or !deferred or T < 2) continue;
+      auto src = middle_rows<cpu>(kind[i] == RECURRENT ? *H : *C, 0, (T-1)*bs);
+      *dW[i] += dot(src.T(), middle_rows<cpu>(*dG[i], bs, (T-1)*bs));
+    }
+    for (uint i=0; i<W.size(); i++) {
+      if (kind[i] != INPUT) continue;
+      *dW[i] += dot(X->T(), *dG[i]);
+      *dX += dot(*dG[i], W[i]->T());
+    }
+  });
+  return Tbs / secs;
+}
+
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint runs = argc > 1 ? std::stoi(argv[1]) : 3;
+
+  // fused gate gemms: lstm(128) on 30 steps of 8, 64 inputs
+  bench::header("gates, 30 x 8", {"tokens/s"});
+  auto X = seq_batch(30, 8, 64);
+  bench::row("lstm(128)", {layer_speed(lstm<cpu>(128), X, runs)});
+  bench::row("gemms, one per gate",
+             {gemm_speed(30, 8, 64, 128, false, false, runs)});
+  bench::row("gemms, fused", {gemm_speed(30, 8, 64, 128, true, false, runs)});
+
+  // deferred recurrent weight gradients: short and wide against long and
+  // narrow batches of the same lstm(128)
+  std::cout << std::endl;
+  bench::header("weight gradients", {"30 x 8", "200 x 2"});
+  auto Xw = seq_batch(30, 8, 64), Xn = seq_batch(200, 2, 64);
+  bench::row("lstm(128)", {layer_speed(lstm<cpu>(128), Xw, runs),
+                           layer_speed(lstm<cpu>(128), Xn, runs)});
+  bench::row("recurrent(128)", {layer_speed(recurrent<cpu>(128), Xw, runs),
+                                layer_speed(recurrent<cpu>(128), Xn, runs)});
+  bench::row("gemms, per step", {gemm_speed(30, 8, 64, 128, true, false, runs),
+                                 gemm_speed(200, 2, 64, 128, true, false, runs)});
+  bench::row("gemms, deferred", {gemm_speed(30, 8, 64, 128, true, true, runs),
+                                 gemm_speed(200, 2, 64, 128, true, true, runs)});
+
+  // packed batches: 32 sequences, two of 60 steps and thirty of 4 to 18,
+  // padded to 60 steps or packed
+  std::cout << std::endl;
+  std::vector<Data<cpu>> S(32), L(32), Xb, Lb;
+  uint tokens = 0;
+  for (uint j=0; j<S.size(); j++) {
+    S[j] = seq_batch(j < 2 ? 60 : 4 + j % 15, 1, 64);
+    L[j].init(1, 1);
+    tokens += S[j].len();
+  }
+  bench::header("packing, " + std::to_string(tokens) + " tokens",
+                {"rows", "tokens/s"});
+  for (bool packed : {false, true}) {
+    batch_seq_single_label(&Xb, &Lb, S, L, 0., S.size(), false, packed);
+    bench::row(packed ? "lstm(64), packed" : "lstm(64), padded",
+               {(double)Xb[0]().size(0),
+                layer_speed(lstm<cpu>(64), Xb[0], runs, tokens)});
+  }
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include "bench.h"
+
+using namespace milk;
+using namespace milk::factory;
+
+// forward+backward throughput of recursive(50, 2) on cpu, in trees/s, on a
+// balanced and a left branching binary tree with 25 rows per node:
+//   bench-recursive [runs]
+// the per node schedule that level scheduling replaced is timed as its gemms
+// alone (one [25 x 50] x [50 x 50] product per edge and direction), which
+// bounds the old layer from below.
+
+// balanced: node n has children 2n+1 (label 0) and 2n+2 (label 1)
+std::shared_ptr<sdag> balanced(uint nodes) {
+  auto dag = std::make_shared<sdag>();
+  dag->adj_list.resize(nodes);
+  for (uint n=0; 2*n+2 < nodes; n++)
+    dag->adj_list[n] = {{2*n+1, 0}, {2*n+2, 1}};
+  return dag;
+}
+
+// left branching: inner node 2k has the inner node 2k+2 on its left and the
+// leaf 2k+1 on its right, down to the leaf at the bottom
+std::shared_ptr<sdag> left_branching(uint nodes) {
+  auto dag = std::make_shared<sdag>();
+  dag->adj_list.resize(nodes);
+  for (uint n=0; n+2 < nodes; n+=2) dag->adj_list[n] = {{n+2, 0}, {n+1, 1}};
+  return dag;
+}
+
+double layer_speed(std::shared_ptr<sdag> dag, uint bs, uint runs) {
+  Data<cpu> x(dag->size() * bs, 50);
+  x.batch_size = bs;
+  x.dag = dag;
+  mshadow::Random<cpu, Real>(0).SampleUniform(&(x()), -1., 1.);
+  auto l = recursive<cpu>(50, 2);
+  l->x.connect_from(x);
+  double secs = bench::best_of(runs, [&]() {
+    l->forward();
+    l->h.d() = 1.;
+    l->backward();
+    l->reset_grad();
+  });
+  return 1 / secs;
+}
+
+double per_node_gemm_speed(std::shared_ptr<sdag> dag, uint bs, uint runs) {
+  uint N = dag->size();
+  auto h = make_MC<cpu>(N * bs, 50, 0.1), dh = make_MC<cpu>(N * bs, 50, 0.01);
+  std::vector<std::shared_ptr<MatrixContainer<cpu>>> V, dV;
+  for (uint l=0; l<2; l++) {
+    V.push_back(make_MC<cpu>(50, 50, 0.01));
+    dV.push_back(make_MC<cpu>(50, 50));
+  }
+  auto node = [&](std::shared_ptr<MatrixContainer<cpu>> m, uint n) {
+    return middle_rows<cpu>(*m, n*bs, bs);
+  };
+  double secs = bench::best_of(runs, [&]() {
+    for (int n=N-1; n>=0; n--) // children come after their parents
+      for (auto& c : dag->children(n))
+        node(h, n) += dot(node(h, c.first), *V[c.second]);
+    for (uint n=0; n<N; n++)
+      for (auto& c : dag->children(n)) {
+        *dV[c.second] += dot(node(h, c.first).T(), node(dh, n));
+        node(dh, c.first) += dot(node(dh, n), V[c.second]->T());
+      }
+  });
+  return 1 / secs;
+}
+
+int main(int argc, char** argv) {
+  InitTensorEngine<cpu>();
+  uint runs = argc > 1 ? std::stoi(argv[1]) : 3;
+
+  bench::header("trees/s", {"balanced", "left"});
+  auto b = balanced(63), lb = left_branching(39);
+  bench::row("recursive(50, 2)", {layer_speed(b, 25, runs),
+                                  layer_speed(lb, 25, runs)});
+  bench::row("gemms, per node", {per_node_gemm_speed(b, 25, runs),
+                                 per_node_gemm_speed(lb, 25, runs)});
+
+  ShutdownTensorEngine<cpu>();
+  return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef MILK_EXAMPLES_BENCH_H
+#define MILK_EXAMPLES_BENCH_H
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include "../milk.h"
+
+/* Shared pieces of the bench-* programs. Data is synthetic but shaped like
+ * that of the examples, so no dataset is needed. Everything runs on cpu;
+ * build them like the examples (mshadow on the include path, a cblas linked)
+ * with optimizations on. Timings are the best of a few runs after a warm-up.
+ */
+
+namespace milk {
+namespace bench {
+
+// seconds of the fastest of runs calls of f, after a warm-up call
+inline double best_of(uint runs, std::function<void()> f) {
+  f();
+  double best = std::numeric_limits<double>::max();
+  for (uint r=0; r<runs; r++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    best = std::min(best, d.count());
+  }
+  return best;
+}
+
+// peak resident set size of this process so far, in MB
+inline double peak_rss() {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss / 1024.; // kB on linux
+}
+
+// runs f in a child process and waits for it, so that the peak_rss() of f
+// does not include what earlier runs allocated
+inline void in_child(std::function<void()> f) {
+  std::cout << std::flush;
+  pid_t pid = fork();
+  if (pid == 0) {
+    f();
+    std::cout << std::flush;
+    std::_Exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+// n rows of dim features in [-1, 1] with labels below classes, batched by
+// bs (e.g. mnist: 784 features, 10 classes)
+inline void dense_data(std::vector<Data<cpu>>* X, std::vector<Data<cpu>>* Y,
+                       uint n, uint dim, uint classes, uint bs) {
+  MatrixContainer<cpu> X_(Shape2(n, dim)), Y_(Shape2(n, 1));
+  mshadow::Random<cpu, Real>(0).SampleUniform(&X_, -1., 1.);
+  for (uint i=0; i<n; i++) Y_[i][0] = std::rand() % classes;
+  *X = to_data(X_, bs);
+  *Y = to_data(Y_, bs);
+}
+
+// n sentences of word ids below vocab, with lengths in [min_len, max_len]
+// and a label below classes each (e.g. sstb: 5 classes)
+inline void sent_data(std::vector<Data<cpu>>* X, std::vector<Data<cpu>>* Y,
+                      uint n, uint min_len, uint max_len, uint vocab,
+                      uint classes) {
+  X->resize(n);
+  Y->resize(n);
+  for (uint j=0; j<n; j++) {
+    (*X)[j].init(min_len + std::rand() % (max_len - min_len + 1), 1);
+    for (uint t=0; t<(*X)[j].len(); t++) (*X)[j]()[t][0] = std::rand() % vocab;
+    (*Y)[j].init(1, 1);
+    (*Y)[j]()[0][0] = std::rand() % classes;
+  }
+}
+
+// a results table: the header, then rows of a name and values in columns
+inline void header(const std::string& name,
+                   const std::vector<std::string>& columns) {
+  std::cout << std::left << std::setw(28) << name << std::right;
+  for (auto& c : columns) std::cout << std::setw(12) << c;
+  std::cout << std::endl;
+}
+
+inline void row(const std::string& name, const std::vector<double>& values) {
+  std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+            << std::setprecision(1);
+  for (auto v : values) std::cout << std::setw(12) << v;
+  std::cout << std::endl;
+}
+
+} // end namespace bench
+} // end namespace milk
+
+#endif
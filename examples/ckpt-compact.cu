@@ -0,0 +1,18 @@
+#include <iostream>
+#include "../milk.h"
+
+using namespace milk;
+
+// merges a chain of delta checkpoints (save_delta) into one full checkpoint:
+//   ckpt-compact model.delta5 model.full
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " in.ckpt out.ckpt" << std::endl;
+    return 1;
+  }
+  uint chain = 0;
+  for (std::string f = argv[1]; !f.empty(); f = ckpt_file(f).base) chain++;
+  compact_checkpoint(argv[1], argv[2]);
+  std::cout << chain << " checkpoints merged into " << argv[2] << std::endl;
+  return 0;
+}
@@ -0,0 +1,22 @@
+#include <iostream>
+#include "../milk.h"
+
+using namespace milk;
+
+// runs n ranks of a training program that uses make_comm (e.g. through
+// dist_trainer) on this machine, over shared memory or tcp loopback:
+//   launch 4 shm ./mnist
+//   launch 4 tcp ./sstb-lstm data/
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cerr << "usage: " << argv[0] << " n shm|tcp program [args]" << std::endl;
+    return 1;
+  }
+  uint failed = launch(std::stoi(argv[1]), [&](uint rank) {
+    execvp(argv[3], argv + 3);
+    std::cerr << "cannot run " << argv[3] << std::endl;
+    return 127;
+  }, argv[2]);
+  if (failed) std::cerr << failed << " ranks failed" << std::endl;
+  return failed ? 1 : 0;
+}
@@ -5,6 +5,8 @@
 using namespace milk;
 using namespace milk::factory;
 
+// records made by rec-convert (next to the text) load from a mapping instead:
+//   rec-convert table ../../data/mnist 1 784 ../../data/mnist/mnist_*.txt
 void mnist_reader(std::string fname,
                   std::vector<Data<gpu>>* X,
                   std::vector<Data<gpu>>* Y,
@@ -12,12 +14,17 @@ void mnist_reader(std::string fname,
                   uint batch_size = 1) {
   MatrixContainer<cpu> X_(Shape2(rows, 784));
   MatrixContainer<cpu> Y_(Shape2(rows, 1));
-  std::ifstream in(fname.c_str());
-  assert(in.is_open());
-  for (uint i=0; i<rows; i++) {
-    in >> Y_[i][0];
-    for (uint j=0; j<784; j++)
-      in >> X_[i][j];
+  std::string rec = fname.substr(0, fname.rfind('.')) + ".rec";
+  if (std::ifstream(rec).good()) {
+    std::vector<Data<cpu>> Xr, Yr; // a row each
+    read_records<cpu>({rec}, {&Xr, &Yr});
+    assert(Xr.size() == rows);
+    for (uint i=0; i<rows; i++) {
+      Copy(X_[i], Xr[i]()[0]);
+      Copy(Y_[i], Yr[i]()[0]);
+    }
+  } else {
+    read_labeled_table(fname, &X_, &Y_);
   }
   X_ *= (1./256.);
   paired_shuffle<cpu>({X_, Y_});
@@ -19,12 +19,14 @@ std::vector<Real> Fscore(std::shared_ptr<layer::layer<xpu>> layers,
                          Real label_pad_value) {
   timer::tic("F score");
   ds->set_data({&sents, &labels});
+  layers->set_mode(TEST);
+  memplan<xpu> plan(layers); // activations share slabs, see memplan
   uint nExprPredicted = 0;
   uint nExprTrue = 0;
   Real precNumerProp = 0, precNumerBin = 0;
   Real recallNumerProp = 0, recallNumerBin = 0;
   for (uint i=0; i<sents.size(); i++) { // per sentence batch
-    layers->forward();
+    plan.forward();
 
     auto& ds_x = ds->x[0];
     auto& ds_y = ds->x[1];
@@ -135,6 +137,10 @@ std::vector<Real> Fscore(std::shared_ptr<layer::layer<xpu>> layers,
       }
     }
   }
+  static bool printed = false;
+  if (!printed) { std::cout << "Test "; plan.print(); printed = true; }
+  plan.release();
+  layers->set_mode(TRAIN);
   Real precisionProp = (nExprPredicted==0) ? 1 : precNumerProp/nExprPredicted;
   Real recallProp = (nExprTrue==0) ? 1 : recallNumerProp/nExprTrue;
   Real f1Prop = (precisionProp+recallProp) == 0 ? 0 :
@@ -208,7 +214,15 @@ int main(int argc, char **argv) {
   std::string datadir = "../../data/mpqa/";
 
   std::vector<Data<cpu>> X, T;
-  readSentences(X, T, w2i, i2w, y2i, i2y, datadir+"dse.txt"); // dse.txt or ese.txt
+  // records made by rec-convert load from a mapping instead:
+  //   rec-convert tagged ../../data/mpqa ../../data/mpqa/dse.txt
+  if (std::ifstream(datadir+"vocab.txt").good()) {
+    read_vocab(datadir+"vocab.txt", &w2i, &i2w);
+    read_vocab(datadir+"tags.txt", &y2i, &i2y);
+    read_records<cpu>({datadir+"dse.rec"}, {&X, &T});
+  } else {
+    readSentences(X, T, w2i, i2w, y2i, i2y, datadir+"dse.txt"); // dse.txt or ese.txt
+  }
 
   std::unordered_map<std::string, std::set<uint> > sentenceIds;
   std::set<std::string> allDocs;
@@ -313,12 +327,14 @@ int main(int argc, char **argv) {
 
 
   trainer<gpu> t(ds, nn);
+  t.plan_memory = true; // only to print the train plan, which saves nothing here
 
   for (uint ep=0; ep <100; ep++) {   // training loop
     ds->set_data({&trainXb, &trainLb});
     timer::tic("train");
     Real running_err = t.train({&trainXb, &trainLb});
     timer::toc("train");
+    if (ep == 0) { std::cout << "Train "; t.plan->print(); }
 
     if ((ep+1) % 5 == 0) {
       std::cout << "Epoch " << ep << std::endl;
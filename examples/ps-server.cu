@@ -0,0 +1,24 @@
+#include <iostream>
+#include "../milk.h"
+
+using namespace milk;
+
+// one shard of a parameter server (utils/ps.h) for a [rows x dim] proj table,
+// trained with lazy rmsprop, listening on the port of its MILK_PS_HOSTS entry:
+//   ps-server shard K rows dim workers [staleness [out.ckpt]]
+// out.ckpt, if given, gets the rows of the shard once all workers are done.
+int main(int argc, char** argv) {
+  if (argc < 6) {
+    std::cerr << "usage: " << argv[0]
+              << " shard K rows dim workers [staleness [out.ckpt]]" << std::endl;
+    return 1;
+  }
+  uint shard = std::stoi(argv[1]), K = std::stoi(argv[2]);
+  uint staleness = argc > 6 ? std::stoi(argv[6]) : 0;
+  ps_server srv(shard, K, std::stoi(argv[3]), std::stoi(argv[4]),
+                std::stoi(argv[5]), staleness);
+  srv.set_updater(std::make_shared<lazy_rmsprop<cpu>>());
+  srv.serve(port_of(ps_hosts(K)[shard]));
+  if (argc > 7) save_checkpoint(std::vector<Weight<cpu>*>{&srv.W}, argv[7]);
+  return 0;
+}
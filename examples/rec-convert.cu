@@ -0,0 +1,163 @@
+#include <iostream>
+#include <queue>
+#include "../milk.h"
+
+using namespace milk;
+
+typedef std::unordered_map<std::string, uint> vocab;
+
+// converts text datasets to record files (utils/records.h), one example per
+// record, that read_records loads from a mapping or stream_datastream reads:
+//   rec-convert table  out_dir ylen xlen in.txt..  ylen labels, then xlen
+//                                                  features per line (mnist)
+//   rec-convert tree   out_dir in.txt..            sst trees (sstb-rsv.cu)
+//   rec-convert sent   out_dir in.txt..            sentence \t label per line
+//                                                  (sstb-lstm.cu)
+//   rec-convert tagged out_dir in.txt..            token \t pos \t tag per line,
+//                                                  sentences end at blank
+//                                                  lines (mpqa.cu)
+// dir/in.txt becomes out_dir/in.rec. word (and tag) indices are shared by the
+// inputs, in order, and saved to out_dir/vocab.txt (and out_dir/tags.txt).
+
+uint index_of(const std::string& w, vocab* w2i, std::vector<std::string>* i2w) {
+  auto it = w2i->find(w);
+  if (it != w2i->end()) return it->second;
+  (*w2i)[w] = i2w->size();
+  i2w->push_back(w);
+  return i2w->size() - 1;
+}
+
+Data<cpu> column(const std::vector<uint>& v) {
+  Data<cpu> d(v.size(), 1);
+  for (uint t=0; t<v.size(); t++) d()[t][0] = v[t];
+  return d;
+}
+
+std::vector<std::string> split_outermost(const std::string &s) {
+  std::vector<std::string> v;
+  std::string running;
+  int ctr = 0;
+  for (uint i=0; i<s.size(); i++) {
+    char c = s[i];
+    if (c == '(') { ctr++; running.push_back(c); }
+    else if (c == ')') { ctr--; running.push_back(c); }
+    else if (isspace(c) and ctr == 0) {
+      v.push_back(running);
+      running = "";
+    }
+    else { running.push_back(c); }
+  }
+  v.push_back(running);
+  return v;
+}
+
+// as read_tree in sstb-rsv.cu: nodes breadth first, internal nodes get word 0
+void convert_tree(const std::string& line, record_writer& out, vocab* w2i,
+                  std::vector<std::string>* i2w) {
+  auto dag = std::make_shared<sdag>();
+  std::vector<uint> words, labels;
+  std::queue<std::pair<uint, std::string>> q;
+  q.push(std::make_pair((uint)0, line));
+  uint id = 1;
+  while (q.size() > 0) {
+    auto p = q.front(); q.pop();
+    auto& s = p.second;
+    assert(s.front() == '(' and s.back() == ')');
+    auto v = split_outermost(s.substr(1, s.size()-2));
+    labels.push_back(std::stoi(v[0]));
+    if (v.size() == 3) { // internal with two children
+      words.push_back(0);
+      dag->adj_list.push_back({std::make_pair(id, 0), std::make_pair(id+1, 1)});
+      q.push(std::make_pair(id, v[1]));
+      q.push(std::make_pair(id+1, v[2]));
+      id += 2;
+    } else { // leaf
+      assert(v.size() == 2);
+      words.push_back(index_of(v[1], w2i, i2w));
+      dag->adj_list.push_back({});
+    }
+  }
+  std::vector<Data<cpu>> rec = {column(words), column(labels)};
+  rec[0].dag = rec[1].dag = dag;
+  out.write(rec);
+}
+
+void convert(const std::string& format, const std::string& in_name,
+             record_writer& out, uint ylen, uint xlen, vocab* w2i,
+             std::vector<std::string>* i2w, vocab* t2i,
+             std::vector<std::string>* i2t) {
+  std::ifstream in(in_name);
+  assert(in.is_open());
+  std::string line;
+  std::vector<uint> words, tags;
+  auto flush = [&]() { // a tagged sentence
+    if (words.empty()) return;
+    std::vector<Data<cpu>> rec = {column(words), column(tags)};
+    out.write(rec);
+    words.clear(); tags.clear();
+  };
+  while (std::getline(in, line)) {
+    if (format == "table") {
+      if (is_whitespace(line)) continue;
+      const char* p = line.data();
+      const char* end = p + line.size();
+      std::vector<Data<cpu>> rec = {Data<cpu>(1, xlen), Data<cpu>(1, ylen)};
+      for (uint j=0; j<ylen; j++) rec[1]()[0][j] = parse_real(p, end);
+      for (uint j=0; j<xlen; j++) rec[0]()[0][j] = parse_real(p, end);
+      out.write(rec);
+    } else if (format == "tree") {
+      if (!is_whitespace(line)) convert_tree(line, out, w2i, i2w);
+    } else if (format == "sent") {
+      if (is_whitespace(line)) continue;
+      auto v = split(line, '\t');
+      for (auto& w : split(v[0], ' ')) words.push_back(index_of(w, w2i, i2w));
+      std::vector<Data<cpu>> rec = {column(words), column({(uint)std::stoi(v[1])})};
+      out.write(rec);
+      words.clear();
+    } else { // tagged
+      if (is_whitespace(line)) { flush(); continue; }
+      auto v = split(line, '\t');
+      assert(v.size() == 3);
+      words.push_back(index_of(v[0], w2i, i2w));
+      tags.push_back(index_of(v[2], t2i, i2t));
+    }
+  }
+  flush();
+}
+
+int main(int argc, char** argv) {
+  std::string format = argc > 1 ? argv[1] : "";
+  uint first = (format == "table") ? 5 : 3;
+  if ((format != "table" and format != "tree" and format != "sent" and
+       format != "tagged") or (uint)argc < first + 1) {
+    std::cerr << "usage: " << argv[0] << " table out_dir ylen xlen in.txt..\n"
+              << "       " << argv[0] << " tree|sent|tagged out_dir in.txt.."
+              << std::endl;
+    return 1;
+  }
+  std::string out_dir = argv[2];
+  uint ylen = 0, xlen = 0;
+  if (format == "table") { ylen = std::stoi(argv[3]); xlen = std::stoi(argv[4]); }
+
+  vocab w2i, t2i;
+  std::vector<std::string> i2w, i2t;
+  if (format == "tree") { // as sstb-rsv.cu
+    i2w.push_back("**");
+    w2i[""] = 0;
+  }
+  std::vector<record_kind> kinds = {REC_IDS, REC_IDS};
+  if (format == "table") kinds = {REC_DENSE, REC_DENSE};
+
+  for (int a=first; a<argc; a++) {
+    std::string in = argv[a];
+    std::string base = in.substr(in.rfind('/') + 1);
+    std::string out_name = out_dir + "/" + base.substr(0, base.rfind('.')) + ".rec";
+    record_writer out(out_name, 2, kinds);
+    convert(format, in, out, ylen, xlen, &w2i, &i2w, &t2i, &i2t);
+    std::cout << in << ": " << out.count << " records in " << out_name
+              << std::endl;
+  }
+  if (format != "table") write_vocab(out_dir + "/vocab.txt", i2w);
+  if (format == "tagged") write_vocab(out_dir + "/tags.txt", i2t);
+  return 0;
+}
@@ -47,17 +47,28 @@ int main() {
 
   std::cout << "reading..." << std::endl;
 
-  sstb_reader("../../data/sstb_flat/train_root.txt", &X,     &Y,     &w2i, &i2w);
-  sstb_reader("../../data/sstb_flat/dev_root.txt",   &Xdev,  &Ydev,  &w2i, &i2w);
-  sstb_reader("../../data/sstb_flat/test_root.txt",  &Xtest, &Ytest, &w2i, &i2w);
+  // records made by rec-convert load from a mapping instead:
+  //   rec-convert sent ../../data/sstb_flat ../../data/sstb_flat/*_root.txt
+  std::string dir = "../../data/sstb_flat/";
+  if (std::ifstream(dir + "vocab.txt").good()) {
+    read_vocab(dir + "vocab.txt", &w2i, &i2w);
+    read_records<cpu>({dir + "train_root.rec"}, {&X,     &Y});
+    read_records<cpu>({dir + "dev_root.rec"},   {&Xdev,  &Ydev});
+    read_records<cpu>({dir + "test_root.rec"},  {&Xtest, &Ytest});
+  } else {
+    sstb_reader(dir + "train_root.txt", &X,     &Y,     &w2i, &i2w);
+    sstb_reader(dir + "dev_root.txt",   &Xdev,  &Ydev,  &w2i, &i2w);
+    sstb_reader(dir + "test_root.txt",  &Xtest, &Ytest, &w2i, &i2w);
+  }
 
   uint N = w2i.size();
 
   std::cout << "batching..." << std::endl;
 
-  batch_seq_single_label(&Xb, &Yb, X, Y, N, batch_size);
-  batch_seq_single_label(&Xbdev, &Ybdev, Xdev, Ydev, N, batch_size);
-  batch_seq_single_label(&Xbtest, &Ybtest, Xtest, Ytest, N, batch_size);
+  // packed: no pad rows, lstm only runs over the sequences still active
+  batch_seq_single_label(&Xb, &Yb, X, Y, N, batch_size, false, true);
+  batch_seq_single_label(&Xbdev, &Ybdev, Xdev, Ydev, N, batch_size, false, true);
+  batch_seq_single_label(&Xbtest, &Ybtest, Xtest, Ytest, N, batch_size, false, true);
 
   auto ds = datastream(2);
   auto wv = proj(300, N+1);
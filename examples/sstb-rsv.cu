@@ -116,14 +116,18 @@ Real root_error(std::vector<std::vector<Data<gpu>>*> dataset,
                 std::shared_ptr<layer::layer<gpu>> nn,
                 std::shared_ptr<layer::smax_xent<gpu>> top) {
   nn->set_mode(TEST);
+  memplan<gpu> plan(nn);
   Real err=0, tot=0;
   do {
-    nn->forward();
-    VectorContainer<gpu> equals(Shape1(top->h.batch_size));
-    eq(equals, vec(top->c(0)), vec(top->y(0)));
-    err += top->h.batch_size - sum(equals);
-    tot += top->h.batch_size;
+    plan.forward();
+    MatrixContainer<cpu> c(top->c().shape_), y(top->y().shape_);
+    Copy(c, top->c()); Copy(y, top->y());
+    for (auto r : top->y.in->dag->root_nodes()) { // one per tree in the forest
+      err += (c[r][0] != y[r][0]);
+      tot++;
+    }
   } while (ds->count != 0);
+  plan.release();
   return err/tot;
 }
 
@@ -137,15 +141,32 @@ int main() {
 
   std::cout << "reading..." << std::endl;
 
-  i2w.push_back("**");
-  w2i[""] = 0;
-
-  sstb_reader("../../data/sstb/trees/train.txt", &X,     &Y,     &w2i, &i2w);
-  sstb_reader("../../data/sstb/trees/dev.txt",   &Xdev,  &Ydev,  &w2i, &i2w);
-  sstb_reader("../../data/sstb/trees/test.txt",  &Xtest, &Ytest, &w2i, &i2w);
+  // records made by rec-convert load from a mapping instead:
+  //   rec-convert tree ../../data/sstb/trees ../../data/sstb/trees/*.txt
+  std::string dir = "../../data/sstb/trees/";
+  if (std::ifstream(dir + "vocab.txt").good()) {
+    read_vocab(dir + "vocab.txt", &w2i, &i2w);
+    read_records<gpu>({dir + "train.rec"}, {&X,     &Y});
+    read_records<gpu>({dir + "dev.rec"},   {&Xdev,  &Ydev});
+    read_records<gpu>({dir + "test.rec"},  {&Xtest, &Ytest});
+  } else {
+    i2w.push_back("**");
+    w2i[""] = 0;
+
+    sstb_reader(dir + "train.txt", &X,     &Y,     &w2i, &i2w);
+    sstb_reader(dir + "dev.txt",   &Xdev,  &Ydev,  &w2i, &i2w);
+    sstb_reader(dir + "test.txt",  &Xtest, &Ytest, &w2i, &i2w);
+  }
 
   uint N = w2i.size();
 
+  std::cout << "batching..." << std::endl;
+
+  uint batch_size = 25; // trees per forest
+  std::vector<Data<gpu>> Xb, Yb, Xbdev, Ybdev;
+  batch_trees(&Xb, &Yb, X, Y, batch_size);
+  batch_trees(&Xbdev, &Ybdev, Xdev, Ydev, batch_size);
+
   auto ds = datastream(2);
   auto wv = proj(300, N+1);
   auto top = smax_xent();
@@ -165,12 +186,13 @@ int main() {
   nn->set_la(1e-5);
 
   trainer<gpu> t(ds, nn);
+  t.plan_memory = true;
 
   for (uint ep=0; ep<30; ep++) {
-    t.train({&X, &Y});
-    std::cout << 1.-t.mean_error({&X, &Y}) << "\t";
-    std::cout << 1.-t.mean_error({&Xdev, &Ydev}) << "\t";
-    std::cout << 1.-root_error({&Xdev, &Ydev}, ds, nn, top) << std::endl;
+    t.train({&Xb, &Yb});
+    std::cout << 1.-t.mean_error({&Xb, &Yb}) << "\t";
+    std::cout << 1.-t.mean_error({&Xbdev, &Ybdev}) << "\t";
+    std::cout << 1.-root_error({&Xbdev, &Ybdev}, ds, nn, top) << std::endl;
   }
 
   ShutdownTensorEngine<gpu>();
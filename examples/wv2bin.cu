@@ -0,0 +1,18 @@
+#include <iostream>
+#include "../milk.h"
+
+using namespace milk;
+
+// converts a text word vector table (e.g. GloVe) to the binary format that
+// load_wv_table_bin and proj::map read:
+//   wv2bin glove.840B.300d.txt glove.840B.300d.bin 300
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    std::cerr << "usage: " << argv[0] << " in.txt out.bin dim" << std::endl;
+    return 1;
+  }
+  convert_wv_table(argv[1], argv[2], std::stoi(argv[3]));
+  wv_file f(argv[2]);
+  std::cout << f.header.rows << " x " << f.header.dim << std::endl;
+  return 0;
+}
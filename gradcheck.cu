@@ -1,6 +1,7 @@
 #define Real double
 #define MilkDefaultDev cpu
 #include "milk.h"
+#include <set>
 
 using namespace milk;
 using namespace milk::factory;
@@ -68,7 +69,9 @@ Stats check_grad_wrt(std::shared_ptr<ltype<xpu>> l,
 }
 
 template <typename xpu, template <typename> class ltype>
-void check_grad(std::shared_ptr<ltype<xpu>> l, uint verbosity=0) {
+void check_grad(std::shared_ptr<ltype<xpu>> l, uint verbosity=0,
+                std::shared_ptr<packing> pack=nullptr,
+                std::shared_ptr<sdag> dag=nullptr) {
   uint xdim = 4;
   uint T = 5;
   uint bs = 2;
@@ -78,10 +81,12 @@ void check_grad(std::shared_ptr<ltype<xpu>> l, uint verbosity=0) {
 
   for (uint i=0; i<ins.size(); i++) {
     auto& x = xs[i];
-    x.init(bs*T,xdim);
+    x.init(pack ? pack->rows() : dag ? dag->size() : bs*T, xdim);
     mshadow::Random<xpu, Real>(i).SampleUniform(&(x()), -10., 10.);
     x.reset_grad();
-    x.batch_size = bs;
+    x.batch_size = pack ? pack->sizes[0] : dag ? 1 : bs;
+    x.pack = pack;
+    x.dag = dag;
     ins[i]->connect_from(x);
   }
 
@@ -197,6 +202,1126 @@ std::cout << "Checking " << #layer << std::endl;             \
 check_grad(layer, verbosity);                                \
 std::cout << std::endl;                                      \
 
+// same with a packed batch of three sequences of lengths 5, 3 and 2
+#define CHECK_GRAD_PACKED(layer)                             \
+std::cout << "Checking packed " << #layer << std::endl;      \
+check_grad(layer, verbosity,                                 \
+           std::make_shared<packing>(std::vector<uint>{5,3,2})); \
+std::cout << std::endl;                                      \
+
+// lookups through a mapped binary table (proj::map) and through
+// load_wv_table_bin match the ones after load_wv_table from text
+void check_mapped_proj() {
+  std::string txt = "/tmp/milk_gradcheck_wv.txt", bin = "/tmp/milk_gradcheck_wv.bin";
+  {
+    std::ofstream out(txt);
+    out << "the 0.5 -1.25 3\nof 1e-3 2 -0.75\n, 4 5.5 -6\nand 0 0.1 0.2\n";
+  }
+  convert_wv_table(txt, bin, 3);
+  auto f = std::make_shared<wv_file>(bin);
+
+  auto l_txt = proj<cpu>(3, 4), l_bin = proj<cpu>(3, 4), l_map = proj<cpu>(3, 4);
+  l_txt->init(); l_bin->init();
+  load_wv_table(txt, 3, &(l_txt->W()), f->w2i);
+  load_wv_table_bin(bin, &(l_bin->W()), f->w2i);
+  l_map->map(f);
+
+  std::vector<std::string> words = {",", "the", "and", "of", "the"};
+  Data<cpu> x(words.size(), 1);
+  for (uint i=0; i<words.size(); i++) x()[i][0] = f->w2i[words[i]];
+
+  Stats s;
+  for (auto l : {l_bin, l_map}) {
+    l_txt->x.connect_from(x); l->x.connect_from(x);
+    l_txt->forward(); l->forward();
+    for (uint i=0; i<x().size(0); i++)
+      for (uint j=0; j<3; j++) s.accumulate(l_txt->h()[i][j], l->h()[i][j]);
+  }
+
+  // a read-only mapping stays frozen through set_lr and a training step, a
+  // copy_on_write one trains without touching the file
+  auto f_cow = std::make_shared<wv_file>(bin, true);
+  auto l_cow = proj<cpu>(3, 4);
+  l_map->map(f);
+  l_cow->map(f_cow);
+  for (auto l : {l_map, l_cow}) {
+    l->set_lr(0.1);
+    l->x.connect_from(x);
+    l->forward();
+    l->h.d() = 1.;
+    l->backward();
+    l->update();
+  }
+  Real moved = 0;
+  for (uint i=0; i<4; i++)
+    for (uint j=0; j<3; j++) {
+      s.accumulate(l_bin->W()[i][j], l_map->W()[i][j]);
+      s.accumulate(l_bin->W()[i][j], wv_file(bin).table()[i][j]);
+      moved += std::abs(l_cow->W()[i][j] - l_bin->W()[i][j]);
+    }
+  assert(moved > 0);
+
+  // a short row or an overlong number is an error, not a 0 or two numbers
+  std::vector<std::string> bad = {"the 0.5 -1.25\n",
+                                  "the 0.5 -1.25 3" + std::string(70, '0') + "\n"};
+  for (auto& line : bad) {
+    {
+      std::ofstream out(txt);
+      out << "of 1e-3 2 -0.75\n" << line;
+    }
+    bool threw = false;
+    try {
+      load_wv_table(txt, 3, &(l_txt->W()), f->w2i);
+    } catch (const std::runtime_error&) { threw = true; }
+    assert(threw);
+  }
+  s.print();
+}
+
+// a checkpoint of params in the version 1 layout (no deltas)
+void write_checkpoint_v1(const std::vector<Weight<cpu>*>& params,
+                         const std::string& fname) {
+  std::vector<Matrix<cpu>> m;
+  std::vector<ckpt_entry_v1> table;
+  for (uint k=0; k<params.size(); k++) {
+    m.push_back((*params[k])());
+    table.push_back({0, 0, 0, k, 0, 0});
+    auto hist = params[k]->u->history();
+    for (uint r=0; r<hist.size(); r++) {
+      m.push_back(*hist[r]);
+      table.push_back({0, 0, 0, k, r+1, 0});
+    }
+  }
+  ckpt_header_v1 hdr;
+  std::memcpy(hdr.magic, ckpt_magic, sizeof(hdr.magic));
+  hdr.version = 1; hdr.real_size = sizeof(Real);
+  hdr.num_tensors = table.size(); hdr.arch_bytes = 0;
+  hdr.table_offset = sizeof(hdr);
+  uint64_t offset = hdr.table_offset + table.size() * sizeof(ckpt_entry_v1);
+  for (uint i=0; i<m.size(); i++) {
+    auto& e = table[i];
+    e.rows = m[i].size(0); e.cols = m[i].size(1);
+    e.offset = offset = align_ckpt(offset);
+    e.checksum = checksum(m[i].dptr_, e.rows * e.cols * sizeof(Real));
+    offset += e.rows * e.cols * sizeof(Real);
+  }
+  hdr.table_checksum = checksum(table.data(), table.size() * sizeof(ckpt_entry_v1));
+  std::ofstream out(fname, std::ios::binary);
+  out.write((const char*)&hdr, sizeof(hdr));
+  out.write((const char*)table.data(), table.size() * sizeof(ckpt_entry_v1));
+  for (uint i=0; i<m.size(); i++) {
+    out.seekp(table[i].offset);
+    out.write((const char*)m[i].dptr_, m[i].size(0) * m[i].size(1) * sizeof(Real));
+  }
+}
+
+// binary checkpoints (also of version 1) load to the exact values and
+// updater histories, also when saved over the file they were loaded from,
+// and corrupted ones or ones of another updater are rejected. text files
+// load to within their printed precision.
+void check_checkpoint() {
+  std::string txt = "/tmp/milk_gradcheck_params.txt";
+  std::string bin = "/tmp/milk_gradcheck_params.bin";
+  std::string v1 = "/tmp/milk_gradcheck_params_v1.bin";
+  auto l = ff(3) >> lstm(2);
+  Data<cpu> x; // random inputs drive one step of updates
+  x.init(4, 2);
+  mshadow::Random<cpu, Real>(0).SampleUniform(&(x()), -1., 1.);
+  l->ins()[0]->connect_from(x);
+  l->forward();
+  l->outs()[0]->d() = 1.;
+  l->backward();
+  l->update();
+  {
+    std::ofstream out(txt);
+    l->save_params(out);
+  }
+  l->save_params(bin);
+
+  auto l_txt = ff(3) >> lstm(2), l_bin = ff(3) >> lstm(2);
+  auto l_again = ff(3) >> lstm(2), l_v1 = ff(3) >> lstm(2);
+  write_checkpoint_v1(l->params(), v1);
+  l_v1->load_params(v1);
+  l_txt->load_params(txt);
+  l_bin->load_params(bin);
+  l_bin->save_params(bin); // l_bin aliases the mapping of bin on cpu
+  l_again->load_params(bin);
+
+  auto values = [](std::shared_ptr<layer::layer<cpu>> l) {
+    std::vector<Matrix<cpu>> m;
+    for (auto W : l->params()) {
+      m.push_back((*W)());
+      for (auto h : W->u->history()) m.push_back(*h);
+    }
+    return m;
+  };
+  Stats s_bin, s_txt;
+  auto m = values(l), m_txt = values(l_txt), m_bin = values(l_bin),
+       m_again = values(l_again), m_v1 = values(l_v1);
+  for (uint n=0; n<m.size(); n++)
+    for (uint i=0; i<m[n].size(0); i++)
+      for (uint j=0; j<m[n].size(1); j++) {
+        s_bin.accumulate(m[n][i][j], m_bin[n][i][j]);
+        s_bin.accumulate(m[n][i][j], m_again[n][i][j]);
+        s_bin.accumulate(m[n][i][j], m_v1[n][i][j]);
+        s_txt.accumulate(m[n][i][j], m_txt[n][i][j]);
+      }
+  std::cout << "Binary ";
+  s_bin.print();
+  assert(s_bin.max_abs_diff == 0);
+  std::cout << "Text ";
+  s_txt.print();
+
+  {
+    std::fstream f(bin, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekg(0, std::ios::end);
+    f.seekp((uint)f.tellg() - 1); // in the last tensor
+    f.put('x');
+  }
+  bool rejected = false;
+  try { l_again->load_params(bin); } catch (std::runtime_error&) { rejected = true; }
+  assert(rejected);
+
+  auto l_adam = ff(3) >> lstm(2); // two histories per Weight, not one
+  l_adam->set_updater<adam<cpu>>();
+  rejected = false;
+  try { l_adam->load_params(v1); } catch (std::runtime_error&) { rejected = true; }
+  assert(rejected);
+}
+
+// proj rows (and row clock rows) in the delta at fname, besides the steps
+std::set<uint64_t> delta_rows(const std::string& fname, uint64_t size) {
+  ckpt_file f(fname);
+  std::set<uint64_t> rows;
+  for (uint i=0; i<f.table.size(); i++) {
+    if (f.table[i].weight != 0) continue;
+    assert(f.table[i].index_offset);
+    for (uint r=0; r<f.table[i].rows; r++)
+      if (f.rows(i)[r] < size) rows.insert(f.rows(i)[r]);
+  }
+  return rows;
+}
+
+// a full checkpoint followed by deltas of the proj rows that changed loads
+// to the same params as a full checkpoint, and so does its compaction. each
+// delta has just the rows updated since its base, though lazy_rmsprop has
+// stale rows from before.
+void check_delta_checkpoint() {
+  std::string full = "/tmp/milk_gradcheck_full.bin";
+  std::string delta = "/tmp/milk_gradcheck_delta.bin";
+  std::string compact = "/tmp/milk_gradcheck_compact.bin";
+  std::string last = "/tmp/milk_gradcheck_last.bin";
+  auto make = []() {
+    auto l = proj(3, 50) >> ff(2);
+    l->set_updater<lazy_rmsprop<cpu>>();
+    return l;
+  };
+  auto l = make();
+  Data<cpu> x;
+  x.init(4, 1);
+  l->ins()[0]->connect_from(x);
+  std::set<uint64_t> rows;
+  auto step = [&](uint k) {
+    for (uint i=0; i<4; i++) rows.insert(x()[i][0] = (7 * k + 11 * i) % 50);
+    l->forward();
+    l->outs()[0]->d() = 1.;
+    l->backward();
+    l->update();
+  };
+  step(0);
+  l->save_params(full);
+  rows.clear();
+  step(1); step(2);
+  save_delta(l->params(), delta + "0", full);
+  assert(delta_rows(delta + "0", 50) == rows);
+  rows.clear();
+  step(3);
+  save_delta(l->params(), delta, delta + "0");
+  assert(delta_rows(delta, 50) == rows);
+  compact_checkpoint(delta, compact);
+  l->save_params(last);
+
+  Stats s;
+  auto l_last = make(), l_delta = make(), l_compact = make();
+  l_last->load_params(last);
+  l_delta->load_params(delta);
+  l_compact->load_params(compact);
+  auto P = l_last->params();
+  for (auto l_ : {l_delta, l_compact}) {
+    auto Q = l_->params();
+    for (uint k=0; k<P.size(); k++) {
+      Q[k]->u->sync((*Q[k])()); // as save_params did for last
+      std::vector<Matrix<cpu>> m = {(*P[k])()}, n = {(*Q[k])()};
+      for (auto h : P[k]->u->history()) m.push_back(*h);
+      for (auto h : Q[k]->u->history()) n.push_back(*h);
+      for (uint t=0; t<m.size(); t++)
+        for (uint i=0; i<m[t].size(0); i++)
+          for (uint j=0; j<m[t].size(1); j++)
+            s.accumulate(m[t][i][j], n[t][i][j]);
+    }
+  }
+  s.print();
+}
+
+// all-reduce of 3 forked ranks, in more pieces than fit the shm slots, and
+// over tcp in uneven ring chunks, of Reals and of uint64s past 2^32 (exact).
+// prints the number of ranks that got a wrong sum (or crashed).
+void check_allreduce(std::string backend) {
+  uint failed = launch(3, [&](uint rank) {
+    std::shared_ptr<comm> c;
+    if (backend == "shm")
+      c = std::make_shared<shm_comm>(env_or("MILK_SHM_NAME", ""), rank, 3, 64);
+    else
+      c = make_comm();
+    std::vector<Real> v(1001);
+    for (uint i=0; i<v.size(); i++) v[i] = rank * 1000. + i;
+    c->allreduce(v.data(), v.size());
+    for (uint i=0; i<v.size(); i++) if (v[i] != 3000. + 3*i) return 1;
+    std::vector<uint64_t> u(1001);
+    for (uint i=0; i<u.size(); i++) u[i] = (uint64_t(rank) << 32) + (1u << 25) + i;
+    c->allreduce(u.data(), u.size());
+    for (uint i=0; i<u.size(); i++)
+      if (u[i] != (uint64_t(3) << 32) + 3 * ((1u << 25) + i)) return 1;
+    return 0;
+  }, backend);
+  std::cout << "Failed ranks: " << failed << std::endl;
+}
+
+// a profiled training epoch of ds >> timewise(ff >> ff) >> sqerr, 4 batches
+// of 3 steps: calls per node and op, and as many trace events
+void check_profile() {
+  std::vector<Data<cpu>> X(4), Y(4);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(3*2, 2);
+    Y[j].init(3*2, 1);
+    X[j].batch_size = Y[j].batch_size = 2;
+    X[j]() = j;
+  }
+  auto ds = datastream<cpu>(2);
+  auto all = ds >> timewise(ff<cpu>(3) >> ff<cpu>(1)) >> sqerr<cpu>();
+  trainer<cpu> t(ds, all);
+  profile::name(*all);
+  profile::start();
+  t.train({&X, &Y});
+  profile::stop();
+
+  std::map<std::string, std::vector<uint64_t>> expected = { // fwd, bwd, steps, update
+    {"net/stack",            {4, 4, 0, 0, 4, 0}},
+    {"net/stack/datastream", {4, 4, 0, 0, 4, 0}},
+    {"net/stack/timewise",   {4, 4, 0, 0, 4, 0}},
+    {"net/stack/timewise/stack", {0, 0, 12, 12, 4, 0}},
+    {"net/stack/timewise/stack/ff#0", {0, 0, 12, 12, 4, 0}},
+    {"net/stack/timewise/stack/ff#1", {0, 0, 12, 12, 4, 0}},
+    {"net/sqerr", {4, 4, 0, 0, 4, 0}},
+  };
+  Stats s;
+  uint64_t events = 0;
+  for (auto& r : profile::summary()) {
+    if (r.path == "net") {
+      s.accumulate(r.self, 0);
+      continue;
+    }
+    auto it = expected.find(r.path);
+    if (it == expected.end()) { s.accumulate(1, 0); continue; }
+    for (uint o=0; o<profile::NUM_OPS; o++) {
+      s.accumulate(r.calls[o], it->second[o]);
+      events += r.calls[o];
+    }
+    expected.erase(it);
+  }
+  if (!expected.empty()) s.accumulate(1, 0);
+
+  profile::write_trace("/tmp/milk_gradcheck_trace.json");
+  std::ifstream in("/tmp/milk_gradcheck_trace.json");
+  std::string line;
+  uint64_t lines = 0;
+  while (std::getline(in, line)) lines += line.find("\"ph\":\"X\"") != std::string::npos;
+  s.accumulate(lines, events);
+  s.print();
+}
+
+// padded batches of batch_seq_label_seq and batch_seq_single_label (from
+// either side, uneven last batch) against rows looked up one at a time
+void check_batch_seq() {
+  uint N = 37, bs = 8;
+  std::vector<Data<cpu>> X(N), L(N), Y(N);
+  for (uint j=0; j<N; j++) {
+    X[j].init(1 + (j*5) % 9, 3);
+    L[j].init(X[j].len(), 1);
+    for (uint t=0; t<X[j].len(); t++) {
+      X[j]()[t] = 100*j + t;
+      L[j]()[t] = j;
+    }
+    Y[j].init(1, 2);
+    Y[j]() = j;
+  }
+  Stats s;
+  for (bool from_right : {false, true}) {
+    std::vector<Data<cpu>> Xb, Lb, Xs, Ys;
+    batch_seq_label_seq(&Xb, &Lb, X, L, -1., -2., bs, from_right);
+    batch_seq_single_label(&Xs, &Ys, X, Y, -1., bs, from_right);
+    auto index = sort_by_length(X);
+    uint n = 0;
+    for (uint i=0; i<Xb.size(); i++) {
+      uint b = Xb[i].batch_size, T = Xb[i].len();
+      for (uint j=0; j<b; j++, n++) {
+        uint k = index[n], T_ = X[k].len(), skip = from_right ? 0 : T - T_;
+        for (uint t=0; t<T; t++) {
+          bool pad = t < skip or t >= skip + T_;
+          for (uint c=0; c<3; c++) {
+            s.accumulate(Xb[i]()[b*t + j][c], pad ? -1. : X[k]()[t-skip][c]);
+            s.accumulate(Xs[i]()[b*t + j][c], Xb[i]()[b*t + j][c]);
+          }
+          s.accumulate(Lb[i]()[b*t + j][0], pad ? -2. : k);
+        }
+        s.accumulate(Ys[i]()[j][0], k);
+      }
+    }
+    if (n != N) s.accumulate(1, 0);
+  }
+  s.print();
+}
+
+// batches of prefetch_datastream (3 threads) against bucket_datastream with
+// the same seed, over 3 training epochs and test passes
+void check_prefetch() {
+  std::vector<Data<cpu>> X(40), Y(40);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(1 + j % 7, 2);
+    X[j]() = j;
+    Y[j].init(1, 1);
+    Y[j]() = j;
+  }
+  std::shared_ptr<layer::bucket_datastream<cpu>>
+    b = bucket_datastream<cpu>(2, 12, 2, 7),
+    p = prefetch_datastream<cpu>(2, 12, 2, 7, 3, 2);
+  Stats s;
+  for (Mode mode : {TRAIN, TRAIN, TRAIN, TEST}) {
+    for (auto ds : {b, p}) { // as trainer::run
+      ds->set_mode(mode);
+      ds->set_data({&X, &Y});
+    }
+    do {
+      b->forward();
+      p->forward();
+      assert(b->count == p->count);
+      for (uint i=0; i<2; i++) {
+        Matrix<cpu> u = b->x[i](), v = p->x[i]();
+        assert(u.shape_ == v.shape_);
+        for (uint r=0; r<u.size(0); r++)
+          for (uint c=0; c<u.size(1); c++) s.accumulate(u[r][c], v[r][c]);
+      }
+    } while (b->count != 0);
+  }
+
+  // a training epoch then a test pass without set_data: the test batches are
+  // planned afresh, as those of a stream that never trained
+  auto fresh = bucket_datastream<cpu>(2, 12, 2, 7);
+  fresh->set_mode(TEST);
+  fresh->set_data({&X, &Y});
+  for (auto ds : {b, p}) {
+    ds->set_mode(TRAIN);
+    do ds->forward(); while (ds->count != 0);
+    ds->set_mode(TEST);
+  }
+  do {
+    fresh->forward();
+    for (auto ds : {b, p}) {
+      ds->forward();
+      for (uint i=0; i<2; i++) {
+        Matrix<cpu> u = fresh->x[i](), v = ds->x[i]();
+        if (u.shape_ != v.shape_) { s.accumulate(1, 0); continue; }
+        for (uint r=0; r<u.size(0); r++)
+          for (uint c=0; c<u.size(1); c++) s.accumulate(u[r][c], v[r][c]);
+      }
+    }
+  } while (fresh->count != 0);
+  s.print();
+}
+
+// a dataset written to 3 record shards and streamed back by two
+// stream_datastreams with the same seed (2 readers, mmap and read()) over two
+// epochs: they must agree, and serve every instance within max_len once
+void check_stream() {
+  uint N = 30, max_len = 4;
+  std::vector<Data<cpu>> X(N), Y(N);
+  for (uint j=0; j<N; j++) {
+    X[j].init(1 + j % 6, 2);
+    X[j]() = j;
+    Y[j].init(1, 1);
+    Y[j]() = j;
+  }
+  auto files = write_records<cpu>("/tmp/milk_gradcheck_stream", 3, {&X, &Y});
+  auto a = stream_datastream<cpu>(files, 2, 4, 2, 5);
+  auto b = stream_datastream<cpu>(files, 2, 4, 2, 5);
+  b->use_mmap = false;
+  Stats s;
+  for (uint e=0; e<2; e++) {
+    std::vector<Real> seen;
+    for (auto ds : {a, b}) ds->max_len = max_len;
+    do {
+      a->forward();
+      b->forward();
+      s.accumulate(a->x[1]()[0][0], b->x[1]()[0][0]);
+      s.accumulate(a->x[0]()[0][0], a->x[1]()[0][0]);
+      seen.push_back(a->x[1]()[0][0]);
+    } while (a->count != 0);
+    std::sort(seen.begin(), seen.end());
+    std::vector<Real> expected;
+    for (uint j=0; j<N; j++) if (X[j].len() <= max_len) expected.push_back(j);
+    if (seen != expected) s.accumulate(1, 0);
+  }
+
+  // a version 1 file of the same records (pieces unpadded) reads the same
+  std::string v1 = "/tmp/milk_gradcheck_v1.rec";
+  {
+    std::ofstream out(v1, std::ios::binary);
+    record_file_header h = {{}, 1, sizeof(Real), 2, 0, N};
+    std::memcpy(h.magic, record_magic, sizeof(h.magic));
+    out.write((const char*)&h, sizeof(h));
+    for (uint j=0; j<N; j++) {
+      uint64_t bytes = 0;
+      for (auto d : {X[j], Y[j]}) bytes += sizeof(record_part) + d().shape_.Size() * sizeof(Real);
+      uint64_t padded = align_record(bytes);
+      out.write((const char*)&padded, sizeof(padded));
+      for (auto d : {X[j], Y[j]}) {
+        record_part p = {REC_DENSE, d.batch_size, d().size(0), d().size(1)};
+        out.write((const char*)&p, sizeof(p));
+        out.write((const char*)d().dptr_, d().shape_.Size() * sizeof(Real));
+      }
+      out.write("\0\0\0\0\0\0\0", padded - bytes);
+    }
+  }
+  std::vector<Data<cpu>> X1, Y1;
+  read_records<cpu>({v1}, {&X1, &Y1});
+  if (X1.size() != N) s.accumulate(1, 0);
+  for (uint j=0; j<X1.size(); j++) {
+    if (X1[j]().shape_ != X[j]().shape_) { s.accumulate(1, 0); continue; }
+    for (uint i=0; i<X[j]().size(0); i++)
+      for (uint k=0; k<2; k++) s.accumulate(X[j]()[i][k], X1[j]()[i][k]);
+    s.accumulate(Y[j]()[0][0], Y1[j]()[0][0]);
+  }
+  s.print();
+}
+
+// same with a forest of two trees
+std::shared_ptr<sdag> forest() {
+  auto t1 = std::make_shared<sdag>(), t2 = std::make_shared<sdag>();
+  t1->adj_list = { {{1,0}, {2,1}}, {}, {{3,0}, {4,1}}, {}, {} };
+  t2->adj_list = { {{1,0}, {2,1}}, {}, {} };
+  return sdag::merge({t1, t2});
+}
+
+// token ids, labels and trees of forest() through record files: values,
+// dags (shared by x and y) and their roots must come back as written
+void check_record_trees() {
+  std::vector<Data<cpu>> X(2), Y(2);
+  for (uint j=0; j<2; j++) {
+    auto dag = forest();
+    if (j == 0) { // a single tree, no roots
+      dag = std::make_shared<sdag>();
+      dag->adj_list = { {{1,0}, {2,1}}, {}, {} };
+    }
+    X[j].init(dag->size(), 1);
+    Y[j].init(dag->size(), 1);
+    for (uint n=0; n<dag->size(); n++) { X[j]()[n][0] = 3 * n + j; Y[j]()[n][0] = n % 5; }
+    X[j].dag = Y[j].dag = dag;
+  }
+  auto files = write_records<cpu>("/tmp/milk_gradcheck_trees", 1, {&X, &Y},
+                                  {REC_IDS, REC_IDS});
+  std::vector<Data<cpu>> X_, Y_;
+  read_records<cpu>(files, {&X_, &Y_});
+  Stats s;
+  if (X_.size() != X.size()) s.accumulate(1, 0);
+  for (uint j=0; j<X_.size(); j++) {
+    for (uint n=0; n<X[j]().size(0); n++) {
+      s.accumulate(X[j]()[n][0], X_[j]()[n][0]);
+      s.accumulate(Y[j]()[n][0], Y_[j]()[n][0]);
+    }
+    if (X_[j].dag != Y_[j].dag or X_[j].dag->adj_list != X[j].dag->adj_list or
+        X_[j].dag->roots != X[j].dag->roots)
+      s.accumulate(1, 0);
+  }
+  s.print();
+}
+
+#define CHECK_GRAD_FOREST(layer)                             \
+std::cout << "Checking forest " << #layer << std::endl;      \
+check_grad(layer, verbosity, nullptr, forest());             \
+std::cout << std::endl;                                      \
+
+// no activation gradients after a TEST forward of proj >> cast >>
+// (lstm, ff) >> cat >> drop >> ff, and all of them back after a TRAIN one.
+// the ids proj reads never have one.
+void check_test_mode() {
+  Data<cpu> x(3*2, 1);
+  x.batch_size = 2;
+  for (uint r=0; r<6; r++) x()[r][0] = r % 5;
+  auto p = proj<cpu>(4, 5);
+  auto c = cast<cpu>();
+  auto rnn = lstm<cpu>(3);
+  auto f = ff<cpu>(3);
+  auto k = cat<cpu>();
+  auto d = drop<cpu>(0.5);
+  auto top = ff<cpu>(2);
+  auto nn = p >> c >> (rnn, f) >> k >> d >> top;
+  p->x.connect_from(x);
+
+  std::vector<layer::layer<cpu>*> ls = {&*p, &*c, &*rnn, &*f, &*k, &*d, &*top};
+  for (Mode mode : {TEST, TRAIN}) {
+    nn->set_mode(mode);
+    nn->forward();
+    uint with = 0, without = 0;
+    for (auto l : ls) {
+      for (auto i : l->ins()) {
+        if (i->in == &x) continue;
+        (i->has_grad() ? with : without)++;
+      }
+      for (auto o : l->outs()) (o->has_grad() ? with : without)++;
+    }
+    std::cout << (mode == TEST ? "TEST" : "TRAIN") << ": " << with
+              << " with gradients, " << without << " without" << std::endl;
+    assert(mode == TEST ? with == 0 : without == 0);
+    assert(!x.has_grad());
+  }
+}
+
+// outputs of ds >> ff >> timewise(ff >> ff) >> ff in TEST mode through a
+// memplan, traced and then on the slabs, against plain forwards, and
+// training through a plan
+void check_memplan() {
+  std::vector<Data<cpu>> X(3);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(3*2, 2);
+    X[j].batch_size = 2;
+    for (uint r=0; r<6; r++)
+      for (uint c=0; c<2; c++) X[j]()[r][c] = std::sin(1. + j + 3*r + 7*c);
+  }
+  auto ds = datastream<cpu>(1);
+  auto nn = ds >> ff<cpu>(4) >> timewise(ff<cpu>(3) >> ff<cpu>(3)) >> ff<cpu>(2);
+  nn->set_mode(TEST);
+  ds->set_data({&X});
+  std::vector<MatrixContainer<cpu>> expected;
+  do {
+    nn->forward();
+    expected.emplace_back((*nn->outs()[0])());
+  } while (ds->count != 0);
+
+  memplan<cpu> plan(nn);
+  Stats s;
+  for (uint e=0; e<2; e++) {
+    uint k = 0;
+    do {
+      plan.forward();
+      Matrix<cpu> h = (*nn->outs()[0])();
+      for (uint r=0; r<h.size(0); r++)
+        for (uint c=0; c<h.size(1); c++) s.accumulate(h[r][c], expected[k][r][c]);
+      k++;
+    } while (ds->count != 0);
+  }
+  plan.release();
+
+  // training through a TRAIN mode plan (the ff output that only smax_xent
+  // reads is not kept) takes the same steps as without
+  std::vector<Data<cpu>> Y(X.size());
+  for (uint j=0; j<Y.size(); j++) {
+    Y[j].init(3*2, 1);
+    Y[j].batch_size = 2;
+    for (uint r=0; r<6; r++) Y[j]()[r][0] = (j + r) % 2;
+  }
+  std::vector<std::shared_ptr<layer::layer<cpu>>> nets;
+  for (bool planned : {false, true}) {
+    init::seed = 0;
+    auto ds2 = datastream<cpu>(2);
+    auto net = ff<cpu>(4) >> ff<cpu>(2, nonlin::id<cpu>()) >> smax_xent<cpu>();
+    trainer<cpu> t(ds2, ds2 >> net);
+    t.plan_memory = planned;
+    std::srand(1);
+    t.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+    nets.push_back(net);
+  }
+  auto P = nets[0]->params(), Q = nets[1]->params();
+  for (uint k=0; k<P.size(); k++)
+    for (uint i=0; i<(*P[k])().size(0); i++)
+      for (uint j=0; j<(*P[k])().size(1); j++)
+        s.accumulate((*P[k])()[i][j], (*Q[k])()[i][j]);
+  s.print();
+}
+
+// variable length lstm training settles in the pool: the first epoch sees
+// every batch length, later epochs allocate no tensor storage
+void check_pool_steady() {
+  uint N = 8, bs = 4;
+  std::vector<Data<cpu>> X(N), Y(N);
+  for (uint j=0; j<N; j++) { // padded batches of 1 to 9 steps
+    X[j].init(bs * (1 + (j*5) % 9), 1);
+    X[j].batch_size = bs;
+    for (uint r=0; r<X[j]().size(0); r++) X[j]()[r][0] = (j + r) % 6;
+    Y[j].init(bs, 1);
+    Y[j]() = j % 2;
+  }
+  auto ds = datastream<cpu>(2);
+  auto nn = ds >> proj<cpu>(3, 7) >> lstm<cpu>(4) >> tail<cpu>()
+               >> ff<cpu>(2, nonlin::id<cpu>()) >> smax_xent<cpu>();
+  trainer<cpu> t(ds, nn);
+  std::vector<size_t> allocs;
+  for (uint e=0; e<4; e++) {
+    t.train({&X, &Y});
+    allocs.push_back(pool<cpu>::get().stats().allocs);
+  }
+  Stats s;
+  for (uint e=1; e<allocs.size(); e++) s.accumulate(allocs[e], allocs[0]);
+  s.print();
+}
+
+// the fused lstm cell and its branch-free exp against the unfused mshadow
+// expressions, on inputs large enough to saturate the gates
+void check_lstm_cell() {
+  Stats s;
+  for (Real x=-100; x<100; x+=0.37) {
+    Real e = std::exp(std::min<Real>(std::max<Real>(x, -80), 80));
+    s.accumulate(layer::lstm_cell_exp(x) / e, 1);
+  }
+  Data<cpu> x(5*3, 4);
+  x.batch_size = 3;
+  mshadow::Random<cpu, Real>(0).SampleUniform(&(x()), -50., 50.);
+  auto fused = lstm(6), unfused = lstm(6);
+  unfused->fused = false;
+  fused->x.connect_from(x);
+  unfused->x.connect_from(x);
+  fused->forward(); // to init weights
+  unfused->forward();
+  auto W = fused->params(), V = unfused->params();
+  for (uint k=0; k<W.size(); k++) Copy((*V[k])(), (*W[k])());
+  for (auto l : {fused, unfused}) {
+    l->forward();
+    l->h.d() = 1.;
+    l->backward();
+  }
+  for (uint i=0; i<fused->h().size(0); i++)
+    for (uint j=0; j<fused->h().size(1); j++)
+      s.accumulate(fused->h()[i][j], unfused->h()[i][j]);
+  for (uint k=0; k<W.size(); k++)
+    for (uint i=0; i<W[k]->d().size(0); i++)
+      for (uint j=0; j<W[k]->d().size(1); j++)
+        s.accumulate(W[k]->d()[i][j], V[k]->d()[i][j]);
+  s.print();
+  assert(s.max_abs_diff < 1e-10);
+}
+
+// a training epoch of bucket_datastream then a test pass without set_data:
+// the test batches are planned afresh, as those of a stream that never trained
+void check_bucket_modes() {
+  std::vector<Data<cpu>> X(40), Y(40);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(1 + j % 7, 2);
+    X[j]() = j;
+    Y[j].init(1, 1);
+    Y[j]() = j;
+  }
+  auto b = bucket_datastream<cpu>(2, 12, 2, 7);
+  auto fresh = bucket_datastream<cpu>(2, 12, 2, 7);
+  fresh->set_mode(TEST);
+  fresh->set_data({&X, &Y});
+  b->set_data({&X, &Y});
+  do b->forward(); while (b->count != 0);
+  b->set_mode(TEST);
+  Stats s;
+  do {
+    fresh->forward();
+    b->forward();
+    for (uint i=0; i<2; i++) {
+      Matrix<cpu> u = fresh->x[i](), v = b->x[i]();
+      if (u.shape_ != v.shape_) { s.accumulate(1, 0); continue; }
+      for (uint r=0; r<u.size(0); r++)
+        for (uint c=0; c<u.size(1); c++) s.accumulate(u[r][c], v[r][c]);
+    }
+  } while (fresh->count != 0);
+  s.print();
+}
+
+// a layer of just the Weights ws, to save them with layer::save_params
+class weights : public layer::layer<cpu> {
+  public:
+    std::vector<Weight<cpu>*> ws;
+    weights(std::vector<Weight<cpu>*> a_ws) : ws(a_ws) {}
+    virtual void forward() {}
+    virtual std::vector<Weight<cpu>*> params() { return ws; }
+    virtual std::vector<Input<cpu>*> ins() { return {}; }
+    virtual std::vector<Data<cpu>*> outs() { return {}; }
+};
+
+void sin_init(Matrix<cpu> m) {
+  for (uint i=0; i<m.size(0); i++)
+    for (uint j=0; j<m.size(1); j++) m[i][j] = 0.1 * std::sin(3. * i + j);
+}
+
+// a Weight trained by a lazy updater on gradients of a few rows against the
+// dense updater on the same (otherwise zero) gradients: w and histories for
+// rmsprop and momentum, histories only for adam (its lazy w skips steps).
+// the lazy one goes through a full checkpoint and a delta midway, and is
+// loaded back from the delta, so its stale rows are caught up by sync().
+// with text_save it is also saved as text in between, whose sync() must
+// leave the rows it caught up to the delta.
+template <typename lazy, typename dense>
+void check_lazy(bool compare_w, Stats& s, bool text_save = false) {
+  std::string full = "/tmp/milk_gradcheck_lazy_full.bin";
+  std::string delta = "/tmp/milk_gradcheck_lazy_delta.bin";
+  uint rows = 8, cols = 3;
+  auto make = [&](std::shared_ptr<updater<cpu>> u) {
+    auto W = std::make_shared<Weight<cpu>>();
+    W->u = u;
+    W->initer = sin_init;
+    W->init(rows, cols);
+    W->u->set_lr(0.05);
+    return W;
+  };
+  auto L = make(std::make_shared<lazy>()), D = make(std::make_shared<dense>());
+  for (uint k=0; k<15; k++) {
+    std::vector<uint> r = {(3*k) % rows, (5*k + 1) % rows};
+    std::sort(r.begin(), r.end());
+    r.erase(std::unique(r.begin(), r.end()), r.end());
+    auto index = make_MC<cpu>(std::vector<Real>(r.begin(), r.end()));
+    for (auto W : {L, D}) {
+      W->d() = 0.;
+      for (auto i : r)
+        for (uint j=0; j<cols; j++) W->d()[i][j] = std::sin(1. + k + 2*i + 5*j);
+    }
+    L->update_rows(r, vec(*index));
+    D->update();
+    if (k == 4) save_checkpoint<cpu>({L.get()}, full);
+    if (k == 7 and text_save) {
+      std::ostringstream out;
+      weights({L.get()}).save_params(out);
+    }
+    if (k == 9) {
+      save_delta<cpu>({L.get()}, delta, full);
+      auto L_ = make(std::make_shared<lazy>());
+      load_checkpoint<cpu>({L_.get()}, delta);
+      L = L_;
+    }
+  }
+  L->u->sync((*L)());
+  std::vector<Matrix<cpu>> m, n;
+  if (compare_w) { m.push_back((*L)()); n.push_back((*D)()); }
+  for (auto h : L->u->history()) m.push_back(*h);
+  for (auto h : D->u->history()) n.push_back(*h);
+  for (uint t=0; t<m.size(); t++)
+    for (uint i=0; i<rows; i++)
+      for (uint j=0; j<cols; j++) s.accumulate(m[t][i][j], n[t][i][j]);
+}
+
+void check_lazy_updaters() {
+  Stats s;
+  check_lazy<lazy_rmsprop<cpu>, rmsprop<cpu>>(true, s);
+  check_lazy<lazy_momentum<cpu>, momentum<cpu>>(true, s);
+  check_lazy<lazy_adam<cpu>, adam<cpu>>(false, s);
+  check_lazy<lazy_rmsprop<cpu>, rmsprop<cpu>>(true, s, true);
+  check_lazy<lazy_momentum<cpu>, momentum<cpu>>(true, s, true);
+  check_lazy<lazy_adam<cpu>, adam<cpu>>(false, s, true);
+  s.print();
+}
+
+// reset_grad of a stack or join reaches proj, which zeroes only the rows it
+// touched: the other rows of W.d() keep a sentinel a dense reset would clear
+void check_proj_reset() {
+  Data<cpu> x(4, 1);
+  x()[0][0] = 0; x()[1][0] = 2; x()[2][0] = 0; x()[3][0] = 5;
+  auto p1 = proj<cpu>(3, 8), p2 = proj<cpu>(3, 8);
+  auto net = (p1 >> ff<cpu>(2), p2);
+  p1->x.connect_from(x); p2->x.connect_from(x);
+  net->forward();
+  for (auto h : net->outs()) h->d() = 1.;
+  net->backward();
+
+  std::vector<uint> touched = {1, 0, 1, 0, 0, 1, 0, 0};
+  for (auto p : {p1, p2})
+    for (uint i=0; i<8; i++)
+      if (!touched[i]) p->W.d()[i] = 7.;
+  net->reset_grad();
+
+  Stats s;
+  for (auto p : {p1, p2}) {
+    s.accumulate(p->touched.size(), 0);
+    for (uint i=0; i<8; i++)
+      for (uint j=0; j<3; j++) s.accumulate(p->W.d()[i][j], touched[i] ? 0 : 7);
+  }
+  s.print();
+}
+
+// a trainer checkpointing in the background (after steps 2 and 4 of 4):
+// after wait() the file loads to the final params and histories, bitwise.
+// a failed write is thrown from wait(), and later saves still work.
+void check_async_checkpoint() {
+  std::string bin = "/tmp/milk_gradcheck_async.bin";
+  std::vector<Data<cpu>> X(4), Y(4);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(4, 1);
+    Y[j].init(4, 1);
+    for (uint i=0; i<4; i++) {
+      X[j]()[i][0] = (7 * j + 3 * i) % 50;
+      Y[j]()[i][0] = std::sin(X[j]()[i][0]);
+    }
+  }
+  auto make = []() {
+    return proj<cpu>(3, 50) >> ff<cpu>(2) >> ff<cpu>(1, nonlin::id<cpu>()) >>
+           sqerr<cpu>();
+  };
+  auto ds = datastream<cpu>(2);
+  auto nn = make();
+  trainer<cpu> t(ds, ds >> nn);
+  t.checkpoint(bin, 2);
+  t.train({&X, &Y});
+  t.wait();
+
+  Stats s;
+  auto l = make();
+  l->load_params(bin);
+  auto P = nn->params(), Q = l->params();
+  for (uint k=0; k<P.size(); k++) {
+    std::vector<Matrix<cpu>> m = {(*P[k])()}, n = {(*Q[k])()};
+    for (auto h : P[k]->u->history()) m.push_back(*h);
+    for (auto h : Q[k]->u->history()) n.push_back(*h);
+    for (uint r=0; r<m.size(); r++)
+      for (uint i=0; i<m[r].size(0); i++)
+        for (uint j=0; j<m[r].size(1); j++)
+          s.accumulate(m[r][i][j], n[r][i][j]);
+  }
+  s.print();
+  assert(s.max_abs_diff == 0);
+
+  async_checkpointer<cpu> a;
+  a.save(nn->params(), "/nonexistent/milk_gradcheck_async.bin");
+  bool thrown = false;
+  try { a.wait(); } catch (std::runtime_error&) { thrown = true; }
+  assert(thrown);
+  a.save(nn->params(), bin);
+  a.wait();
+}
+
+// hogwild training of proj >> ff >> sqerr with 2 threads lowers the loss and
+// keeps the weights finite. updaters that count steps are refused.
+void check_hogwild() {
+  std::vector<Data<cpu>> X(40), Y(40);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(4, 1);
+    Y[j].init(4, 1);
+    for (uint i=0; i<4; i++) {
+      X[j]()[i][0] = (7 * j + 3 * i) % 50;
+      Y[j]()[i][0] = std::sin(X[j]()[i][0]);
+    }
+  }
+  auto make = []() -> std::shared_ptr<layer::layer<cpu>> {
+    return proj<cpu>(4, 50) >> ff<cpu>(1, nonlin::id<cpu>()) >> sqerr<cpu>();
+  };
+  Stats s;
+  hogwild_trainer<cpu> t(datastream<cpu>(2), make, 2);
+  t.nn->set_updater<rmsprop<cpu>>();
+  t.nn->set_lr(0.01);
+  t.train({&X, &Y}); // initializes
+  Real before = t.mean_error({&X, &Y});
+  t.train({&X, &Y}, std::numeric_limits<uint>::max(), 10);
+  Real after = t.mean_error({&X, &Y});
+  s.accumulate(after < before ? 0 : 1, 0);
+  for (auto W : t.nn->params())
+    for (uint i=0; i<(*W)().size(0); i++)
+      for (uint j=0; j<(*W)().size(1); j++)
+        s.accumulate(std::isfinite((*W)()[i][j]) ? 0 : 1, 0);
+
+  hogwild_trainer<cpu> t_adam(datastream<cpu>(2), make, 2);
+  t_adam.nn->set_updater<adam<cpu>>();
+  bool refused = false;
+  try { t_adam.train({&X, &Y}); } catch (std::invalid_argument&) { refused = true; }
+  s.accumulate(refused ? 0 : 1, 0);
+
+  hogwild_trainer<cpu> t_default(datastream<cpu>(2), make, 2); // no updater yet
+  t_default.train({&X, &Y});
+  s.print();
+}
+
+// data parallel training of proj >> ff >> ff >> sqerr over 2 replicas is
+// bitwise the same with 1 and 2 threads, and the same as the plain trainer
+// up to rounding, with and without L2 (added once, on the rows of both)
+void check_data_parallel(Real la) {
+  std::vector<Data<cpu>> X(10), Y(10);
+  for (uint j=0; j<X.size(); j++) {
+    X[j].init(6, 1);
+    Y[j].init(6, 1);
+    X[j].batch_size = Y[j].batch_size = 6;
+    for (uint i=0; i<6; i++) {
+      X[j]()[i][0] = (7 * j + 3 * i) % 50;
+      Y[j]()[i][0] = std::sin(X[j]()[i][0]);
+    }
+  }
+  auto make = [=]() -> std::shared_ptr<layer::layer<cpu>> {
+    auto l = proj<cpu>(3, 50) >> ff<cpu>(2) >> ff<cpu>(1, nonlin::id<cpu>()) >>
+             sqerr<cpu>();
+    l->set_initer(sin_init);
+    l->set_la(la);
+    return l;
+  };
+  auto ds = datastream<cpu>(2);
+  auto nn = make();
+  trainer<cpu> t(ds, ds >> nn);
+  data_parallel_trainer<cpu> t1(datastream<cpu>(2), make, 2, 1),
+                             t2(datastream<cpu>(2), make, 2, 2);
+  std::srand(1); t.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+  std::srand(1); t1.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+  std::srand(1); t2.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+
+  Stats s_threads, s_plain;
+  auto P = nn->params(), P1 = t1.nn->params(), P2 = t2.nn->params();
+  for (uint k=0; k<P.size(); k++) {
+    std::vector<Matrix<cpu>> m = {(*P[k])()}, m1 = {(*P1[k])()},
+                             m2 = {(*P2[k])()};
+    for (auto h : P[k]->u->history()) m.push_back(*h);
+    for (auto h : P1[k]->u->history()) m1.push_back(*h);
+    for (auto h : P2[k]->u->history()) m2.push_back(*h);
+    for (uint n=0; n<m.size(); n++)
+      for (uint i=0; i<m[n].size(0); i++)
+        for (uint j=0; j<m[n].size(1); j++) {
+          s_threads.accumulate(m1[n][i][j], m2[n][i][j]);
+          s_plain.accumulate(m[n][i][j], m1[n][i][j]);
+        }
+  }
+  std::cout << "Threads ";
+  s_threads.print();
+  assert(s_threads.max_abs_diff == 0);
+  std::cout << "Plain ";
+  s_plain.print();
+  assert(s_plain.max_abs_diff < 1e-12);
+}
+
+
+// 2 forked ranks train proj >> ff >> ff >> sqerr with dist_trainer over
+// uneven shards, from different initial Weights: both must end up with the
+// same Weights and updater histories, bit for bit
+void check_dist_trainer() {
+  uint failed = launch(2, [&](uint rank) {
+    std::vector<Data<cpu>> X(11), Y(11);
+    for (uint j=0; j<X.size(); j++) {
+      X[j].init(4, 1);
+      Y[j].init(4, 1);
+      for (uint i=0; i<4; i++) {
+        X[j]()[i][0] = (7 * j + 3 * i) % 50;
+        Y[j]()[i][0] = std::sin(X[j]()[i][0]);
+      }
+    }
+    init::seed = 100 * rank;
+    std::srand(rank);
+    auto nn = proj<cpu>(3, 50) >> ff<cpu>(2) >> ff<cpu>(1, nonlin::id<cpu>()) >>
+              sqerr<cpu>();
+    dist_trainer<cpu> t(datastream<cpu>(2), nn);
+    t.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+
+    std::vector<Real> v;
+    for (auto W : nn->params()) {
+      std::vector<Matrix<cpu>> m = {(*W)()};
+      for (auto h : W->u->history()) m.push_back(*h);
+      for (auto& x : m)
+        for (uint i=0; i<x.size(0); i++)
+          for (uint j=0; j<x.size(1); j++) v.push_back(x[i][j]);
+    }
+    auto v0 = v;
+    t.c->broadcast(v0.data(), v0.size());
+    return v == v0 ? 0 : 1;
+  });
+  std::cout << "Failed ranks: " << failed << std::endl;
+}
+
+// with L2, 2 ranks with one batch each take the same steps as the plain
+// trainer on both batches at once: L2 is added once, on the proj rows of
+// either rank
+void check_dist_l2() {
+  uint failed = launch(2, [&](uint rank) {
+    std::vector<Data<cpu>> X(2), Y(2), Xc(1), Yc(1);
+    Xc[0].init(8, 1); Yc[0].init(8, 1);
+    Xc[0].batch_size = Yc[0].batch_size = 2;
+    for (uint j=0; j<2; j++) {
+      X[j].init(4, 1);
+      Y[j].init(4, 1);
+      for (uint i=0; i<4; i++) {
+        X[j]()[i][0] = Xc[0]()[2*i + j][0] = 10 * j + i;
+        Y[j]()[i][0] = Yc[0]()[2*i + j][0] = std::sin(X[j]()[i][0]);
+      }
+    }
+    auto make = []() {
+      auto nn = proj<cpu>(3, 50) >> ff<cpu>(2) >> ff<cpu>(1, nonlin::id<cpu>()) >>
+                sqerr<cpu>();
+      nn->set_la(0.01);
+      return nn;
+    };
+    init::seed = 100 * rank;
+    auto nn = make();
+    dist_trainer<cpu> t(datastream<cpu>(2), nn);
+    t.train({&X, &Y}, std::numeric_limits<uint>::max(), 3);
+    if (rank != 0) return 0;
+
+    init::seed = 0;
+    auto ds = datastream<cpu>(2);
+    auto ref = make();
+    trainer<cpu> t_ref(ds, ds >> ref);
+    t_ref.train({&Xc, &Yc}, std::numeric_limits<uint>::max(), 3);
+    Stats s;
+    auto P = nn->params(), Q = ref->params();
+    for (uint k=0; k<P.size(); k++)
+      for (uint i=0; i<(*P[k])().size(0); i++)
+        for (uint j=0; j<(*P[k])().size(1); j++)
+          s.accumulate((*P[k])()[i][j], (*Q[k])()[i][j]);
+    s.print();
+    return s.max_abs_diff < 1e-12 ? 0 : 1;
+  });
+  std::cout << "Failed ranks: " << failed << std::endl;
+
+// a proj on 2 parameter server processes (staleness 0) and one worker, which
+// trains it and a local copy alike, then compares the tables. prints the
+// number of processes that failed.
+void check_ps() {
+  uint V = 50, D = 3, K = 2;
+  auto hosts = ps_hosts(K);
+  uint failed = launch(K + 1, [&](uint rank) {
+    if (rank < K) {
+      ps_server srv(rank, K, V, D, 1);
+      srv.set_updater(std::make_shared<lazy_rmsprop<cpu>>());
+      for (uint r=0, n=0; r<V; r++) // W of the shard in id order
+        if (ps_shard(r, K) == rank) {
+          for (uint j=0; j<D; j++) srv.W()[n][j] = 0.1 * std::sin(3. * r + j);
+          n++;
+        }
+      srv.serve(port_of(hosts[rank]));
+      return 0;
+    }
+    auto client = std::make_shared<ps_client>(hosts, 0, D);
+    auto p_ps = proj(D, V), p = proj(D, V);
+    p_ps->serve(client);
+    auto l_ps = p_ps >> ff(2), l = p >> ff(2);
+    l->set_updater<lazy_rmsprop<cpu>>();
+    l->set_initer(sin_init);
+    l_ps->set_initer(sin_init);
+    Data<cpu> x;
+    x.init(4, 1);
+    for (auto l_ : {l_ps, l}) l_->ins()[0]->connect_from(x);
+    for (uint k=0; k<5; k++) {
+      for (uint i=0; i<4; i++) x()[i][0] = (7 * k + 11 * i) % V;
+      for (auto l_ : {l_ps, l}) {
+        l_->forward();
+        l_->outs()[0]->d() = 1.;
+        l_->backward();
+        l_->update();
+      }
+    }
+    std::vector<uint> all(V);
+    for (uint r=0; r<V; r++) all[r] = r;
+    MatrixContainer<cpu> W(Shape2(V, D));
+    client->pull(all, W);
+    Stats s;
+    for (uint i=0; i<V; i++)
+      for (uint j=0; j<D; j++) s.accumulate(W[i][j], p->W()[i][j]);
+    return s.max_abs_diff < 1e-12 ? 0 : 1;
+  }, "tcp");
+  std::cout << "Failed ranks: " << failed << std::endl;
+}
+
 int main(int argc, char** argv) {
   InitTensorEngine<MilkDefaultDev>();
   uint verbosity = 0;
@@ -227,6 +1352,111 @@ int main(int argc, char** argv) {
 
   CHECK_GRAD( recursive(3,2) )
 
+  CHECK_GRAD_PACKED( recurrent(3) )
+  CHECK_GRAD_PACKED( recurrent(3,reverse) )
+  CHECK_GRAD_PACKED( lstm(3) )
+  CHECK_GRAD_PACKED( tail() )
+  CHECK_GRAD_PACKED( tailcast() )
+  CHECK_GRAD_PACKED( lstm(3) >> tail() )
+  CHECK_GRAD_PACKED( timewise(lstm(3) >> lstm(2)) )
+
+  std::cout << "Checking mapped proj lookups" << std::endl;
+  check_mapped_proj();
+  std::cout << std::endl;
+
+  std::cout << "Checking checkpoint round trip" << std::endl;
+  check_checkpoint();
+  std::cout << std::endl;
+
+  std::cout << "Checking delta checkpoint chain" << std::endl;
+  check_delta_checkpoint();
+  std::cout << std::endl;
+
+  std::cout << "Checking shm allreduce" << std::endl;
+  check_allreduce("shm");
+  std::cout << std::endl;
+
+  std::cout << "Checking tcp allreduce" << std::endl;
+  check_allreduce("tcp");
+  std::cout << std::endl;
+
+  std::cout << "Checking dist trainer" << std::endl;
+  check_dist_trainer();
+  std::cout << std::endl;
+
+  std::cout << "Checking distributed L2" << std::endl;
+  check_dist_l2();
+  std::cout << std::endl;
+
+  std::cout << "Checking sequence batching" << std::endl;
+  check_batch_seq();
+  std::cout << std::endl;
+
+  std::cout << "Checking prefetch datastream" << std::endl;
+  check_prefetch();
+  std::cout << std::endl;
+
+  std::cout << "Checking record stream" << std::endl;
+  check_stream();
+  std::cout << std::endl;
+
+  std::cout << "Checking parameter server" << std::endl;
+  check_ps();
+  std::cout << std::endl;
+
+  std::cout << "Checking record trees" << std::endl;
+  check_record_trees();
+  std::cout << std::endl;
+
+  std::cout << "Checking profiler" << std::endl;
+  check_profile();
+  std::cout << std::endl;
+
+  CHECK_GRAD_FOREST( root() )
+  CHECK_GRAD_FOREST( recursive(3,2) >> recursive(3,2) >> root() )
+
+  std::cout << "Checking TEST mode gradients" << std::endl;
+  check_test_mode();
+  std::cout << std::endl;
+
+  std::cout << "Checking memory plan" << std::endl;
+  check_memplan();
+  std::cout << std::endl;
+
+  std::cout << "Checking pool steady state" << std::endl;
+  check_pool_steady();
+  std::cout << std::endl;
+
+  std::cout << "Checking fused lstm cell" << std::endl;
+  check_lstm_cell();
+  std::cout << std::endl;
+
+  std::cout << "Checking bucket datastream modes" << std::endl;
+  check_bucket_modes();
+  std::cout << std::endl;
+
+  std::cout << "Checking lazy updaters" << std::endl;
+  check_lazy_updaters();
+  std::cout << std::endl;
+
+  std::cout << "Checking sparse proj reset" << std::endl;
+  check_proj_reset();
+  std::cout << std::endl;
+
+  std::cout << "Checking async checkpoints" << std::endl;
+  check_async_checkpoint();
+  std::cout << std::endl;
+
+  std::cout << "Checking hogwild training" << std::endl;
+  check_hogwild();
+  std::cout << std::endl;
+
+  std::cout << "Checking data parallel training" << std::endl;
+  check_data_parallel(0);
+  std::cout << "With L2" << std::endl;
+  check_data_parallel(0.01);
+  std::cout << std::endl;
+
   ShutdownTensorEngine<MilkDefaultDev>();
 
   return 0;
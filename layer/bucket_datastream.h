@@ -0,0 +1,199 @@
+#ifndef MILK_BUCKET_DATASTREAM_H
+#define MILK_BUCKET_DATASTREAM_H
+
+#include <cstring>
+#include <random>
+
+namespace milk {
+
+namespace layer {
+
+/* datastream that batches per-example data (one sequence per Data, batch_size
+ * 1) on the fly, every epoch. Examples are grouped into buckets of similar
+ * length (lengths [k*width, (k+1)*width) share a bucket) and shuffled within
+ * buckets, then cut into batches whose padded size bs * T_max stays within
+ * token_budget, so every step does about the same amount of work. Batch order
+ * is shuffled too, with a generator seeded by (seed, epoch), so an epoch can
+ * be planned ahead (see prefetch_datastream). In TEST mode batches are formed
+ * the same way but deterministically, without shuffling.
+ *
+ * Components with a row per timestep of X[0] (inputs, per-token labels) are
+ * packed (see packing) or, if !packed, padded on the left with pad[i] like
+ * batch_seq_*. Other components (e.g. a label per sequence) must have one row
+ * and become [bs x cols].
+ */
+template <typename xpu>
+class bucket_datastream : public datastream<xpu> {
+  public:
+    bucket_datastream(uint n=2, uint a_token_budget=2048, uint a_bucket_width=4,
+                      uint seed=0);
+    virtual void forward();
+    virtual void init();
+    virtual void set_mode(Mode mode);
+
+    uint token_budget;  // max bs * T_max per batch (longer examples go alone)
+    uint bucket_width;  // in timesteps
+    uint max_batch_size = std::numeric_limits<uint>::max();
+    bool packed = true;
+    std::vector<Real> pad; // pad value per component when !packed
+
+    // state: example ids per batch, longest first, in the order they are served
+    std::vector<std::vector<uint>> batches;
+    uint epoch = 0; // epochs served
+
+  protected:
+    uint seed;
+    std::vector<bool> per_step; // component i has a row per timestep
+
+    uint len(uint j) { return (*this->X[0])[j].len(); }
+    std::vector<std::vector<uint>> plan(uint e); // batches of epoch e
+    void make_batches() { batches = plan(epoch); }
+    Data<xpu> make_batch(uint i, const std::vector<uint>& ids);
+};
+
+template <typename xpu>
+bucket_datastream<xpu>::bucket_datastream(uint n, uint a_token_budget,
+                                          uint a_bucket_width, uint a_seed)
+    : datastream<xpu>(n), token_budget(a_token_budget),
+      bucket_width(a_bucket_width), pad(n, 0.), seed(a_seed) {
+  assert(bucket_width > 0);
+}
+
+template <typename xpu>
+void bucket_datastream<xpu>::init() {
+  datastream<xpu>::init(); // eligible examples (max_len) in perm
+  auto& X = this->X;
+  per_step.assign(X.size(), true);
+  for (uint i=1; i<X.size(); i++) {
+    for (auto j : this->perm) {
+      uint rows = (*X[i])[j]().size(0);
+      if (rows != len(j)) {
+        assert(rows == 1);
+        per_step[i] = false;
+      }
+    }
+  }
+  batches.clear();
+}
+
+template <typename xpu>
+std::vector<std::vector<uint>> bucket_datastream<xpu>::plan(uint e) {
+  bool train = (this->mode == TRAIN);
+  std::seed_seq ss{seed, e};
+  std::mt19937 gen(ss);
+  std::vector<uint> ids = this->perm;
+  if (train) std::shuffle(ids.begin(), ids.end(), gen);
+  std::stable_sort(ids.begin(), ids.end(), [&](uint a, uint b) {
+    return len(a) / bucket_width > len(b) / bucket_width;
+  });
+
+  std::vector<std::vector<uint>> batches;
+  std::vector<uint> cur;
+  uint T = 0; // max length in cur
+  for (auto j : ids) {
+    uint T_ = std::max(T, len(j));
+    if (!cur.empty() and
+        ((cur.size()+1) * T_ > token_budget or cur.size() == max_batch_size)) {
+      batches.push_back(cur);
+      cur.clear();
+      T_ = len(j);
+    }
+    cur.push_back(j);
+    T = T_;
+  }
+  if (!cur.empty()) batches.push_back(cur);
+
+  for (auto& batch : batches)
+    std::stable_sort(batch.begin(), batch.end(),
+                     [&](uint a, uint b) { return len(a) > len(b); });
+  if (train) std::shuffle(batches.begin(), batches.end(), gen);
+  return batches;
+}
+
+// component i of the batch of examples ids, assembled in host memory (see
+// host_batch) and put over in one copy. only reads X, so batches can be made
+// on several threads (see prefetch_datastream)
+template <typename xpu>
+Data<xpu> bucket_datastream<xpu>::make_batch(uint i,
+                                             const std::vector<uint>& ids) {
+  auto& src = *this->X[i];
+  uint bs = ids.size(), cols = src[ids[0]]().size(1);
+  std::vector<std::shared_ptr<MatrixContainer<cpu>>> keep;
+  std::vector<Matrix<cpu>> e(bs); // the examples, on the host
+  for (uint j=0; j<bs; j++) e[j] = host_view<xpu>(src[ids[j]](), keep);
+  Data<xpu>::s->Wait();
+
+  Data<xpu> b; // fresh storage, the previous batch may still be referenced
+  if (!per_step[i]) {
+    b.init(bs, cols);
+  } else if (packed) {
+    std::vector<uint> lengths(bs);
+    for (uint j=0; j<bs; j++) lengths[j] = len(ids[j]);
+    b.pack = std::make_shared<packing>(lengths);
+    b.init(b.pack->rows(), cols);
+  } else {
+    b.init(bs*len(ids[0]), cols);
+  }
+  host_batch<xpu> h;
+  Matrix<cpu> m = h.get(b);
+  auto put = [&](uint r, uint j, uint t) {
+    std::memcpy(m[r].dptr_, e[j][t].dptr_, cols * sizeof(Real));
+  };
+  if (!per_step[i]) {
+    for (uint j=0; j<bs; j++) put(j, j, 0);
+  } else if (packed) {
+    for (uint t=0; t<b.pack->len(); t++)
+      for (uint j=0; j<b.pack->sizes[t]; j++) put(b.pack->offsets[t] + j, j, t);
+  } else {
+    uint T = len(ids[0]);
+    m = pad[i];
+    for (uint j=0; j<bs; j++) {
+      uint T_ = len(ids[j]);
+      for (uint t=0; t<T_; t++) put(bs*(t+T-T_) + j, j, t);
+    }
+  }
+  h.put(b);
+  b.batch_size = bs;
+  return b;
+}
+
+// the plan of the other mode is dropped, the epoch starts over
+template <typename xpu>
+void bucket_datastream<xpu>::set_mode(Mode mode) {
+  if (mode != this->mode) {
+    batches.clear();
+    this->count = 0;
+  }
+  datastream<xpu>::set_mode(mode);
+}
+
+template <typename xpu>
+void bucket_datastream<xpu>::forward() {
+  if (this->perm.size() == 0) init();
+  if (this->count == 0 and (this->mode == TRAIN or batches.empty()))
+    make_batches();
+  auto& ids = batches[this->count];
+  for (uint i=0; i<this->X.size(); i++) this->x[i] = make_batch(i, ids);
+  this->count++;
+  if (this->count == batches.size()) {
+    this->count = 0;
+    epoch++;
+  }
+}
+
+} // end namespace layer
+
+namespace factory {
+
+template <typename xpu=MilkDefaultDev>
+std::shared_ptr<layer::bucket_datastream<xpu>> bucket_datastream(
+    uint n=2, uint token_budget=2048, uint bucket_width=4, uint seed=0) {
+  return std::make_shared<layer::bucket_datastream<xpu>>(n, token_budget,
+                                                         bucket_width, seed);
+}
+
+} // end namespace factory
+
+} // end namespace milk
+
+#endif
@@ -32,7 +32,7 @@ void cat<xpu>::forward() {
   slice<1>(h(),0,dim1)   = x1();
   slice<1>(h(),dim1,dim) = x2();
 
-  h.reset_grad();
+  this->init_grad(h);
   h.clone_info(*x1);
 }
 
@@ -49,8 +49,9 @@ void cf_smax_xent<xpu>::backward() {
   uint dim1 = x1().size(1);
   uint dim2 = x2().size(1);
 
-  MatrixContainer<xpu> y1(y().shape_, 0.), y2(y().shape_, 0.);
-  y1.stream_ = y2.stream_ = y().stream_;
+  auto y1_ = make_MC<xpu>(y().size(0), y().size(1));
+  auto y2_ = make_MC<xpu>(y().size(0), y().size(1));
+  auto& y1 = *y1_; auto& y2 = *y2_;
   y1 = F<Floor>(y() / dim2);
   y2 = y() - y1*dim2;
 
@@ -69,12 +70,14 @@ Real cf_smax_xent<xpu>::loss() { // loss value (xent). assume forward is done
   uint dim1 = x1().size(1);
   uint dim2 = x2().size(1);
 
-  MatrixContainer<xpu> y1(y().shape_, 0.), y2(y().shape_, 0.);
-  y1.stream_ = y2.stream_ = y().stream_;
+  auto y1_ = make_MC<xpu>(y().size(0), y().size(1));
+  auto y2_ = make_MC<xpu>(y().size(0), y().size(1));
+  auto& y1 = *y1_; auto& y2 = *y2_;
   y1 = F<Floor>(y() / dim2);
   y2 = y() - y1*dim2;
 
-  VectorContainer<xpu> m1(Shape1(h1().size(0))), m2(Shape1(h2().size(0)));
+  auto m1_ = make_MC<xpu>(1, h1().size(0)), m2_ = make_MC<xpu>(1, h2().size(0));
+  auto m1 = vec(*m1_), m2 = vec(*m2_);
   m1 = mat_choose_row_element(F<Log>(h1()), vec(y1));
   m2 = mat_choose_row_element(F<Log>(h2()), vec(y2));
   return -sum(m1)-sum(m2);
@@ -82,7 +85,8 @@ Real cf_smax_xent<xpu>::loss() { // loss value (xent). assume forward is done
 
 template <typename xpu>
 Real cf_smax_xent<xpu>::error() {
-  VectorContainer<xpu> equals(Shape1(h1().size(0)));
+  auto equals_ = make_MC<xpu>(1, h1().size(0));
+  auto equals = vec(*equals_);
   eq(equals, vec(c()), vec(y()));
   return h1().size(0) - sum(equals);
 }
@@ -111,8 +115,9 @@ void cf_smax_xent<xpu>::backward_step(uint t) {
   uint dim1 = x1().size(1);
   uint dim2 = x2().size(1);
 
-  MatrixContainer<xpu> y1(y(t).shape_, 0.), y2(y(t).shape_, 0.);
-  y1.stream_ = y2.stream_ = y().stream_;
+  auto y1_ = make_MC<xpu>(y(t).size(0), y(t).size(1));
+  auto y2_ = make_MC<xpu>(y(t).size(0), y(t).size(1));
+  auto& y1 = *y1_; auto& y2 = *y2_;
   y1 = F<Floor>(y(t) / dim2);
   y2 = y(t) - y1*dim2;
 
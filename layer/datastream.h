@@ -26,6 +26,15 @@ class datastream : public layer<xpu> {
     // for curriculum learning
     uint max_len = std::numeric_limits<uint>::max();
 
+    // only every num_shards-th eligible instance, from shard, e.g. one shard
+    // per rank (see dist_trainer)
+    uint shard = 0, num_shards = 1;
+    void set_shard(uint a_shard, uint a_num_shards) {
+      assert(a_shard < a_num_shards);
+      shard = a_shard; num_shards = a_num_shards;
+      perm.clear();
+    }
+
     virtual std::vector<Weight<xpu>*> params() { return {}; }
     virtual std::vector<Input<xpu>*> ins() { return {}; }
     virtual std::vector<Data<xpu>*> outs() { return get_ptrs(x); }
@@ -63,6 +72,12 @@ void datastream<xpu>::init() {
   perm.clear();
   for (uint j=0; j<X[0]->size(); j++) if ((*X[0])[j].len() <= max_len)
       perm.push_back(j);
+  if (num_shards > 1) {
+    uint n = 0;
+    for (uint k=shard; k<perm.size(); k+=num_shards) perm[n++] = perm[k];
+    perm.resize(n);
+    assert(n > 0);
+  }
   count = 0;
 }
 
@@ -38,7 +38,7 @@ void drop<xpu>::forward() {
   assert(x);
   h.init(x().size(0), x().size(1));
   mask.init(x().size(0), x().size(1));
-  h.reset_grad();
+  this->init_grad(h);
   h.clone_info(*x);
 
   if (this->mode == TRAIN) {
@@ -62,7 +62,7 @@ void drop<xpu>::forward_step(uint t) {
   if (t == 0) {
     h.init(x().size(0), x().size(1));
     mask.init(x().size(0), x().size(1));
-    h.reset_grad();
+    this->init_grad(h);
     h.clone_info(*x);
   }
 
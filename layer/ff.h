@@ -30,6 +30,11 @@ class ff : public layer<xpu> {
     virtual std::vector<Weight<xpu>*> params() { return {&W, &b}; };
     virtual std::vector<Input<xpu>*> ins() { return {&x}; };
     virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+    // the derivative of id does not look at h
+    virtual std::vector<Data<xpu>*> kept_outs() {
+      if (f.backward == &nonlin::id_b<xpu>) return {};
+      return outs();
+    }
 };
 
 template <typename xpu>
@@ -56,7 +61,7 @@ void ff<xpu>::forward() {
   h() += repmat(vec(b()), h().size(0));
   f(h(), h());
 
-  h.reset_grad();
+  this->init_grad(h);
   h.clone_info(*x.in);
 }
 
@@ -76,7 +81,7 @@ void ff<xpu>::forward_step(uint t) {
   if (W().size(0) == 0) init();
   if (t == 0) {
     h.init(x().size(0), W().size(1));
-    h.reset_grad(); h.clone_info(*x);
+    this->init_grad(h); h.clone_info(*x);
   }
 
   h(t) = dot(x(t), W());
@@ -12,12 +12,32 @@ class join : public layer<xpu> {
     join(std::shared_ptr<layer<xpu>> a_left,
          std::shared_ptr<layer<xpu>> a_right);
 
-    virtual void forward()  { left->forward();   right->forward(); };
-    virtual void backward() { right->backward(); left->backward(); };
-    virtual void forward_step(uint t)  { left->forward_step(t);   right->forward_step(t); };
-    virtual void backward_step(uint t) { right->backward_step(t); left->backward_step(t); };
+    // sublayers are called through profile::timed (utils/profile.h)
+    virtual void forward() {
+      timed(left, profile::FORWARD)->forward();
+      timed(right, profile::FORWARD)->forward();
+    }
+    virtual void backward() {
+      timed(right, profile::BACKWARD)->backward();
+      timed(left, profile::BACKWARD)->backward();
+    }
+    virtual void forward_step(uint t) {
+      timed(left, profile::FORWARD_STEP)->forward_step(t);
+      timed(right, profile::FORWARD_STEP)->forward_step(t);
+    }
+    virtual void backward_step(uint t) {
+      timed(right, profile::BACKWARD_STEP)->backward_step(t);
+      timed(left, profile::BACKWARD_STEP)->backward_step(t);
+    }
     virtual void init()     { left->init();      right->init(); };
-    virtual void update()   { left->update();    right->update(); };
+    virtual void update() {
+      timed(left, profile::UPDATE)->update();
+      timed(right, profile::UPDATE)->update();
+    }
+    virtual void reset_grad() {
+      timed(left, profile::RESET_GRAD)->reset_grad();
+      timed(right, profile::RESET_GRAD)->reset_grad();
+    }
 
     virtual void set_mode(Mode mode) {
       left->set_mode(mode); right->set_mode(mode);
@@ -25,15 +45,27 @@ class join : public layer<xpu> {
     virtual Real error() { return left->error() + right->error(); }
     virtual Real loss()  { return left->loss()  + right->loss();  }
 
+    using layer<xpu>::load_params;
+    virtual void load_params(std::istream& in) {
+      left->load_params(in); right->load_params(in);
+    }
+
     virtual std::vector<Weight<xpu>*> params() {
       return left->params() + right->params();
     }
+    virtual std::vector<const std::vector<uint>*> grad_rows() {
+      return left->grad_rows() + right->grad_rows();
+    }
     virtual std::vector<Input<xpu>*> ins() {
       return left->ins() + right->ins();
     }
     virtual std::vector<Data<xpu>*> outs() {
       return left->outs() + right->outs();
     }
+    virtual std::vector<layer<xpu>*> leaves() {
+      return left->leaves() + right->leaves();
+    }
+    virtual std::vector<layer<xpu>*> children() { return {left.get(), right.get()}; }
 };
 
 template <typename xpu>
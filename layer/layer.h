@@ -21,6 +21,7 @@ class layer {
     virtual void init() {};
     virtual void update();
     virtual void reset_grad();
+    void init_grad(Data<xpu>& h); // for outputs, called in forward
 
     virtual Real error() { return 0.; }; // loss layers will override this
     virtual Real loss()  { return 0.; }; // loss layers will override this
@@ -28,6 +29,7 @@ class layer {
 
     virtual void save_params(std::ostream& out); // TODO: also save/load the
     virtual void load_params(std::istream& in);  //       architecture
+    // binary checkpoints (utils/checkpoint.h), text files are still read
     virtual void save_params(const std::string& outfname);
     virtual void load_params(const std::string& infname);
 
@@ -51,7 +53,30 @@ class layer {
 
     virtual std::vector<Input<xpu>*> dangling_ins();
 
+    // the ins() and outs() whose values are read again after forward(), by
+    // backward(), error() or loss(), all of them unless overridden. memplan
+    // shares the storage of the others once forward() is past their readers.
+    virtual std::vector<Input<xpu>*> kept_ins() { return ins(); }
+    virtual std::vector<Data<xpu>*> kept_outs() { return outs(); }
+
+    // non-container layers in the order forward() runs them
+    virtual std::vector<layer<xpu>*> leaves() { return {this}; }
+    // direct sublayers of containers, see utils/profile.h
+    virtual std::vector<layer<xpu>*> children() { return {}; }
+
+    // take over what the backward of a replica (same architecture) recorded
+    // besides its gradients, which are summed separately. see
+    // data_parallel_trainer.
+    virtual void merge_replica(layer<xpu>&) {}
+    // for each of params(), the rows where its gradient may be nonzero
+    // (sorted), or nullptr for all of them. see data_parallel_trainer.
+    virtual std::vector<const std::vector<uint>*> grad_rows() {
+      return std::vector<const std::vector<uint>*>(params().size(), nullptr);
+    }
+
     virtual uint count_params();
+    // Weights of other (same architecture), shared instead of our own
+    void share_params(layer<xpu>& other);
 
     Mode mode = TRAIN;
 };
@@ -125,15 +150,35 @@ uint layer<xpu>::count_params() {
   return c;
 }
 
+template <typename xpu>
+void layer<xpu>::share_params(layer<xpu>& other) {
+  auto P = params(), Q = other.params();
+  assert(P.size() == Q.size());
+  for (uint i=0; i<P.size(); i++) {
+    assert((*Q[i])().size(0) > 0); // other is initialized
+    P[i]->share(*Q[i]);
+  }
+}
+
 template <typename xpu>
 void layer<xpu>::reset_grad() {
   for (const auto& W : params())
     W->reset_grad();
 }
 
+// gradients of outputs are only needed when training. in TEST mode they are
+// never allocated, so has_grad() is false all the way down and no backprop
+// buffers are zeroed per batch.
+template <typename xpu>
+void layer<xpu>::init_grad(Data<xpu>& h) {
+  if (mode == TRAIN) h.reset_grad();
+  else h.free_grad();
+}
+
 template <typename xpu>
 void layer<xpu>::save_params(std::ostream& out) {
   for (auto& W : params()) {
+    W->mark_dirty(W->u->sync((*W)())); // the next delta must carry them
     out << (*W)().size(0) << " " << (*W)().size(1) << std::endl;
     out << (*W)() << std::endl;
     for (auto& h : W->u->history()) {
@@ -147,7 +192,7 @@ void layer<xpu>::load_params(std::istream& in) {
   for (auto& W : params()) {
     uint rows=0, cols=0;
     in >> rows >> cols;
-    W->init(rows, cols);
+    W->alloc(rows, cols);
     in >> (*W)();
     for (auto& h : W->u->history()) { in >> *h; }
   }
@@ -155,13 +200,12 @@ void layer<xpu>::load_params(std::istream& in) {
 
 template <typename xpu>
 void layer<xpu>::save_params(const std::string& outfname) {
-  std::ofstream out(outfname);
-  assert(out.is_open());
-  save_params(out);
+  save_checkpoint(params(), outfname);
 }
 
 template <typename xpu>
 void layer<xpu>::load_params(const std::string& infname) {
+  if (is_checkpoint(infname)) return load_checkpoint(params(), infname);
   std::ifstream in(infname);
   assert(in.is_open());
   load_params(in);
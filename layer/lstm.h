@@ -18,33 +18,58 @@ class lstm : public layer<xpu> {
     virtual void backward_step(uint t);
     virtual void init();
 
+    using layer<xpu>::load_params;
+    virtual void load_params(std::istream& in);
+
     // io
     Data<xpu> h;
     Input<xpu> x;
 
-    // tmps
-    Data<xpu> i, f, c, o, g, h_;
+    // tmps. gates holds the i, f, o, g blocks side by side, [time*batch x 4dim]
+    Data<xpu> gates, c, h_;
 
     // nonlinearity
     Nonlin<xpu> nl_gate = nonlin::sigmoid<xpu>();
     Nonlin<xpu> nl_g = nonlin::tanh<xpu>();
     Nonlin<xpu> nl_h = nonlin::tanh<xpu>();
 
-    //params
-    Weight<xpu> Wix, Wfx, Wcx, Wox,
-                Wih, Wfh, Wch, Woh,
-                Wic, Wfc,      Woc,
-                bi,  bf,  bc,  bo;
+    //params, fused over gates in the same i, f, o, g order
+    Weight<xpu> Wx, // [xdim x 4dim]
+                Wh, // [dim x 4dim]
+                Wc, // [dim x 3dim] peepholes, no g block
+                b;  // [1 x 4dim]
 
     int dim;
     int incr = 1; // increment, -1 for reverse direction
+    bool fused = true; // use lstm_cell_* when the nonlinearities allow it
+
+    enum { I, F, O, G };
+    // columns of gate k (n consecutive gates) in a gates slice
+    Matrix<xpu> gate(Matrix<xpu> a, uint k, uint n=1) {
+      return middle_cols(a, k*dim, n*dim);
+    }
 
-    virtual std::vector<Weight<xpu>*> params() { return {&Wix, &Wfx, &Wcx, &Wox,
-                                                         &Wih, &Wfh, &Wch, &Woh,
-                                                         &Wic, &Wfc,       &Woc,
-                                                         &bi,  &bf,  &bc,  &bo }; }
+    virtual std::vector<Weight<xpu>*> params() { return {&Wx, &Wh, &Wc, &b}; }
     virtual std::vector<Input<xpu>*> ins() { return {&x}; };
     virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+
+  private:
+    int begin();
+    uint prev_rows(int t) { // rows of step t that continue from step t-incr
+      return std::min(h.batch_size_at(t), h.batch_size_at(t-incr));
+    }
+    bool use_fused() {
+      return fused and nl_gate.forward == nonlin::sigmoid_f<xpu> and
+             nl_g.forward == nonlin::tanh_f<xpu> and
+             nl_h.forward == nonlin::tanh_f<xpu>;
+    }
+    void init_tmps();
+    void step_forward(int t);  // everything after the input projection
+    void step_backward(int t, bool weights=true); // everything before the
+                                                  // input projection
+    void step_backward_unfused(int t, uint n); // elementwise part without
+                                               // lstm_cell_*
+    void load_legacy(std::istream& in);
 };
 
 template <typename xpu>
@@ -54,228 +79,199 @@ template <typename xpu>
 void lstm<xpu>::init() {
   assert(x.in);
   int xdim = x().size(1);
-  for (auto& w : {&Wix, &Wfx, &Wcx, &Wox}) w->init(xdim,dim);
-  for (auto& w : {&Wih, &Wfh, &Wch, &Woh, &Wic, &Wfc, &Woc}) w->init(dim,dim);
-  for (auto& w : {&bi, &bf, &bc, &bo}) { w->init(1,dim); (*w)() = 0; }
+  Wx.init(xdim, 4*dim);
+  Wh.init(dim, 4*dim);
+  Wc.init(dim, 3*dim);
+  b.init(1, 4*dim); b() = 0;
 }
 
 template <typename xpu>
-void lstm<xpu>::forward() {
-  if (Wix().size(0) == 0) init();
-  uint Tbs = x().size(0); // time*batch
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
-  int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
-
-  for (auto& w : {&i, &f, &g, &c, &o, &h_, &h}) {
-    w->init(Tbs,dim); w->clone_info(*x.in); w->reset_grad();
-  }
-  i() = dot(x(), Wix()); i() += repmat(vec(bi()), Tbs);
-  f() = dot(x(), Wfx()); f() += repmat(vec(bf()), Tbs);
-  g() = dot(x(), Wcx()); g() += repmat(vec(bc()), Tbs);
-  o() = dot(x(), Wox()); o() += repmat(vec(bo()), Tbs);
-
-  for (int t=begin; t!=end; t+=incr) {
-    if (t != begin) {
-      i(t) += dot(h(t-incr), Wih());
-      i(t) += dot(c(t-incr), Wic());
-      f(t) += dot(h(t-incr), Wfh());
-      f(t) += dot(c(t-incr), Wfc());
-    }
-    nl_gate(i(t), i(t));
-    nl_gate(f(t), f(t));
-    if (t != begin)
-      g(t) += dot(h(t-incr), Wch());
-    nl_g(g(t), g(t));
-
-    c(t) = i(t) * g(t);
-    if (t != begin) c(t) += (1.-f(t)) * c(t-incr);
-
-    if (t != begin) {
-      o(t) += dot(h(t-incr), Woh());
-      o(t) += dot(c(t-incr), Woc());
-    }
-    nl_gate(o(t), o(t));
+int lstm<xpu>::begin() {
+  return (incr > 0) ? 0 : x.in->len()-1;
+}
 
-    nl_h(h_(t), c(t));
-    h(t) = o(t) * h_(t);
+template <typename xpu>
+void lstm<xpu>::init_tmps() {
+  uint Tbs = x().size(0); // time*batch
+  gates.init(Tbs, 4*dim); gates.clone_info(*x.in); this->init_grad(gates);
+  for (auto& w : {&c, &h_, &h}) {
+    w->init(Tbs,dim); w->clone_info(*x.in); this->init_grad(*w);
   }
 }
 
 template <typename xpu>
-void lstm<xpu>::backward() {
-  uint Tbs = x().size(0);
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+void lstm<xpu>::step_forward(int t) {
+  auto a = gates(t);
+  bool first = (t == begin());
+  uint n = first ? 0 : prev_rows(t);
+  if (n > 0) {
+    auto an = top_rows(a, n);
+    an += dot(top_rows(h(t-incr), n), Wh());
+    gate(an, I, 3) += dot(top_rows(c(t-incr), n), Wc());
+  }
+  if (use_fused() and
+      lstm_cell_forward(a, first ? c(t) : c(t-incr), n, c(t), h_(t), h(t)))
+    return;
 
-  int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
+  nl_gate(gate(a, I, 3), gate(a, I, 3));
+  nl_g(gate(a, G), gate(a, G));
 
-  for (int t=end-incr; t != begin-incr; t-=incr) {
-    h_.d(t) += h.d(t) * o(t);
-    o.d(t)  += h.d(t) * h_(t);
-    nl_h.backward_add(c.d(t), h_.d(t), h_(t));
-
-    nl_gate.backward(o.d(t), o.d(t), o(t));
-    if (t != begin) {
-      h.d(t-incr) += dot(o.d(t), Woh().T());
-      Woh.d()     += dot(h(t-incr).T(), o.d(t));
-      c.d(t-incr) += dot(o.d(t), Woc().T());
-      Woc.d()     += dot(c(t-incr).T(), o.d(t));
-    }
+  c(t) = gate(a, I) * gate(a, G);
+  if (n > 0)
+    top_rows(c(t), n) += (1.-gate(top_rows(a, n), F)) * top_rows(c(t-incr), n);
 
-    if (t != begin) {
-      f.d(t) -= c.d(t) * c(t-incr);
-      c.d(t-incr) += c.d(t) * (1.-f(t));
-    }
-    i.d(t) += c.d(t) * g(t);
-    g.d(t) += c.d(t) * i(t);
-
-    nl_g.backward(g.d(t), g.d(t), g(t));
-    if (t != begin) {
-      h.d(t-incr) += dot(g.d(t), Wch().T());
-      Wch.d()     += dot(h(t-incr).T(), g.d(t));
-    }
+  nl_h(h_(t), c(t));
+  h(t) = gate(a, O) * h_(t);
+}
 
-    nl_gate.backward(f.d(t), f.d(t), f(t));
-    nl_gate.backward(i.d(t), i.d(t), i(t));
-
-    if (t != begin) {
-      c.d(t-incr) += dot(f.d(t), Wfc().T());
-      Wfc.d()     += dot(c(t-incr).T(), f.d(t));
-      h.d(t-incr) += dot(f.d(t), Wfh().T());
-      Wfh.d()     += dot(h(t-incr).T(), f.d(t));
-      c.d(t-incr) += dot(i.d(t), Wic().T());
-      Wic.d()     += dot(c(t-incr).T(), i.d(t));
-      h.d(t-incr) += dot(i.d(t), Wih().T());
-      Wih.d()     += dot(h(t-incr).T(), i.d(t));
-    }
+template <typename xpu>
+void lstm<xpu>::step_backward(int t, bool weights) {
+  auto a = gates(t), da = gates.d(t);
+  bool first = (t == begin());
+  uint n = first ? 0 : prev_rows(t);
+
+  if (!use_fused() or
+      !lstm_cell_backward(a, da, first ? c(t) : c(t-incr),
+                          first ? c.d(t) : c.d(t-incr), n,
+                          c.d(t), h_(t), h_.d(t), h.d(t)))
+    step_backward_unfused(t, n);
+
+  if (n == 0) return;
+  auto dan = top_rows(da, n);
+  top_rows(h.d(t-incr), n) += dot(dan, Wh().T());
+  top_rows(c.d(t-incr), n) += dot(gate(dan, I, 3), Wc().T());
+  if (weights) {
+    Wh.d() += dot(top_rows(h(t-incr), n).T(), dan);
+    Wc.d() += dot(top_rows(c(t-incr), n).T(), gate(dan, I, 3));
   }
+}
+
+template <typename xpu>
+void lstm<xpu>::step_backward_unfused(int t, uint n) {
+  auto a = gates(t), da = gates.d(t);
+
+  h_.d(t) += h.d(t) * gate(a, O);
+  gate(da, O) += h.d(t) * h_(t);
+  nl_h.backward_add(c.d(t), h_.d(t), h_(t));
 
-  Wix.d() += dot(x().T(), i.d());
-  Wfx.d() += dot(x().T(), f.d());
-  Wcx.d() += dot(x().T(), g.d());
-  Wox.d() += dot(x().T(), o.d());
-  vec(bi.d()) += sum_rows(i.d());
-  vec(bf.d()) += sum_rows(f.d());
-  vec(bc.d()) += sum_rows(g.d());
-  vec(bo.d()) += sum_rows(o.d());
-
-  if (x.has_grad()) {
-    x.d() += dot(i.d(), Wix().T());
-    x.d() += dot(f.d(), Wfx().T());
-    x.d() += dot(g.d(), Wcx().T());
-    x.d() += dot(o.d(), Wox().T());
+  if (n > 0) {
+    auto dc = top_rows(c.d(t), n);
+    gate(top_rows(da, n), F) -= dc * top_rows(c(t-incr), n);
+    top_rows(c.d(t-incr), n) += dc * (1.-gate(top_rows(a, n), F));
   }
+  gate(da, I) += c.d(t) * gate(a, G);
+  gate(da, G) += c.d(t) * gate(a, I);
 
-  layer<xpu>::backward();
+  nl_gate.backward(gate(da, I, 3), gate(da, I, 3), gate(a, I, 3));
+  nl_g.backward(gate(da, G), gate(da, G), gate(a, G));
 }
 
 template <typename xpu>
-void lstm<xpu>::forward_step(uint t) {
-  if (Wix().size(0) == 0) init();
+void lstm<xpu>::forward() {
+  if (Wx().size(0) == 0) init();
   uint Tbs = x().size(0); // time*batch
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
-  int begin; if (incr > 0) { begin=0; } else { begin=T-1; }
+  uint T = x.in->len();
+  int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
 
-  if (t == begin) for (auto& w : {&i, &f, &g, &c, &o, &h_, &h}) {
-    w->init(Tbs,dim); w->clone_info(*x.in); w->reset_grad();
-  }
+  init_tmps();
+  gates() = dot(x(), Wx()); gates() += repmat(vec(b()), Tbs);
 
-  i(t) = dot(x(t), Wix()); i(t) += repmat(vec(bi()), bs);
-  f(t) = dot(x(t), Wfx()); f(t) += repmat(vec(bf()), bs);
-  g(t) = dot(x(t), Wcx()); g(t) += repmat(vec(bc()), bs);
-  o(t) = dot(x(t), Wox()); o(t) += repmat(vec(bo()), bs);
+  for (int t=begin; t!=end; t+=incr) step_forward(t);
+}
 
-  if (t != begin) {
-    i(t) += dot(h(t-incr), Wih());
-    i(t) += dot(c(t-incr), Wic());
-    f(t) += dot(h(t-incr), Wfh());
-    f(t) += dot(c(t-incr), Wfc());
-  }
-  nl_gate(i(t), i(t));
-  nl_gate(f(t), f(t));
-  if (t != begin)
-    g(t) += dot(h(t-incr), Wch());
-  nl_g(g(t), g(t));
-
-  c(t) = i(t) * g(t);
-  if (t != begin) c(t) += (1.-f(t)) * c(t-incr);
-
-  if (t != begin) {
-    o(t) += dot(h(t-incr), Woh());
-    o(t) += dot(c(t-incr), Woc());
+template <typename xpu>
+void lstm<xpu>::backward() {
+  uint bs = x.in->batch_size;
+  uint T = x.in->len();
+  bool packed = (x.in->pack != nullptr);
+
+  int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
+
+  for (int t=end-incr; t != begin-incr; t-=incr) step_backward(t, packed);
+
+  // recurrent weight grads for all steps at once: h(t-incr), c(t-incr)
+  // against the gate deltas of t, t != begin. packed steps do not line up,
+  // so those are accumulated per step above.
+  if (T > 1 and !packed) {
+    uint n = (T-1)*bs;
+    auto da = middle_rows(gates.d(), (incr > 0) ? bs : 0, n);
+    Wh.d() += dot(middle_rows(h(), (incr > 0) ? 0 : bs, n).T(), da);
+    Wc.d() += dot(middle_rows(c(), (incr > 0) ? 0 : bs, n).T(),
+                  gate(da, I, 3));
   }
-  nl_gate(o(t), o(t));
 
-  nl_h(h_(t), c(t));
-  h(t) = o(t) * h_(t);
+  Wx.d() += dot(x().T(), gates.d());
+  vec(b.d()) += sum_rows(gates.d());
+  if (x.has_grad()) x.d() += dot(gates.d(), Wx().T());
+
+  layer<xpu>::backward();
 }
 
 template <typename xpu>
-void lstm<xpu>::backward_step(uint t) {
-  uint Tbs = x().size(0);
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+void lstm<xpu>::forward_step(uint t) {
+  if (Wx().size(0) == 0) init();
 
-  int begin; if (incr > 0) { begin=0; } else { begin=T-1; }
+  if (t == begin()) init_tmps();
 
-  h_.d(t) += h.d(t) * o(t);
-  o.d(t)  += h.d(t) * h_(t);
-  nl_h.backward_add(c.d(t), h_.d(t), h_(t));
+  gates(t) = dot(x(t), Wx()); gates(t) += repmat(vec(b()), x(t).size(0));
+  step_forward(t);
+}
 
-  nl_gate.backward(o.d(t), o.d(t), o(t));
-  if (t != begin) {
-    h.d(t-incr) += dot(o.d(t), Woh().T());
-    Woh.d()     += dot(h(t-incr).T(), o.d(t));
-    c.d(t-incr) += dot(o.d(t), Woc().T());
-    Woc.d()     += dot(c(t-incr).T(), o.d(t));
-  }
+template <typename xpu>
+void lstm<xpu>::backward_step(uint t) {
+  step_backward(t);
 
-  if (t != begin) {
-    f.d(t) -= c.d(t) * c(t-incr);
-    c.d(t-incr) += c.d(t) * (1.-f(t));
-  }
-  i.d(t) += c.d(t) * g(t);
-  g.d(t) += c.d(t) * i(t);
+  Wx.d() += dot(x(t).T(), gates.d(t));
+  vec(b.d()) += sum_rows(gates.d(t));
+  if (x.has_grad()) x.d(t) += dot(gates.d(t), Wx().T());
 
-  nl_g.backward(g.d(t), g.d(t), g(t));
-  if (t != begin) {
-    h.d(t-incr) += dot(g.d(t), Wch().T());
-    Wch.d()     += dot(h(t-incr).T(), g.d(t));
-  }
+  if (t == begin()) layer<xpu>::backward();
+}
 
-  nl_gate.backward(f.d(t), f.d(t), f(t));
-  nl_gate.backward(i.d(t), i.d(t), i(t));
-
-  if (t != begin) {
-    c.d(t-incr) += dot(f.d(t), Wfc().T());
-    Wfc.d()     += dot(c(t-incr).T(), f.d(t));
-    h.d(t-incr) += dot(f.d(t), Wfh().T());
-    Wfh.d()     += dot(h(t-incr).T(), f.d(t));
-    c.d(t-incr) += dot(i.d(t), Wic().T());
-    Wic.d()     += dot(c(t-incr).T(), i.d(t));
-    h.d(t-incr) += dot(i.d(t), Wih().T());
-    Wih.d()     += dot(h(t-incr).T(), i.d(t));
-  }
+template <typename xpu>
+void lstm<xpu>::load_params(std::istream& in) {
+  auto pos = in.tellg();
+  uint rows=0, cols=0;
+  in >> rows >> cols;
+  in.seekg(pos);
+  if (cols == 4*uint(dim)) layer<xpu>::load_params(in);
+  else load_legacy(in);
+}
 
-  Wix.d() += dot(x(t).T(), i.d(t));
-  Wfx.d() += dot(x(t).T(), f.d(t));
-  Wcx.d() += dot(x(t).T(), g.d(t));
-  Wox.d() += dot(x(t).T(), o.d(t));
-  vec(bi.d()) += sum_rows(i.d(t));
-  vec(bf.d()) += sum_rows(f.d(t));
-  vec(bc.d()) += sum_rows(g.d(t));
-  vec(bo.d()) += sum_rows(o.d(t));
-
-  if (x.has_grad()) {
-    x.d(t) += dot(i.d(t), Wix().T());
-    x.d(t) += dot(f.d(t), Wfx().T());
-    x.d(t) += dot(g.d(t), Wcx().T());
-    x.d(t) += dot(o.d(t), Wox().T());
+// files saved before the gates were fused hold 15 blocks, one per gate:
+// Wix Wfx Wcx Wox, Wih Wfh Wch Woh, Wic Wfc Woc, bi bf bc bo. each block
+// (and its updater history) is copied into its columns of the fused weight.
+template <typename xpu>
+void lstm<xpu>::load_legacy(std::istream& in) {
+  auto pos = in.tellg();
+  uint xdim=0, cols=0;
+  in >> xdim >> cols;
+  in.seekg(pos);
+  assert(cols == uint(dim));
+
+  Wx.alloc(xdim, 4*dim);
+  Wh.alloc(dim, 4*dim);
+  Wc.alloc(dim, 3*dim);
+  b.alloc(1, 4*dim);
+
+  std::vector<std::pair<Weight<xpu>*, uint>> blocks =
+    {{&Wx, I}, {&Wx, F}, {&Wx, G}, {&Wx, O},
+     {&Wh, I}, {&Wh, F}, {&Wh, G}, {&Wh, O},
+     {&Wc, I}, {&Wc, F},            {&Wc, O},
+     {&b,  I}, {&b,  F}, {&b,  G}, {&b,  O}};
+  for (auto& blk : blocks) {
+    auto& W = *blk.first;
+    uint rows=0, cols=0;
+    in >> rows >> cols;
+    assert(rows == W().size(0) and cols == dim);
+    auto tmp = make_MC<xpu>(rows, cols);
+    in >> *tmp;
+    Copy(gate(W(), blk.second), *tmp);
+    for (auto& h : W.u->history()) {
+      in >> *tmp;
+      Copy(gate(*h, blk.second), *tmp);
+    }
   }
-
-  if (t == begin) layer<xpu>::backward();
 }
 
 } // end namespace layer
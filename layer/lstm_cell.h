@@ -0,0 +1,306 @@
+#ifndef MILK_LSTM_CELL_H
+#define MILK_LSTM_CELL_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace milk {
+namespace layer {
+
+/* Fused elementwise part of an lstm step for the default nonlinearities
+ * (sigmoid gates, tanh cell input and output). a is a [bs x 4dim] slice of
+ * gate pre-activations in i, f, o, g order; it is overwritten with the
+ * activations, which backward reads. Each element is read and written once
+ * instead of once per mshadow expression. Only the first n_prev rows have a
+ * previous cell state (none on the first step, fewer for packed batches).
+ *
+ * The cpu versions are branch-free row loops for the compiler to vectorize
+ * at -O3 (AVX2 or AVX-512 depending on -march, check with -fopt-info-vec),
+ * the gpu versions launch one kernel each.
+ * Both return false when there is no fused version for the device, in which
+ * case lstm falls back to the unfused expressions.
+ */
+
+template <typename xpu>
+bool lstm_cell_forward(Matrix<xpu>, Matrix<xpu>, uint, Matrix<xpu>,
+                       Matrix<xpu>, Matrix<xpu>) {
+  return false;
+}
+
+template <typename xpu>
+bool lstm_cell_backward(Matrix<xpu>, Matrix<xpu>, Matrix<xpu>, Matrix<xpu>,
+                        uint, Matrix<xpu>, Matrix<xpu>, Matrix<xpu>,
+                        Matrix<xpu>) {
+  return false;
+}
+
+// branch-free exp, sigmoid and tanh for the cell, so that the cpu row loops
+// vectorize (std::exp only does with -ffast-math). exp(x) = 2^n e^r with
+// |r| <= ln2/2: n is rounded by adding a magic number, e^r is its Taylor
+// polynomial to within an ulp of Real and 2^n is written into the exponent
+// bits. x is clamped to [-80, 80], where sigmoid and tanh have long saturated.
+// The gpu uses exp itself.
+template <size_t bytes> struct lstm_cell_bits;
+template <> struct lstm_cell_bits<4> {
+  typedef uint32_t type;
+  static const int mantissa = 23, bias = 127;
+};
+template <> struct lstm_cell_bits<8> {
+  typedef uint64_t type;
+  static const int mantissa = 52, bias = 1023;
+};
+
+MSHADOW_XINLINE Real lstm_cell_exp(Real x) {
+#ifdef __CUDA_ARCH__
+  return exp(x);
+#else
+  typedef typename lstm_cell_bits<sizeof(Real)>::type U;
+  const int mantissa = lstm_cell_bits<sizeof(Real)>::mantissa;
+  const int bias = lstm_cell_bits<sizeof(Real)>::bias;
+  // clamp |x| on the bits: a float select here keeps gcc from vectorizing
+  // (it duplicates the divisions of sigmoid and tanh into both arms).
+  // nan stays nan.
+  const U sign = U(1) << (8*sizeof(Real) - 1), inf = U(2*bias + 1) << mantissa;
+  const Real max = 80;
+  U u, lim;
+  std::memcpy(&u, &x, sizeof(u));
+  std::memcpy(&lim, &max, sizeof(lim));
+  U m = u & ~sign;
+  u = (u & sign) | ((m > lim and m <= inf) ? lim : m);
+  std::memcpy(&x, &u, sizeof(u));
+  const Real magic = Real(3) * (U(1) << (mantissa - 1));
+  Real t = x * Real(1.4426950408889634) + magic; // n in the low bits
+  Real n = t - magic;
+  Real r = x - n * Real(0.693145751953125) - n * Real(1.4286068203094173e-06);
+  Real p = Real(1./6227020800);                    // 1/13!, an ulp of double
+  p = p * r + Real(1./479001600); p = p * r + Real(1./39916800);
+  p = p * r + Real(1./3628800);   p = p * r + Real(1./362880);
+  p = p * r + Real(1./40320);     p = p * r + Real(1./5040);
+  p = p * r + Real(1./720);       p = p * r + Real(1./120);
+  p = p * r + Real(1./24);        p = p * r + Real(1./6);
+  p = p * r + Real(1./2);         p = p * r + 1;
+  p = p * r + 1;
+  std::memcpy(&u, &t, sizeof(u));
+  u = (u + bias) << mantissa;
+  Real scale;
+  std::memcpy(&scale, &u, sizeof(u));
+  return p * scale;
+#endif
+}
+
+MSHADOW_XINLINE Real lstm_cell_sigmoid(Real x) {
+  return 1 / (1 + lstm_cell_exp(-x));
+}
+
+MSHADOW_XINLINE Real lstm_cell_tanh(Real x) {
+  return 1 - 2 / (lstm_cell_exp(2 * x) + 1);
+}
+
+// one element j of a row of the cell. pointers are to that row of each
+// operand, ai .. ag to the i, f, o, g blocks of a (and da). c_prev (and
+// dc_prev) are only read when prev.
+template <bool prev>
+MSHADOW_XINLINE void lstm_cell_forward_at(Real* ai, Real* af, Real* ao,
+                                          Real* ag, const Real* c_prev,
+                                          Real* c, Real* h_, Real* h, uint j) {
+  Real i = lstm_cell_sigmoid(ai[j]);
+  Real f = lstm_cell_sigmoid(af[j]);
+  Real o = lstm_cell_sigmoid(ao[j]);
+  Real g = lstm_cell_tanh(ag[j]);
+  Real cj = i * g;
+  if (prev) cj += (1 - f) * c_prev[j];
+  Real hj_ = lstm_cell_tanh(cj);
+  ai[j] = i; af[j] = f; ao[j] = o; ag[j] = g;
+  c[j] = cj; h_[j] = hj_; h[j] = o * hj_;
+}
+
+template <bool prev>
+MSHADOW_XINLINE void lstm_cell_backward_at(const Real* ai, const Real* af,
+                                           const Real* ao, const Real* ag,
+                                           Real* dai, Real* daf, Real* dao,
+                                           Real* dag, const Real* c_prev,
+                                           Real* dc_prev, Real* dc,
+                                           const Real* h_, Real* dh_,
+                                           const Real* dh, uint j) {
+  Real i = ai[j], f = af[j], o = ao[j], g = ag[j];
+  Real dhj_ = dh_[j] + dh[j] * o;
+  Real dcj = dc[j] + (1 - h_[j] * h_[j]) * dhj_;
+  Real di = dai[j] + dcj * g;
+  Real df = daf[j];
+  Real d_o = dao[j] + dh[j] * h_[j];
+  Real dg = dag[j] + dcj * i;
+  if (prev) {
+    df -= dcj * c_prev[j];
+    dc_prev[j] += dcj * (1 - f);
+  }
+  dai[j] = (1 - i) * i * di;
+  daf[j] = (1 - f) * f * df;
+  dao[j] = (1 - o) * o * d_o;
+  dag[j] = (1 - g * g) * dg;
+  dh_[j] = dhj_; dc[j] = dcj;
+}
+
+// a row of dim elements on the cpu. the rows of distinct operands (and the
+// gate blocks of a row) never overlap, which __restrict__ tells the compiler
+// so that it vectorizes the loop without run-time alias checks. gcc drops
+// __restrict__ when it inlines a call whose pointers share a base (the gate
+// blocks), hence noinline.
+template <bool prev>
+__attribute__((noinline))
+void lstm_cell_forward_row(Real* __restrict__ ai, Real* __restrict__ af,
+                           Real* __restrict__ ao, Real* __restrict__ ag,
+                           const Real* __restrict__ c_prev,
+                           Real* __restrict__ c, Real* __restrict__ h_,
+                           Real* __restrict__ h, uint dim) {
+  for (uint j=0; j<dim; j++)
+    lstm_cell_forward_at<prev>(ai, af, ao, ag, c_prev, c, h_, h, j);
+}
+
+template <bool prev>
+__attribute__((noinline))
+void lstm_cell_backward_row(const Real* __restrict__ ai,
+                            const Real* __restrict__ af,
+                            const Real* __restrict__ ao,
+                            const Real* __restrict__ ag,
+                            Real* __restrict__ dai, Real* __restrict__ daf,
+                            Real* __restrict__ dao, Real* __restrict__ dag,
+                            const Real* __restrict__ c_prev,
+                            Real* __restrict__ dc_prev, Real* __restrict__ dc,
+                            const Real* __restrict__ h_, Real* __restrict__ dh_,
+                            const Real* __restrict__ dh, uint dim) {
+  for (uint j=0; j<dim; j++)
+    lstm_cell_backward_at<prev>(ai, af, ao, ag, dai, daf, dao, dag, c_prev,
+                                dc_prev, dc, h_, dh_, dh, j);
+}
+
+template <>
+inline bool lstm_cell_forward<cpu>(Matrix<cpu> a, Matrix<cpu> c_prev,
+                                   uint n_prev, Matrix<cpu> c, Matrix<cpu> h_,
+                                   Matrix<cpu> h) {
+  uint bs = c.size(0), dim = c.size(1);
+  for (uint r=0; r<bs; r++) {
+    Real* ar = a[r].dptr_;
+    Real *cr = c[r].dptr_, *hr_ = h_[r].dptr_, *hr = h[r].dptr_;
+    if (r < n_prev)
+      lstm_cell_forward_row<true>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                  c_prev[r].dptr_, cr, hr_, hr, dim);
+    else
+      lstm_cell_forward_row<false>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                   nullptr, cr, hr_, hr, dim);
+  }
+  return true;
+}
+
+template <>
+inline bool lstm_cell_backward<cpu>(Matrix<cpu> a, Matrix<cpu> da,
+                                    Matrix<cpu> c_prev, Matrix<cpu> dc_prev,
+                                    uint n_prev, Matrix<cpu> dc,
+                                    Matrix<cpu> h_, Matrix<cpu> dh_,
+                                    Matrix<cpu> dh) {
+  uint bs = dc.size(0), dim = dc.size(1);
+  for (uint r=0; r<bs; r++) {
+    Real *ar = a[r].dptr_, *dar = da[r].dptr_, *dcr = dc[r].dptr_;
+    Real *hr_ = h_[r].dptr_, *dhr_ = dh_[r].dptr_, *dhr = dh[r].dptr_;
+    if (r < n_prev)
+      lstm_cell_backward_row<true>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                   dar, dar + dim, dar + 2*dim, dar + 3*dim,
+                                   c_prev[r].dptr_, dc_prev[r].dptr_, dcr,
+                                   hr_, dhr_, dhr, dim);
+    else
+      lstm_cell_backward_row<false>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                    dar, dar + dim, dar + 2*dim, dar + 3*dim,
+                                    nullptr, nullptr, dcr, hr_, dhr_, dhr,
+                                    dim);
+  }
+  return true;
+}
+
+#ifdef __CUDACC__
+
+__global__ void lstm_cell_forward_kernel(Real* a, uint sa,
+                                         const Real* c_prev, uint scp,
+                                         uint n_prev,
+                                         Real* c, uint sc, Real* h_, uint sh_,
+                                         Real* h, uint sh, uint bs, uint dim) {
+  for (uint k = blockIdx.x * blockDim.x + threadIdx.x; k < bs*dim;
+       k += blockDim.x * gridDim.x) {
+    uint r = k / dim, j = k % dim;
+    Real* ar = a + r*sa;
+    if (r < n_prev)
+      lstm_cell_forward_at<true>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                 c_prev + r*scp, c + r*sc, h_ + r*sh_,
+                                 h + r*sh, j);
+    else
+      lstm_cell_forward_at<false>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                  nullptr, c + r*sc, h_ + r*sh_, h + r*sh, j);
+  }
+}
+
+__global__ void lstm_cell_backward_kernel(const Real* a, uint sa,
+                                          Real* da, uint sda,
+                                          const Real* c_prev, uint scp,
+                                          Real* dc_prev, uint sdcp,
+                                          uint n_prev,
+                                          Real* dc, uint sdc,
+                                          const Real* h_, uint sh_,
+                                          Real* dh_, uint sdh_,
+                                          const Real* dh, uint sdh,
+                                          uint bs, uint dim) {
+  for (uint k = blockIdx.x * blockDim.x + threadIdx.x; k < bs*dim;
+       k += blockDim.x * gridDim.x) {
+    uint r = k / dim, j = k % dim;
+    const Real* ar = a + r*sa;
+    Real* dar = da + r*sda;
+    if (r < n_prev)
+      lstm_cell_backward_at<true>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                  dar, dar + dim, dar + 2*dim, dar + 3*dim,
+                                  c_prev + r*scp, dc_prev + r*sdcp, dc + r*sdc,
+                                  h_ + r*sh_, dh_ + r*sdh_, dh + r*sdh, j);
+    else
+      lstm_cell_backward_at<false>(ar, ar + dim, ar + 2*dim, ar + 3*dim,
+                                   dar, dar + dim, dar + 2*dim, dar + 3*dim,
+                                   nullptr, nullptr, dc + r*sdc, h_ + r*sh_,
+                                   dh_ + r*sdh_, dh + r*sdh, j);
+  }
+}
+
+const uint lstm_cell_threads = 256;
+
+inline uint lstm_cell_blocks(uint n) {
+  return std::min<uint>((n + lstm_cell_threads - 1) / lstm_cell_threads, 65535);
+}
+
+template <>
+inline bool lstm_cell_forward<gpu>(Matrix<gpu> a, Matrix<gpu> c_prev,
+                                   uint n_prev, Matrix<gpu> c, Matrix<gpu> h_,
+                                   Matrix<gpu> h) {
+  uint bs = c.size(0), dim = c.size(1);
+  cudaStream_t s = Stream<gpu>::GetStream(c.stream_);
+  lstm_cell_forward_kernel<<<lstm_cell_blocks(bs*dim), lstm_cell_threads, 0, s>>>(
+      a.dptr_, a.stride_, c_prev.dptr_, c_prev.stride_, n_prev,
+      c.dptr_, c.stride_, h_.dptr_, h_.stride_, h.dptr_, h.stride_, bs, dim);
+  return true;
+}
+
+template <>
+inline bool lstm_cell_backward<gpu>(Matrix<gpu> a, Matrix<gpu> da,
+                                    Matrix<gpu> c_prev, Matrix<gpu> dc_prev,
+                                    uint n_prev, Matrix<gpu> dc,
+                                    Matrix<gpu> h_, Matrix<gpu> dh_,
+                                    Matrix<gpu> dh) {
+  uint bs = dc.size(0), dim = dc.size(1);
+  cudaStream_t s = Stream<gpu>::GetStream(dc.stream_);
+  lstm_cell_backward_kernel<<<lstm_cell_blocks(bs*dim), lstm_cell_threads, 0, s>>>(
+      a.dptr_, a.stride_, da.dptr_, da.stride_,
+      c_prev.dptr_, c_prev.stride_, dc_prev.dptr_, dc_prev.stride_, n_prev,
+      dc.dptr_, dc.stride_, h_.dptr_, h_.stride_, dh_.dptr_, dh_.stride_,
+      dh.dptr_, dh.stride_, bs, dim);
+  return true;
+}
+
+#endif
+
+} // end namespace layer
+} // end namespace milk
+
+#endif
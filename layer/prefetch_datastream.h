@@ -0,0 +1,165 @@
+#ifndef MILK_PREFETCH_DATASTREAM_H
+#define MILK_PREFETCH_DATASTREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace milk {
+
+namespace layer {
+
+/* bucket_datastream whose batches are made ahead of time on background
+ * threads, so padding, packing and copies of the next batches overlap with
+ * the network working on the current one. At most depth batches are ready or
+ * in the works, across epoch boundaries. Only on cpu: pool threads have no
+ * device set and only a default stream, so on other devices batches are
+ * made in order on the calling thread, when submitted. Batches are planned
+ * per epoch on the calling thread and served in plan order, so for a seed
+ * the stream is the same as that of bucket_datastream, whatever the number
+ * of threads.
+ *
+ * set_data, set_mode and init wait for batches in the works and drop them.
+ */
+template <typename xpu>
+class prefetch_datastream : public bucket_datastream<xpu> {
+  public:
+    prefetch_datastream(uint n=2, uint token_budget=2048, uint bucket_width=4,
+                        uint seed=0, uint threads=1, uint a_depth=4);
+    ~prefetch_datastream() { drain(); }
+
+    virtual void forward();
+    virtual void init();
+    virtual void set_data(const std::vector<std::vector<Data<xpu>>*>&);
+    virtual void set_mode(Mode mode);
+
+    uint depth;
+
+  private:
+    struct slot {
+      std::vector<Data<xpu>> x;
+      bool ready = false;
+    };
+    thread_pool pool;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<slot>> ring; // submitted batches, in order
+
+    // plans[0] is the epoch being served (batches), later ones were drawn to
+    // submit ahead. next is where submission is: batch b of plans[e].
+    std::deque<std::vector<std::vector<uint>>> plans;
+    uint next_e = 0, next_b = 0;
+
+    void fill();
+    void drain();
+    void submit(std::function<void()> f) { f(); }
+};
+
+template <>
+inline void prefetch_datastream<cpu>::submit(std::function<void()> f) {
+  pool.submit(f);
+}
+
+template <typename xpu>
+prefetch_datastream<xpu>::prefetch_datastream(uint n, uint token_budget,
+                                              uint bucket_width, uint seed,
+                                              uint threads, uint a_depth)
+    : bucket_datastream<xpu>(n, token_budget, bucket_width, seed),
+      depth(a_depth), pool(threads) {
+  assert(depth > 0 and threads > 0);
+}
+
+// submit batches until depth are on the way
+template <typename xpu>
+void prefetch_datastream<xpu>::fill() {
+  while (ring.size() < depth) {
+    if (next_e == plans.size())
+      plans.push_back(this->plan(this->epoch + plans.size()));
+    auto ids = plans[next_e][next_b];
+    if (++next_b == plans[next_e].size()) { next_e++; next_b = 0; }
+    auto s = std::make_shared<slot>();
+    ring.push_back(s);
+    submit([this, s, ids]() {
+      std::vector<Data<xpu>> x;
+      for (uint i=0; i<this->X.size(); i++) x.push_back(this->make_batch(i, ids));
+      Data<xpu>::s->Wait();
+      std::lock_guard<std::mutex> g(lock);
+      s->x.swap(x);
+      s->ready = true;
+      cv.notify_all();
+    });
+  }
+}
+
+template <typename xpu>
+void prefetch_datastream<xpu>::drain() {
+  std::unique_lock<std::mutex> g(lock);
+  cv.wait(g, [this]() {
+    for (auto& s : ring) if (!s->ready) return false;
+    return true;
+  });
+  ring.clear();
+  plans.clear();
+  next_e = next_b = 0;
+}
+
+template <typename xpu>
+void prefetch_datastream<xpu>::init() {
+  drain();
+  bucket_datastream<xpu>::init();
+}
+
+template <typename xpu>
+void prefetch_datastream<xpu>::set_data(
+    const std::vector<std::vector<Data<xpu>>*>& datalist) {
+  drain();
+  datastream<xpu>::set_data(datalist);
+}
+
+// batches planned for the other mode are dropped, the epoch starts over
+template <typename xpu>
+void prefetch_datastream<xpu>::set_mode(Mode mode) {
+  if (mode != this->mode) drain();
+  bucket_datastream<xpu>::set_mode(mode);
+}
+
+template <typename xpu>
+void prefetch_datastream<xpu>::forward() {
+  if (this->perm.size() == 0) init();
+  fill();
+  if (this->count == 0) this->batches = plans.front(); // once per epoch
+  auto s = ring.front();
+  {
+    std::unique_lock<std::mutex> g(lock);
+    cv.wait(g, [&]() { return s->ready; });
+  }
+  ring.pop_front();
+  for (uint i=0; i<this->X.size(); i++) this->x[i] = s->x[i];
+  this->count++;
+  if (this->count == this->batches.size()) {
+    this->count = 0;
+    this->epoch++;
+    plans.pop_front();
+    next_e--;
+  }
+  fill();
+}
+
+} // end namespace layer
+
+namespace factory {
+
+template <typename xpu=MilkDefaultDev>
+std::shared_ptr<layer::prefetch_datastream<xpu>> prefetch_datastream(
+    uint n=2, uint token_budget=2048, uint bucket_width=4, uint seed=0,
+    uint threads=1, uint depth=4) {
+  return std::make_shared<layer::prefetch_datastream<xpu>>(
+      n, token_budget, bucket_width, seed, threads, depth);
+}
+
+} // end namespace factory
+
+} // end namespace milk
+
+#endif
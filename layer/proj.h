@@ -1,6 +1,9 @@
 #ifndef MILK_PROJ_H
 #define MILK_PROJ_H
 
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
 #include <unordered_set>
 
 namespace milk {
@@ -15,6 +18,13 @@ class proj : public layer<xpu> {
     virtual void forward_step(uint t);
     virtual void backward_step(uint t);
     virtual void init();
+    virtual void map(std::shared_ptr<wv_file> f);
+    virtual void update();
+    virtual void reset_grad();
+    virtual void merge_replica(layer<xpu>& other);
+    // keep W on parameter servers (utils/ps.h): lookups pull the rows of the
+    // batch, backward pushes their gradient. W and params() stay empty here.
+    void serve(std::shared_ptr<ps_client> a_ps);
 
     // io
     Data<xpu> h;
@@ -26,9 +36,35 @@ class proj : public layer<xpu> {
     int dim = -1;
     int size = -1; // vocab size
 
-    virtual std::vector<Weight<xpu>*> params() { return {&W}; };
+    virtual std::vector<Weight<xpu>*> params() {
+      if (ps) return {};
+      return {&W};
+    };
+    virtual std::vector<const std::vector<uint>*> grad_rows() {
+      if (ps) return {};
+      return {&touched};
+    }
     virtual std::vector<Input<xpu>*> ins() { return {&x}; };
     virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+
+    // rows of W with a gradient since the last update (sorted). only these are
+    // regularized, updated (see updater::update_rows) and zeroed.
+    std::vector<uint> touched;
+
+  private:
+    bool frozen = false; // W is a read-only mapping, see map
+    bool trains() { return W.u->lr > 0 and !frozen; }
+
+    std::vector<uint> step_rows; // rows of the current backward (step)
+    void touch(Matrix<xpu> ids);
+    void regularize();
+
+    std::shared_ptr<ps_client> ps;
+    std::vector<uint> ps_rows; // rows of the batch (sorted), as pulled
+    Data<xpu> ps_W;            // their values and gradient
+    Data<xpu> ps_x;            // x as indices into ps_rows
+    void pull();
+    void push();
 };
 
 template <typename xpu>
@@ -41,46 +77,177 @@ void proj<xpu>::init() {
   W.init(size,dim);
 }
 
+// use the table of a binary wv file as W, rows indexed as in f->w2i. on cpu
+// W is the mapping itself: unless f was opened copy_on_write it is frozen
+// (lr 0, and later set_lr calls do not train it). the gradient and updater
+// state are only allocated once W is trained.
+template <typename xpu>
+void proj<xpu>::map(std::shared_ptr<wv_file> f) {
+  assert(dim == -1 or dim == (int)f->header.dim);
+  dim = f->header.dim;
+  size = f->header.rows;
+  W.w = mapped_table<xpu>(f);
+  W.grad = nullptr;
+  if (!W.u) W.u = std::make_shared<rmsprop<xpu>>();
+  frozen = std::is_same<xpu, cpu>::value and !f->copy_on_write();
+  if (frozen) W.u->lr = 0;
+}
+
+template <typename xpu>
+void proj<xpu>::serve(std::shared_ptr<ps_client> a_ps) {
+  assert(a_ps->dim == (uint)dim);
+  ps = a_ps;
+}
+
 template <typename xpu>
 void proj<xpu>::forward() {
-  if (W().size(0) == 0) init();
+  if (!ps and W().size(0) == 0) init();
   assert(x.in);
 
   uint Tbs = x().size(0);
   h.init(Tbs,dim);
 
-  h() += take(vec(x()), W());
+  if (ps) {
+    pull();
+    h() += take(vec(ps_x()), ps_W());
+  } else {
+    h() += take(vec(x()), W());
+  }
 
-  h.reset_grad();
+  this->init_grad(h);
   h.clone_info(*x.in);
-  Matrix<xpu> h = *(W.u->history()[0]);
 }
 
 template <typename xpu>
 void proj<xpu>::backward() {
-  if (W.u->lr > 0) AddTakeGrad(W.d(), vec(x()), h.d());
-  W.d() += (W.la * W() * F<IsNonzero>(W.d())); // L2-regularize iff it is used
+  if (ps) {
+    AddTakeGrad(ps_W.d(), vec(ps_x()), h.d());
+    push();
+  } else if (trains()) {
+    if (!W.has_grad()) { W.reset_grad(); W.u->init(size, dim); } // mapped
+    AddTakeGrad(W.d(), vec(x()), h.d());
+    touch(x());
+    regularize();
+  }
   //layer<xpu>::backward();
 }
 
 template <typename xpu>
 void proj<xpu>::forward_step(uint t) {
-  if (W().size(0) == 0) init();
+  if (!ps and W().size(0) == 0) init();
   if (t == 0) {
     assert(x.in);
     uint Tbs = x().size(0);
     h.init(Tbs,dim);
-    h.reset_grad();
+    this->init_grad(h);
     h.clone_info(*x);
+    if (ps) pull();
   }
 
-  h(t) += take(vec(x(t)), W());
+  if (ps) h(t) += take(vec(ps_x(t)), ps_W());
+  else    h(t) += take(vec(x(t)), W());
 }
 
 template <typename xpu>
 void proj<xpu>::backward_step(uint t) {
-  if (W.u->lr > 0) AddTakeGrad(W.d(), vec(x(t)), h.d(t));
-  if (t == 0) W.d() += (W.la * W() * F<IsNonzero>(W.d())); // L2-regularize iff it is used
+  if (ps) {
+    AddTakeGrad(ps_W.d(), vec(ps_x(t)), h.d(t));
+    if (t == 0) push();
+  } else if (trains()) {
+    if (!W.has_grad()) { W.reset_grad(); W.u->init(size, dim); } // mapped
+    AddTakeGrad(W.d(), vec(x(t)), h.d(t));
+    touch(x(t));
+    if (t == 0) regularize();
+  }
+}
+
+template <typename xpu>
+void proj<xpu>::touch(Matrix<xpu> ids) {
+  MatrixContainer<cpu> ids_(ids.shape_);
+  Copy(ids_, ids, Data<xpu>::s);
+  Data<xpu>::s->Wait();
+  for (uint i=0; i<ids_.size(0); i++) step_rows.push_back(ids_[i][0]);
+}
+
+// L2-regularize the rows used by this backward, then add them to touched
+template <typename xpu>
+void proj<xpu>::regularize() {
+  auto& r = step_rows;
+  std::sort(r.begin(), r.end());
+  r.erase(std::unique(r.begin(), r.end()), r.end());
+  if (W.la > 0 and !r.empty()) {
+    auto index = make_MC<xpu>(std::vector<Real>(r.begin(), r.end()));
+    auto g_ = take_rows(vec(*index), W.d());
+    *g_ += W.la * take(vec(*index), W());
+    IndexFill(W.d(), vec(*index), *g_);
+  }
+  std::vector<uint> merged;
+  std::set_union(touched.begin(), touched.end(), r.begin(), r.end(),
+                 std::back_inserter(merged));
+  touched.swap(merged);
+  r.clear();
+}
+
+// rows of the batch from the servers, and x in terms of them
+template <typename xpu>
+void proj<xpu>::pull() {
+  MatrixContainer<cpu> ids(x().shape_);
+  Copy(ids, x(), Data<xpu>::s);
+  Data<xpu>::s->Wait();
+  ps_rows.assign(ids.dptr_, ids.dptr_ + ids.shape_.Size());
+  std::sort(ps_rows.begin(), ps_rows.end());
+  ps_rows.erase(std::unique(ps_rows.begin(), ps_rows.end()), ps_rows.end());
+  for (uint i=0; i<ids.size(0); i++)
+    ids[i][0] = std::lower_bound(ps_rows.begin(), ps_rows.end(),
+                                 (uint)ids[i][0]) - ps_rows.begin();
+  ps_x.init(ids.size(0), 1);
+  Copy(ps_x(), ids, Data<xpu>::s);
+  ps_x.clone_info(*x.in);
+
+  MatrixContainer<cpu> rows(Shape2(ps_rows.size(), dim));
+  ps->pull(ps_rows, rows);
+  ps_W.init(ps_rows.size(), dim);
+  Copy(ps_W(), rows, Data<xpu>::s);
+  ps_W.reset_grad();
+}
+
+// the servers regularize and update (ps_server::apply)
+template <typename xpu>
+void proj<xpu>::push() {
+  MatrixContainer<cpu> g(ps_W.d().shape_);
+  Copy(g, ps_W.d(), Data<xpu>::s);
+  Data<xpu>::s->Wait();
+  ps->push(ps_rows, g);
+}
+
+template <typename xpu>
+void proj<xpu>::update() {
+  if (ps) return;
+  if (trains() and !touched.empty()) {
+    auto index = make_MC<xpu>(std::vector<Real>(touched.begin(), touched.end()));
+    W.update_rows(touched, vec(*index));
+  }
+  reset_grad();
+}
+
+// rows with a gradient in other's W are summed into ours, so they are touched
+template <typename xpu>
+void proj<xpu>::merge_replica(layer<xpu>& other) {
+  auto& o = static_cast<proj<xpu>&>(other);
+  std::vector<uint> merged;
+  std::set_union(touched.begin(), touched.end(), o.touched.begin(),
+                 o.touched.end(), std::back_inserter(merged));
+  touched.swap(merged);
+}
+
+// W.d() is zero outside of touched, so only those rows are cleared
+template <typename xpu>
+void proj<xpu>::reset_grad() {
+  if (touched.empty()) return;
+  auto index = make_MC<xpu>(std::vector<Real>(touched.begin(), touched.end()));
+  auto zeros = make_MC<xpu>(touched.size(), W().size(1));
+  IndexFill(W.d(), vec(*index), *zeros);
+  touched.clear();
 }
 
 } // end namespace layer
@@ -33,6 +33,11 @@ class recurrent : public layer<xpu> {
     virtual std::vector<Weight<xpu>*> params() { return {&W, &V, &b}; };
     virtual std::vector<Input<xpu>*> ins() { return {&x}; };
     virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+
+  private:
+    uint prev_rows(int t) { // rows of step t that continue from step t-incr
+      return std::min(h.batch_size_at(t), h.batch_size_at(t-incr));
+    }
 };
 
 template <typename xpu>
@@ -64,11 +69,10 @@ void recurrent<xpu>::forward() {
   h.clone_info(*x);
 
   uint Tbs = x().size(0);
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+  uint T = x.in->len();
 
   h.init(Tbs, dim);
-  h.reset_grad();
+  this->init_grad(h);
 
   h() = dot(x(), W());
   h() += repmat(vec(b()), Tbs);
@@ -76,25 +80,34 @@ void recurrent<xpu>::forward() {
   int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
 
   for (int t=begin; t!=end; t+=incr) {
-    if (t != begin) h(t) += dot(h(t-incr), V());
+    uint n = (t != begin) ? prev_rows(t) : 0;
+    if (n > 0) top_rows(h(t), n) += dot(top_rows(h(t-incr), n), V());
     f(h(t), h(t));
   }
 }
 
 template <typename xpu>
 void recurrent<xpu>::backward() {
-  uint Tbs = x().size(0);
   uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+  uint T = x.in->len();
+  bool packed = (h.pack != nullptr);
 
   int begin, end; if (incr > 0) { begin=0; end=T; } else { begin=T-1; end=-1; }
 
   for (int t=end-incr; t != begin-incr; t-=incr) {
     f.backward(h.d(t), h.d(t), h(t));
-    if (t != begin) {
-      V.d() += dot(h(t-incr).T(), h.d(t));
-      h.d(t-incr) += dot(h.d(t), V().T());
-    }
+    uint n = (t != begin) ? prev_rows(t) : 0;
+    if (n == 0) continue;
+    top_rows(h.d(t-incr), n) += dot(top_rows(h.d(t), n), V().T());
+    if (packed) V.d() += dot(top_rows(h(t-incr), n).T(), top_rows(h.d(t), n));
+  }
+
+  // V.d() for all steps at once: h(t-incr) against h.d(t), t != begin.
+  // packed steps do not line up, so those are accumulated per step above.
+  if (T > 1 and !packed) {
+    uint n = (T-1)*bs;
+    V.d() += dot(middle_rows(h(), (incr > 0) ? 0 : bs, n).T(),
+                 middle_rows(h.d(), (incr > 0) ? bs : 0, n));
   }
 
   if (x.has_grad()) // skip if truncation
@@ -32,6 +32,21 @@ class recursive : public layer<xpu> {
     };
     virtual std::vector<Input<xpu>*> ins() { return {&x}; };
     virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+
+  private:
+    // rows of h per level of the dag (see sdag::levels()), as spans of index
+    struct level_rows {
+      uint nodes, n;              // node rows at index[nodes .. nodes+n)
+      std::vector<uint> label, edges, m; // per label with edges: parent rows at
+                                         // edges, child rows at edges+m
+    };
+    std::vector<level_rows> schedule;
+    std::shared_ptr<MatrixContainer<xpu>> index; // [1 x all rows], as Reals
+
+    void make_schedule();
+    Vector<xpu> rows(uint begin, uint n) {
+      return vec(middle_cols(*index, begin, n));
+    }
 };
 
 template <typename xpu>
@@ -51,37 +66,90 @@ void recursive<xpu>::init() {
   b() = 0;
 }
 
+/* Nodes are computed level by level (by height) instead of one at a time:
+ * for each level and edge label the child rows are gathered into one matrix,
+ * multiplied with V[label] in a single GEMM and scatter-added to their parents.
+ * Backward walks the levels in reverse and does the same for the deltas.
+ */
+template <typename xpu>
+void recursive<xpu>::make_schedule() {
+  auto& levels = h.dag->levels();
+  uint bs = h.batch_size;
+  std::vector<Real> idx;
+  auto push = [&](const std::vector<uint>& nodes) { // each node has bs rows
+    for (auto n : nodes) for (uint r=0; r<bs; r++) idx.push_back(n*bs + r);
+  };
+
+  schedule.resize(levels.size());
+  for (uint k=0; k<levels.size(); k++) {
+    auto& lv = levels[k];
+    auto& s = schedule[k];
+    s.nodes = idx.size(); s.n = lv.nodes.size() * bs;
+    push(lv.nodes);
+    s.label.clear(); s.edges.clear(); s.m.clear();
+    for (uint l=0; l<lv.parents.size(); l++) {
+      if (lv.parents[l].empty()) continue;
+      s.label.push_back(l);
+      s.edges.push_back(idx.size());
+      s.m.push_back(lv.parents[l].size() * bs);
+      push(lv.parents[l]);
+      push(lv.children[l]);
+    }
+  }
+
+  index = make_MC<xpu>(idx);
+}
+
 template <typename xpu>
 void recursive<xpu>::forward() {
   if (W().size(0) == 0) init();
-  auto& dag = h.dag;
 
   h.clone_info(*x);
   h.init(x().size(0), dim);
-  h.reset_grad();
+  this->init_grad(h);
 
   h() = dot(x(), W());
   h() += repmat(vec(b()), x().size(0));
 
-  for (int n=dag->size()-1; n>=0; n--) {
-    for (auto& p : dag->children(n)) {
-      uint i = p.first, l = p.second;
-      h(n) += dot(h(i), V[l]());
+  make_schedule();
+  for (auto& s : schedule) {
+    for (uint k=0; k<s.label.size(); k++) {
+      uint m = s.m[k];
+      auto hc_ = make_MC<xpu>(m, dim), hp_ = make_MC<xpu>(m, dim);
+      auto &hc = *hc_, &hp = *hp_;
+      hc = take(rows(s.edges[k] + m, m), h());
+      hp = dot(hc, V[s.label[k]]());
+      AddTakeGrad(h(), rows(s.edges[k], m), hp);
     }
-    f(h(n), h(n));
+    auto z_ = make_MC<xpu>(s.n, dim);
+    auto& z = *z_;
+    z = take(rows(s.nodes, s.n), h());
+    f(z, z);
+    IndexFill(h(), rows(s.nodes, s.n), z);
   }
 }
 
 template <typename xpu>
 void recursive<xpu>::backward() {
-  auto& dag = h.dag;
-
-  for (uint n=0; n<dag->size(); n++) {
-    f.backward(h.d(n), h.d(n), h(n));
-    for (auto& p : dag->children(n)) {
-      uint i = p.first, l = p.second;
-      V[l].d() += dot(h(i).T(), h.d(n));
-      h.d(i) += dot(h.d(n), V[l]().T());
+  for (int k=schedule.size()-1; k>=0; k--) {
+    auto& s = schedule[k];
+    auto z_ = make_MC<xpu>(s.n, dim), dz_ = make_MC<xpu>(s.n, dim);
+    auto &z = *z_, &dz = *dz_;
+    z  = take(rows(s.nodes, s.n), h());
+    dz = take(rows(s.nodes, s.n), h.d());
+    f.backward(dz, dz, z);
+    IndexFill(h.d(), rows(s.nodes, s.n), dz);
+
+    for (uint j=0; j<s.label.size(); j++) {
+      uint m = s.m[j];
+      auto& Vl = V[s.label[j]];
+      auto dp_ = make_MC<xpu>(m, dim), hc_ = make_MC<xpu>(m, dim);
+      auto &dp = *dp_, &hc = *hc_;
+      dp = take(rows(s.edges[j], m), h.d());
+      hc = take(rows(s.edges[j] + m, m), h());
+      Vl.d() += dot(hc.T(), dp);
+      hc = dot(dp, Vl().T()); // reused for the child deltas
+      AddTakeGrad(h.d(), rows(s.edges[j] + m, m), hc);
     }
   }
 
@@ -0,0 +1,62 @@
+#ifndef MILK_ROOT_H
+#define MILK_ROOT_H
+
+namespace milk {
+namespace layer {
+
+// rows of the root nodes of a tree (or of every tree in a forest, see
+// sdag::merge), in order. what tail() is to sequences.
+template <typename xpu>
+class root : public layer<xpu> {
+  public:
+    root() {}
+    virtual void forward();
+    virtual void backward();
+
+    // io
+    Data<xpu> h;
+    Input<xpu> x;
+
+    virtual std::vector<Weight<xpu>*> params() { return {}; };
+    virtual std::vector<Input<xpu>*> ins() { return {&x}; };
+    virtual std::vector<Data<xpu>*> outs() { return {&h}; };
+
+  private:
+    std::shared_ptr<MatrixContainer<xpu>> index; // root rows of x, as Reals
+};
+
+template <typename xpu>
+void root<xpu>::forward() {
+  assert(x.in->dag);
+  uint bs = x.in->batch_size;
+  std::vector<Real> idx;
+  for (auto r : x.in->dag->root_nodes())
+    for (uint j=0; j<bs; j++) idx.push_back(r*bs + j);
+  index = make_MC<xpu>(idx);
+
+  h.clone_info(*x.in);
+  h.dag = nullptr;
+  h.batch_size = idx.size();
+  h.init(idx.size(), x().size(1));
+  h() = take(vec(*index), x());
+  this->init_grad(h);
+}
+
+template <typename xpu>
+void root<xpu>::backward() {
+  if (x.has_grad()) AddTakeGrad(x.d(), vec(*index), h.d());
+}
+
+} // end namespace layer
+
+
+namespace factory {
+template <typename xpu=MilkDefaultDev>
+std::shared_ptr<layer::root<xpu>> root() {
+  return std::make_shared<layer::root<xpu>>();
+}
+} // end namespace factory
+
+} // end namespace milk
+
+#endif
@@ -32,6 +32,8 @@ class smax_xent : public layer<xpu> {
     virtual std::vector<Weight<xpu>*> params() { return {}; };
     virtual std::vector<Input<xpu>*> ins() { return {&x, &y}; };
     virtual std::vector<Data<xpu>*> outs() { return {}; };
+    // backward, loss and error only read h, c and y
+    virtual std::vector<Input<xpu>*> kept_ins() { return {&y}; }
 };
 
 template <typename xpu>
@@ -74,14 +76,16 @@ void smax_xent<xpu>::backward_step(uint t) {
 
 template <typename xpu>
 Real smax_xent<xpu>::loss() { // loss value (xent). assume forward is done
-  VectorContainer<xpu> m(Shape1(h().size(0)));
+  auto m_ = make_MC<xpu>(1, h().size(0));
+  auto m = vec(*m_);
   m = mat_choose_row_element(F<Log>(h()), vec(y()));
   return -sum(m);
 }
 
 template <typename xpu>
 Real smax_xent<xpu>::error() { // assume forward and classify done
-  VectorContainer<xpu> equals(Shape1(h().size(0)));
+  auto equals_ = make_MC<xpu>(1, h().size(0));
+  auto equals = vec(*equals_);
   eq(equals, vec(c()), vec(y()));
 
   return h().size(0) - sum(equals);
@@ -28,9 +28,9 @@ void sqerr<xpu>::backward() {
 
 template <typename xpu>
 Real sqerr<xpu>::loss() { // loss value (0.5 sqerr). assume forward is done
-  MatrixContainer<xpu> d(x().shape_, 0.);
-  d += x() - y();
-  return 0.5 * sqsum(d);
+  auto d = make_MC<xpu>(x().size(0), x().size(1));
+  *d += x() - y();
+  return 0.5 * sqsum(*d);
 }
 
 template <typename xpu>
@@ -12,12 +12,32 @@ class stack : public layer<xpu> {
     stack(std::shared_ptr<layer<xpu>> a_bottom,
           std::shared_ptr<layer<xpu>> a_top);
 
-    virtual void forward()  { bottom->forward(); top->forward(); };
-    virtual void backward() { top->backward();   bottom->backward(); };
-    virtual void forward_step(uint t)  { bottom->forward_step(t); top->forward_step(t); };
-    virtual void backward_step(uint t) { top->backward_step(t);   bottom->backward_step(t); };
+    // sublayers are called through profile::timed (utils/profile.h)
+    virtual void forward() {
+      timed(bottom, profile::FORWARD)->forward();
+      timed(top, profile::FORWARD)->forward();
+    }
+    virtual void backward() {
+      timed(top, profile::BACKWARD)->backward();
+      timed(bottom, profile::BACKWARD)->backward();
+    }
+    virtual void forward_step(uint t) {
+      timed(bottom, profile::FORWARD_STEP)->forward_step(t);
+      timed(top, profile::FORWARD_STEP)->forward_step(t);
+    }
+    virtual void backward_step(uint t) {
+      timed(top, profile::BACKWARD_STEP)->backward_step(t);
+      timed(bottom, profile::BACKWARD_STEP)->backward_step(t);
+    }
     virtual void init()     { bottom->init();    top->init(); };
-    virtual void update()   { bottom->update();  top->update(); };
+    virtual void update() {
+      timed(bottom, profile::UPDATE)->update();
+      timed(top, profile::UPDATE)->update();
+    }
+    virtual void reset_grad() {
+      timed(bottom, profile::RESET_GRAD)->reset_grad();
+      timed(top, profile::RESET_GRAD)->reset_grad();
+    }
 
     virtual void set_mode(Mode mode) {
       bottom->set_mode(mode); top->set_mode(mode);
@@ -25,11 +45,23 @@ class stack : public layer<xpu> {
     virtual Real error() { return bottom->error() + top->error(); }
     virtual Real loss()  { return bottom->loss()  + top->loss();  }
 
+    using layer<xpu>::load_params;
+    virtual void load_params(std::istream& in) {
+      bottom->load_params(in); top->load_params(in);
+    }
+
     virtual std::vector<Weight<xpu>*> params() {
       return bottom->params() + top->params();
     }
+    virtual std::vector<const std::vector<uint>*> grad_rows() {
+      return bottom->grad_rows() + top->grad_rows();
+    }
     virtual std::vector<Input<xpu>*> ins();
     virtual std::vector<Data<xpu>*> outs();
+    virtual std::vector<layer<xpu>*> leaves() {
+      return bottom->leaves() + top->leaves();
+    }
+    virtual std::vector<layer<xpu>*> children() { return {bottom.get(), top.get()}; }
 };
 
 template <typename xpu>
@@ -0,0 +1,205 @@
+#ifndef MILK_STREAM_DATASTREAM_H
+#define MILK_STREAM_DATASTREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace milk {
+
+namespace layer {
+
+/* datastream over record files (utils/records.h, e.g. write_records) that
+ * holds a bounded number of records whatever the size of the corpus. Every
+ * epoch, readers threads each read every readers-th file of a permutation of
+ * the files, record by record, into a queue of up to queue_size. Records are
+ * taken from the readers in turn and go through a shuffle buffer of
+ * buffer_size: each output is a random pick of the buffer, replaced by the
+ * next record. The permutation and the picks are drawn from (seed, epoch),
+ * so the stream is deterministic. In TEST mode files and records come in
+ * order (with one reader, or as many readers interleave them).
+ *
+ * Readers only read the bytes of records (see raw_record), a record is
+ * made into Data by forward(), on the calling thread: reader threads have no
+ * device set and no stream of their own.
+ *
+ * Records whose first component is longer than max_len are skipped while
+ * reading. With set_shard only every num_shards-th file is read. set_data
+ * only restarts the epoch, the files are the data: trainers can run it with
+ * an empty dataset.
+ */
+template <typename xpu>
+class stream_datastream : public datastream<xpu> {
+  public:
+    stream_datastream(const std::vector<std::string>& a_files, uint n=2,
+                      uint a_buffer_size=1024, uint a_readers=1, uint a_seed=0,
+                      uint a_queue_size=64);
+    ~stream_datastream() { stop(); }
+
+    virtual void forward();
+    virtual void init() { stop(); this->count = 0; }
+    virtual void set_data(const std::vector<std::vector<Data<xpu>>*>&) { init(); }
+    virtual void set_mode(Mode mode);
+
+    std::vector<std::string> files;
+    uint buffer_size, readers, seed, queue_size;
+    bool use_mmap = true; // see record_reader
+    uint epoch = 0;       // epochs served
+
+  private:
+    typedef raw_record record;
+    struct reader {
+      std::thread t;
+      std::deque<record> q;
+      bool done = false;
+    };
+    std::vector<std::shared_ptr<reader>> rs; // empty between epochs
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    std::vector<record> buffer;
+    std::mt19937 gen;
+    uint turn = 0; // reader to take the next record from
+
+    void start();
+    void stop();
+    void read(reader& r, std::vector<std::string> fs);
+    bool take(record& rec);
+};
+
+template <typename xpu>
+stream_datastream<xpu>::stream_datastream(
+    const std::vector<std::string>& a_files, uint n, uint a_buffer_size,
+    uint a_readers, uint a_seed, uint a_queue_size)
+    : datastream<xpu>(n), files(a_files), buffer_size(a_buffer_size),
+      readers(a_readers), seed(a_seed), queue_size(a_queue_size) {
+  assert(!files.empty() and buffer_size > 0 and readers > 0 and queue_size > 0);
+}
+
+// readers for this epoch, and a full shuffle buffer
+template <typename xpu>
+void stream_datastream<xpu>::start() {
+  std::seed_seq ss{seed, epoch};
+  gen.seed(ss);
+  std::vector<std::string> order;
+  for (uint k=this->shard; k<files.size(); k+=this->num_shards)
+    order.push_back(files[k]);
+  assert(!order.empty());
+  if (this->mode == TRAIN) std::shuffle(order.begin(), order.end(), gen);
+
+  for (uint r=0; r<std::min<size_t>(readers, order.size()); r++) {
+    std::vector<std::string> fs;
+    for (uint k=r; k<order.size(); k+=readers) fs.push_back(order[k]);
+    rs.push_back(std::make_shared<reader>());
+    auto& rd = *rs.back();
+    rd.t = std::thread([this, &rd, fs]() { read(rd, fs); });
+  }
+  turn = 0;
+  uint cap = (this->mode == TRAIN) ? buffer_size : 1;
+  record rec;
+  while (buffer.size() < cap and take(rec)) buffer.push_back(rec);
+  assert(!buffer.empty()); // no record within max_len
+}
+
+template <typename xpu>
+void stream_datastream<xpu>::read(reader& r, std::vector<std::string> fs) {
+  uint max_len = this->max_len;
+  for (auto& f : fs) {
+    record_reader in(f, use_mmap);
+    assert(in.header.components == this->x.size());
+    record rec;
+    while (in.next(rec, max_len)) {
+      std::unique_lock<std::mutex> g(lock);
+      cv.wait(g, [&]() { return stopping or r.q.size() < queue_size; });
+      if (stopping) return;
+      r.q.push_back(std::move(rec));
+      cv.notify_all();
+    }
+  }
+  std::lock_guard<std::mutex> g(lock);
+  r.done = true;
+  cv.notify_all();
+}
+
+// next record of the readers, in turn. false when all are done
+template <typename xpu>
+bool stream_datastream<xpu>::take(record& rec) {
+  std::unique_lock<std::mutex> g(lock);
+  for (uint tried=0; tried<rs.size(); ) {
+    auto& r = *rs[turn];
+    turn = (turn + 1) % rs.size();
+    cv.wait(g, [&]() { return r.done or !r.q.empty(); });
+    if (r.q.empty()) { tried++; continue; } // done, try the next one
+    rec = std::move(r.q.front());
+    r.q.pop_front();
+    cv.notify_all();
+    return true;
+  }
+  return false;
+}
+
+template <typename xpu>
+void stream_datastream<xpu>::stop() {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    stopping = true;
+  }
+  cv.notify_all();
+  for (auto& r : rs) r->t.join();
+  rs.clear();
+  buffer.clear();
+  stopping = false;
+}
+
+// the epoch starts over in the other mode
+template <typename xpu>
+void stream_datastream<xpu>::set_mode(Mode mode) {
+  if (mode != this->mode) init();
+  datastream<xpu>::set_mode(mode);
+}
+
+template <typename xpu>
+void stream_datastream<xpu>::forward() {
+  if (rs.empty()) start();
+  uint pick = 0;
+  if (this->mode == TRAIN)
+    pick = std::uniform_int_distribution<uint>(0, buffer.size() - 1)(gen);
+  std::vector<Data<xpu>> x;
+  buffer[pick].parse(x);
+  assert(x.size() == this->x.size());
+  for (uint i=0; i<this->x.size(); i++) this->x[i] = x[i];
+  record rec;
+  if (take(rec)) {
+    buffer[pick] = std::move(rec);
+  } else {
+    buffer[pick] = std::move(buffer.back());
+    buffer.pop_back();
+  }
+  this->count++;
+  if (buffer.empty()) { // end of the epoch
+    stop();
+    this->count = 0;
+    epoch++;
+  }
+}
+
+} // end namespace layer
+
+namespace factory {
+
+template <typename xpu=MilkDefaultDev>
+std::shared_ptr<layer::stream_datastream<xpu>> stream_datastream(
+    const std::vector<std::string>& files, uint n=2, uint buffer_size=1024,
+    uint readers=1, uint seed=0, uint queue_size=64) {
+  return std::make_shared<layer::stream_datastream<xpu>>(
+      files, n, buffer_size, readers, seed, queue_size);
+}
+
+} // end namespace factory
+
+} // end namespace milk
+
+#endif
@@ -23,14 +23,22 @@ class tail : public layer<xpu> {
 template <typename xpu>
 void tail<xpu>::forward() {
   h.clone_info(*x.in);
+  h.pack = nullptr;
   h.init(h.batch_size, x().size(1));
-  h() += bottom_rows(x(), h.batch_size);
-  h.reset_grad();
+  if (!x.in->pack) h() += bottom_rows(x(), h.batch_size);
+  else x.in->pack->for_each_end([&](uint t, uint r, uint n) {
+    middle_rows(h(), r, n) += middle_rows(x(t), r, n);
+  });
+  this->init_grad(h);
 }
 
 template <typename xpu>
 void tail<xpu>::backward() {
-  if (x.has_grad()) bottom_rows(x.d(), h.batch_size) += h.d();
+  if (!x.has_grad()) return;
+  if (!x.in->pack) bottom_rows(x.d(), h.batch_size) += h.d();
+  else x.in->pack->for_each_end([&](uint t, uint r, uint n) {
+    middle_rows(x.d(t), r, n) += middle_rows(h.d(), r, n);
+  });
 }
 
 } // end namespace layer
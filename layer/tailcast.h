@@ -26,18 +26,37 @@ template <typename xpu>
 void tailcast<xpu>::forward() {
   h.clone_info(*x.in);
   h.init(x().size(0), x().size(1));
-  h.reset_grad();
-  uint T = x().size(0) / h.batch_size;
+  this->init_grad(h);
+  uint T = h.len();
+  if (!h.pack) {
+    for (uint t=0; t<T; t++)
+      h(t) += bottom_rows(x(), h.batch_size);
+    return;
+  }
+  // packed: gather the last step of each sequence, then broadcast
+  auto last = make_MC<xpu>(h.batch_size, x().size(1));
+  h.pack->for_each_end([&](uint t, uint r, uint n) {
+    middle_rows(*last, r, n) += middle_rows(x(t), r, n);
+  });
   for (uint t=0; t<T; t++)
-    h(t) += bottom_rows(x(), h.batch_size);
+    h(t) += top_rows(*last, h(t).size(0));
 }
 
 template <typename xpu>
 void tailcast<xpu>::backward() {
   if (x.has_grad()) {
-    uint T = x().size(0) / h.batch_size;
+    uint T = h.len();
+    if (!h.pack) {
+      for (uint t=0; t<T; t++)
+        bottom_rows(x.d(), h.batch_size) += h.d(t);
+      return;
+    }
+    auto last = make_MC<xpu>(h.batch_size, x().size(1));
     for (uint t=0; t<T; t++)
-      bottom_rows(x.d(), h.batch_size) += h.d(t);
+      top_rows(*last, h.d(t).size(0)) += h.d(t);
+    h.pack->for_each_end([&](uint t, uint r, uint n) {
+      middle_rows(x.d(t), r, n) += middle_rows(*last, r, n);
+    });
   }
 }
 
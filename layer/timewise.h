@@ -13,16 +13,26 @@ class timewise : public layer<xpu> {
     virtual void forward();
     virtual void backward();
     virtual void init()     { l->init(); }
-    virtual void update()   { l->update(); }
+    virtual void update()   { timed(l, profile::UPDATE)->update(); }
+    virtual void reset_grad() { timed(l, profile::RESET_GRAD)->reset_grad(); }
 
-    virtual void set_mode(Mode mode) { l->set_mode(mode); }
+    // a leaf to leaves() (e.g. for memplan), so it keeps a mode of its own
+    virtual void set_mode(Mode mode) { this->mode = mode; l->set_mode(mode); }
+    virtual void merge_replica(layer<xpu>& other) {
+      l->merge_replica(*static_cast<timewise<xpu>&>(other).l);
+    }
 
     virtual Real error() { return l->error(); }
     virtual Real loss() { return l->loss(); }
 
+    using layer<xpu>::load_params;
+    virtual void load_params(std::istream& in) { l->load_params(in); }
+
     virtual std::vector<Weight<xpu>*> params() { return l->params(); }
+    virtual std::vector<const std::vector<uint>*> grad_rows() { return l->grad_rows(); }
     virtual std::vector<Input<xpu>*> ins() { return l->ins(); }
     virtual std::vector<Data<xpu>*> outs() { return l->outs(); }
+    virtual std::vector<layer<xpu>*> children() { return {l.get()}; }
 };
 
 template <typename xpu>
@@ -31,21 +41,18 @@ timewise<xpu>::timewise(std::shared_ptr<layer<xpu>> a_l) : l(a_l) {}
 template <typename xpu>
 void timewise<xpu>::forward() {
   auto& x = *(l->ins()[0]);
-  uint Tbs = x().size(0); // time*batch
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+  uint T = x.in->len();
 
-  for (int t=0; t<T; t++) l->forward_step(t);
+  for (int t=0; t<T; t++) timed(l, profile::FORWARD_STEP)->forward_step(t);
 }
 
 template <typename xpu>
 void timewise<xpu>::backward() {
   auto& x = *(l->ins()[0]);
-  uint Tbs = x().size(0); // time*batch
-  uint bs = x.in->batch_size;
-  uint T = Tbs / bs;
+  uint T = x.in->len();
 
-  for (int t=T-1; t>=0; t--) l->backward_step(t);
+  for (int t=T-1; t>=0; t--)
+    timed(l, profile::BACKWARD_STEP)->backward_step(t);
 }
 
 } // end namespace layer
@@ -0,0 +1,163 @@
+#ifndef MILK_MEMPLAN_H
+#define MILK_MEMPLAN_H
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace milk {
+
+/* memplan shares activation storage between the outputs of a stack/join tree.
+ * The first forward() is traced leaf by leaf to find, for every output
+ * buffer, the leaf that produces it and the last leaf that reads it. Buffers
+ * whose lifetimes do not overlap are then assigned to the same slab, so a
+ * buffer is effectively freed as soon as its consumers are done. Later
+ * forward()s run as usual, on the shared slabs.
+ *
+ * In TEST mode a buffer lives until its last reader in forward(). In TRAIN
+ * mode the values backward() reads (layer::kept_ins and kept_outs, e.g. not
+ * the input of smax_xent, nor the output of an ff with nonlin::id) live
+ * until the end, so only the others are shared; in most networks that is
+ * little, as backward reads nearly every activation. On mpqa and sstb-rsv
+ * the TRAIN peak does not go down at all, so trainer::plan_memory pays off
+ * for evaluation (TEST), not for training. Gradients are not shared:
+ * init_grad() zeroes them all in forward() and consumers add into them.
+ * Plan again (release()) when the mode changes.
+ */
+template <typename xpu>
+class memplan {
+  public:
+    std::shared_ptr<layer::layer<xpu>> root;
+
+    size_t naive_bytes = 0;   // all outputs alive at once (no planning)
+    size_t planned_bytes = 0; // total size of the slabs
+    uint num_slabs = 0;
+
+    memplan(std::shared_ptr<layer::layer<xpu>> a_root) : root(a_root) {}
+
+    virtual void forward();
+    virtual void release();
+    virtual void print(std::ostream& out = std::cout);
+
+    bool planned() { return traced; }
+
+  private:
+    struct buffer {
+      Data<xpu>* owner;
+      uint begin, end; // first and last leaf that touches it
+      size_t bytes;
+      int slab;
+    };
+
+    bool traced = false;
+    std::vector<Data<xpu>*> outs; // planned outputs
+    std::vector<std::shared_ptr<MatrixContainer<xpu>>> slabs;
+
+    void plan(std::vector<buffer>& bufs, uint last);
+};
+
+template <typename xpu>
+void memplan<xpu>::forward() {
+  if (planned()) { root->forward(); return; }
+
+  auto leaves = root->leaves();
+  bool train = !leaves.empty() and leaves[0]->mode == TRAIN;
+  for (auto l : leaves) assert(l->mode == leaves[0]->mode);
+
+  std::vector<buffer> bufs;
+  std::unordered_map<MatrixContainer<xpu>*, uint> index; // storage -> buffer
+  auto touch = [&](Data<xpu>* d, uint k) {
+    auto it = index.find(d->w.get());
+    if (it != index.end()) bufs[it->second].end = std::max(bufs[it->second].end, k);
+    return it != index.end();
+  };
+
+  uint last = leaves.size();
+  for (uint k=0; k<leaves.size(); k++) {
+    auto l = leaves[k];
+    l->forward();
+    auto ins = l->ins();
+    auto outs_ = l->outs();
+    // sinks (loss layers) read their kept inputs again in error() / loss(),
+    // and in TRAIN mode every layer in backward()
+    auto kept_ins = l->kept_ins();
+    auto kept_outs = l->kept_outs();
+    bool late = train or outs_.empty();
+    for (auto x : ins) {
+      bool kept = std::count(kept_ins.begin(), kept_ins.end(), x);
+      if (x->in) touch(x->in, late and kept ? last : k);
+    }
+    if (ins.empty()) continue; // sources (datastream) own their outputs
+    for (auto h : outs_) {
+      bool kept = std::count(kept_outs.begin(), kept_outs.end(), h);
+      uint end = train and kept ? last : k;
+      if (touch(h, end)) continue; // aliases an input, e.g. cast
+      index[h->w.get()] = bufs.size();
+      bufs.push_back({h, k, end, h->w->shape_.Size() * sizeof(Real), -1});
+    }
+  }
+  for (auto h : root->outs()) touch(h, last); // read by whoever called us
+
+  plan(bufs, last);
+  traced = true;
+}
+
+// greedy interval assignment. a slab is only shared by buffers with the same
+// number of columns so that Resize() within its capacity never reallocates.
+template <typename xpu>
+void memplan<xpu>::plan(std::vector<buffer>& bufs, uint last) {
+  std::vector<uint> cols, free_after;
+  std::vector<size_t> cap;
+  naive_bytes = planned_bytes = 0;
+
+  slabs.clear();
+  for (auto& b : bufs) {
+    int best = -1;
+    for (uint s=0; s<slabs.size(); s++) {
+      if (cols[s] != b.owner->w->size(1) or free_after[s] >= b.begin) continue;
+      if (best == -1 or cap[s] > cap[best]) best = s; // largest free one
+    }
+    if (best == -1) {
+      best = slabs.size();
+      slabs.push_back(make_MC<xpu>(0, b.owner->w->size(1)));
+      cols.push_back(b.owner->w->size(1));
+      free_after.push_back(0);
+      cap.push_back(0);
+    }
+    b.slab = best;
+    free_after[best] = b.end;
+    cap[best] = std::max(cap[best], b.bytes);
+    naive_bytes += b.bytes;
+  }
+  for (auto c : cap) planned_bytes += c;
+  num_slabs = slabs.size();
+
+  for (auto& b : bufs) {
+    if (b.end == last) { // still to be read, keep this batch's values
+      auto& slab = *slabs[b.slab];
+      auto& w = *b.owner->w;
+      pool<xpu>::get().resize(slab, w.size(0), w.size(1));
+      Copy(slab, w);
+    }
+    b.owner->w = slabs[b.slab];
+    outs.push_back(b.owner);
+  }
+}
+
+template <typename xpu>
+void memplan<xpu>::release() {
+  for (auto h : outs) h->w = make_MC<xpu>(0, 0);
+  outs.clear();
+  slabs.clear();
+  traced = false;
+}
+
+template <typename xpu>
+void memplan<xpu>::print(std::ostream& out) {
+  out << "activations: " << naive_bytes << " bytes naive, "
+      << planned_bytes << " bytes planned in " << num_slabs << " slabs"
+      << std::endl;
+}
+
+} // end namespace milk
+
+#endif
@@ -15,6 +15,7 @@
 #include "utils/utils"  // useful small functions
 #include "nonlin.h"     // NN nonlinearities (tanh, relu etc)
 #include "layer/layer"  // all NN layers
+#include "memplan.h"    // activation memory sharing (TEST and TRAIN)
 #include "trainer.h"    // convenience functions for training NNs
 
 #endif
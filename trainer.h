@@ -1,6 +1,11 @@
 #ifndef MILK_TRAINER_H
 #define MILK_TRAINER_H
 
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include "base.h"
 
 namespace milk {
@@ -12,6 +17,15 @@ class trainer {
     std::shared_ptr<layer::datastream<xpu>> ds;
     std::shared_ptr<layer::layer<xpu>> all; // ds >> nn together
 
+    bool plan_memory = false; // share activation buffers, see memplan
+    std::shared_ptr<memplan<xpu>> plan; // last plan, e.g. to print() it
+
+    // checkpoint to ckpt_fname every ckpt_every training steps, in the
+    // background (see checkpoint())
+    std::shared_ptr<async_checkpointer<xpu>> ckpt;
+    std::string ckpt_fname;
+    uint ckpt_every = 0, steps = 0;
+
     trainer(std::shared_ptr<layer::datastream<xpu>> a_ds,
             std::shared_ptr<layer::layer<xpu>> a_all)
       : ds(a_ds), all(a_all) {}
@@ -25,21 +39,38 @@ class trainer {
       ds->set_data(dataset);
       Real err = 0.;
       uint tot = 0;
+      plan = nullptr;
+      if (plan_memory) plan = std::make_shared<memplan<xpu>>(all);
       for (uint e=0; e<epoch; e++) {
         do {
-          all->forward();
+          if (plan)
+            plan->forward();
+          else
+            all->forward();
           err += all->error();
           //tot += ds->x[0].batch_size;
           tot += ds->x[1]().size(0);  // TODO: maybe make denominator generic
           if (train) {
             all->backward();
             all->update();
+            if (ckpt and ckpt_every and ++steps % ckpt_every == 0)
+              ckpt->save(all->params(), ckpt_fname);
           }
         } while (ds->count != num_iter);
       }
+      if (plan) plan->release();
       return err/tot;
     }
 
+    void checkpoint(const std::string& fname, uint every) {
+      if (!ckpt) ckpt = std::make_shared<async_checkpointer<xpu>>();
+      ckpt_fname = fname;
+      ckpt_every = every;
+    }
+
+    // blocks until pending checkpoints are written, e.g. before exiting
+    void wait() { if (ckpt) ckpt->wait(); }
+
     virtual Real train(std::vector<std::vector<Data<xpu>>*> dataset,
                        uint max_len=std::numeric_limits<uint>::max(),
                        uint epoch=1) {
@@ -52,6 +83,484 @@ class trainer {
     }
 };
 
+// base of the parallel trainers: replicas of the network, made by make() and
+// sharing the Weights (storage and updater state) of the prototype nn, each
+// with its own inputs (feeds), activations and gradients
+template <typename xpu>
+class replica_trainer : public trainer<xpu> {
+  public:
+    typedef std::function<std::shared_ptr<layer::layer<xpu>>(void)> maker;
+
+    maker make;
+    std::shared_ptr<layer::layer<xpu>> nn; // prototype, set it up before run
+    uint threads;
+
+    replica_trainer(std::shared_ptr<layer::datastream<xpu>> a_ds, maker a_make,
+                    uint a_threads)
+      : trainer<xpu>(a_ds, nullptr), make(a_make), nn(a_make()),
+        threads(std::max(a_threads, 1u)) { // at least the calling thread
+      this->all = std::make_shared<layer::stack<xpu>>(this->ds, nn);
+    }
+
+  protected:
+    std::vector<std::shared_ptr<layer::layer<xpu>>> replicas;
+    std::vector<std::vector<Data<xpu>>> feeds; // inputs of each replica
+    thread_pool pool{threads - 1}; // plus the calling thread
+
+    // f(i) for i < n: on the pool on cpu, otherwise in order on the calling
+    // thread, as pool threads have no device set and only a default stream
+    void for_each(uint n, std::function<void(uint)> f) {
+      for (uint i=0; i<n; i++) f(i);
+    }
+
+    bool initialized() {
+      auto P = nn->params();
+      return P.empty() or (*P[0])().size(0) > 0;
+    }
+
+    void make_replicas(uint n, Mode mode) {
+      assert(initialized());
+      for (auto& r : replicas) r->set_mode(mode);
+      while (replicas.size() < n) {
+        auto l = make();
+        l->set_mode(mode);
+        l->share_params(*nn);
+        feeds.emplace_back(this->ds->x.size()); // stands in for ds outputs
+        auto ins = l->ins();
+        auto& x = feeds.back();
+        for (uint k=0, j=0; k<ins.size() and j<x.size(); k++)
+          if (!ins[k]->in) ins[k]->connect_from(x[j++]);
+        replicas.push_back(l);
+      }
+    }
+
+    // rows updated by replicas are dirty in nn, for delta checkpoints
+    void merge_dirty() {
+      auto P = nn->params();
+      for (auto& r : replicas) {
+        auto Q = r->params();
+        for (uint k=0; k<P.size(); k++) {
+          if (Q[k]->all_dirty) P[k]->all_dirty = true;
+          else P[k]->mark_dirty(Q[k]->dirty);
+          Q[k]->mark_clean();
+        }
+      }
+    }
+};
+
+template <>
+inline void replica_trainer<cpu>::for_each(uint n,
+                                           std::function<void(uint)> f) {
+  pool.parallel_for(n, f);
+}
+
+/* Hogwild training: threads replicas pull batches from the shared ds and
+ * update the shared Weights without locks; only taking a batch is locked.
+ * Each thread has its own Data<xpu>::s. Meant for cpu, where the sparse
+ * updates of proj-heavy models rarely collide. The first batch of the first
+ * run trains nn alone, to initialize the Weights the replicas share.
+ * Updaters must be lock_free (adagrad, rmsprop, momentum); run throws for
+ * the others when training with more than one thread. Of these only adagrad
+ * (lazy_adagrad) updates just the touched rows of proj: with rmsprop or
+ * momentum every step updates all of W, which is neither sparse nor rarely
+ * colliding, so use adagrad for proj-heavy models.
+ */
+template <typename xpu>
+class hogwild_trainer : public replica_trainer<xpu> {
+  public:
+    hogwild_trainer(std::shared_ptr<layer::datastream<xpu>> a_ds,
+                    typename replica_trainer<xpu>::maker a_make,
+                    uint a_threads = std::max(1u, std::thread::hardware_concurrency()))
+      : replica_trainer<xpu>(a_ds, a_make, a_threads) {}
+
+    virtual Real run(std::vector<std::vector<Data<xpu>>*> dataset,
+                     Mode mode, bool train, uint epoch=1,
+                     uint max_len=std::numeric_limits<uint>::max(),
+                     uint num_iter = 0) {
+      auto& ds = this->ds;
+      this->all->set_mode(mode);
+      ds->max_len = max_len;
+      ds->set_data(dataset);
+      Real err = 0.;
+      uint tot = 0;
+
+      if (train and this->threads > 1)
+        for (auto W : this->nn->params()) // unset: rmsprop, see Weight::init
+          if (W->u and !W->u->lock_free())
+            throw std::invalid_argument("hogwild_trainer: updater is not "
+                                        "lock_free, see updater::lock_free");
+
+      bool first = !this->initialized();
+      if (first) { // initializes the Weights
+        assert(train);
+        this->all->forward();
+        err += this->all->error();
+        tot += ds->x[1]().size(0);
+        this->all->backward();
+        this->all->update();
+      }
+      this->make_replicas(this->threads, mode);
+
+      std::mutex lock;
+      for (uint e=0; e<epoch; e++) {
+        // the first batch may have been a whole epoch
+        bool done = first and e == 0 and ds->count == num_iter;
+        this->pool.parallel_for(this->threads, [&](uint i) {
+          auto& l = this->replicas[i];
+          auto& x = this->feeds[i];
+          Real err_ = 0.;
+          uint tot_ = 0;
+          while (true) {
+            {
+              std::lock_guard<std::mutex> g(lock);
+              if (done) break;
+              ds->forward();
+              for (uint j=0; j<x.size(); j++) x[j] = ds->x[j];
+              done = ds->count == num_iter;
+            }
+            l->forward();
+            err_ += l->error();
+            tot_ += x[1]().size(0);
+            if (train) {
+              l->backward();
+              l->update();
+            }
+          }
+          std::lock_guard<std::mutex> g(lock);
+          err += err_;
+          tot += tot_;
+        });
+      }
+      this->merge_dirty();
+      return err/tot;
+    }
+};
+
+// adds la * W to the gradient of W on the given rows (sorted), or on all of
+// them for nullptr, as layer::backward and proj::regularize do. for trainers
+// that sum the gradients of several backwards and regularize the sum once.
+template <typename xpu>
+void add_l2(Weight<xpu>* W, Real la, const std::vector<uint>* rows) {
+  if (la <= 0) return;
+  if (!rows) {
+    W->d() += la * (*W)();
+  } else if (!rows->empty()) {
+    auto index = make_MC<xpu>(std::vector<Real>(rows->begin(), rows->end()));
+    auto g = take_rows(vec(*index), W->d());
+    *g += la * take(vec(*index), (*W)());
+    IndexFill(W->d(), vec(*index), *g);
+  }
+}
+
+/* Synchronous data-parallel training: each batch is split into (up to)
+ * replicas slices (see slice_batch), which run forward and backward in
+ * parallel. Their gradients are summed into the first replica by a tree
+ * reduction in a fixed order (pairs at distance 1, 2, 4, ..), over blocks
+ * of rows of every Weight, and the first replica takes the single update.
+ * Results do not depend on threads or scheduling: they are bitwise the same
+ * as with threads = 1 for the same number of replicas. Replicas only run in
+ * parallel on cpu; on other devices they run in order on the calling thread
+ * and its stream (see replica_trainer::for_each). The replicas run
+ * without L2; the L2 of nn is added once to the sum, for proj on the rows
+ * any replica touched, as the plain trainer would for the whole batch.
+ */
+template <typename xpu>
+class data_parallel_trainer : public replica_trainer<xpu> {
+  public:
+    uint num_replicas;
+
+    data_parallel_trainer(std::shared_ptr<layer::datastream<xpu>> a_ds,
+                          typename replica_trainer<xpu>::maker a_make,
+                          uint a_replicas = std::max(1u, std::thread::hardware_concurrency()),
+                          uint a_threads = 0) // 0: one per replica
+      : replica_trainer<xpu>(a_ds, a_make, a_threads ? a_threads : a_replicas),
+        num_replicas(a_replicas) {}
+
+    virtual Real run(std::vector<std::vector<Data<xpu>>*> dataset,
+                     Mode mode, bool train, uint epoch=1,
+                     uint max_len=std::numeric_limits<uint>::max(),
+                     uint num_iter = 0) {
+      auto& ds = this->ds;
+      auto& R = this->replicas;
+      this->all->set_mode(mode);
+      ds->max_len = max_len;
+      ds->set_data(dataset);
+      Real err = 0.;
+      uint tot = 0;
+
+      bool pending = false; // a batch from ds not processed yet
+      if (!this->initialized()) { // forward only, to initialize the Weights
+        this->all->forward();
+        pending = true;
+      }
+      this->make_replicas(num_replicas, mode);
+      for (uint k=0; k<R.size(); k++) // L2 once, see reduce
+        for (auto& W : R[k]->params()) W->la = 0;
+
+      std::vector<Real> errs(R.size());
+      for (uint e=0; e<epoch; e++) {
+        do {
+          if (!pending) ds->forward();
+          pending = false;
+          uint bs = ds->x[0].batch_size;
+          uint n = std::min<uint>(R.size(), bs);
+          this->for_each(n, [&](uint k) {
+            uint begin = k * bs / n, end = (k+1) * bs / n;
+            for (uint j=0; j<ds->x.size(); j++)
+              slice_batch(&this->feeds[k][j], ds->x[j], begin, end - begin);
+            R[k]->forward();
+            errs[k] = R[k]->error();
+            if (train) R[k]->backward();
+          });
+          for (uint k=0; k<n; k++) err += errs[k];
+          tot += ds->x[1]().size(0);
+          if (train) {
+            reduce(n);
+            auto L0 = R[0]->leaves();
+            for (uint k=1; k<n; k++) {
+              auto Lk = R[k]->leaves();
+              for (uint i=0; i<L0.size(); i++) L0[i]->merge_replica(*Lk[i]);
+              R[k]->reset_grad();
+            }
+            R[0]->update();
+          }
+        } while (ds->count != num_iter);
+      }
+      this->merge_dirty();
+      return err/tot;
+    }
+
+  private:
+    static const uint block = 16384; // Reals per reduction task
+
+    // gradients of replicas 1..n-1 summed into replica 0. for Weights with
+    // grad_rows (proj) only the rows of the source are added, and the
+    // destination then has the union of both. then the L2 of nn is added,
+    // on the union of the rows of all replicas.
+    void reduce(uint n) {
+      struct task { uint dst, src, w, begin, rows; };
+      std::vector<std::vector<Weight<xpu>*>> P(n);
+      std::vector<std::vector<std::vector<uint>>> rows(n);
+      std::vector<std::vector<bool>> dense(n);
+      for (uint k=0; k<n; k++) {
+        P[k] = this->replicas[k]->params();
+        auto G = this->replicas[k]->grad_rows();
+        assert(G.size() == P[k].size());
+        rows[k].resize(G.size());
+        dense[k].resize(G.size());
+        for (uint w=0; w<G.size(); w++) {
+          dense[k][w] = !G[w];
+          if (G[w]) rows[k][w] = *G[w];
+        }
+      }
+      for (uint d=1; d<n; d*=2) {
+        std::vector<task> tasks;
+        for (uint i=0; i+d<n; i+=2*d) {
+          for (uint w=0; w<P[i].size(); w++) {
+            uint all = dense[i+d][w] ? P[i][w]->d().size(0) : rows[i+d][w].size();
+            uint cols = P[i][w]->d().size(1);
+            uint step = std::max(1u, block / std::max(1u, cols));
+            for (uint b=0; b<all; b+=step)
+              tasks.push_back({i, i+d, w, b, std::min(step, all - b)});
+          }
+        }
+        this->for_each(tasks.size(), [&](uint t) {
+          auto& k = tasks[t];
+          auto dst = P[k.dst][k.w]->d(), src = P[k.src][k.w]->d();
+          if (dense[k.src][k.w]) {
+            middle_rows(dst, k.begin, k.rows) += middle_rows(src, k.begin, k.rows);
+            return;
+          }
+          auto& r = rows[k.src][k.w];
+          auto index = make_MC<xpu>(std::vector<Real>(r.begin() + k.begin,
+                                                      r.begin() + k.begin + k.rows));
+          auto sum = take_rows(vec(*index), dst);
+          *sum += take(vec(*index), src);
+          IndexFill(dst, vec(*index), *sum);
+        });
+        for (uint i=0; i+d<n; i+=2*d)
+          for (uint w=0; w<P[i].size(); w++) {
+            if (dense[i][w] or dense[i+d][w]) { dense[i][w] = true; continue; }
+            std::vector<uint> merged;
+            std::set_union(rows[i][w].begin(), rows[i][w].end(),
+                           rows[i+d][w].begin(), rows[i+d][w].end(),
+                           std::back_inserter(merged));
+            rows[i][w].swap(merged);
+          }
+      }
+      auto Q = this->nn->params();
+      for (uint w=0; w<P[0].size(); w++)
+        add_l2(P[0][w], Q[w]->la, dense[0][w] ? nullptr : &rows[0][w]);
+    }
+};
+
+/* Multi-process data-parallel training: each rank of c trains ds >> nn on
+ * its own shard of ds (datastream::set_shard), the gradients of all ranks
+ * are summed with c->allreduce after every backward and every rank takes
+ * the same update, so the Weights stay identical. When nn is first
+ * initialized the Weights and updater state of rank 0 are broadcast. Ranks
+ * that run out of batches before the others contribute zero gradients until
+ * every rank is done with the epoch. For proj only the rows touched on some
+ * rank are summed, and updated on all. Backward runs without L2; the L2 of
+ * nn is added once to the sum.
+ */
+template <typename xpu>
+class dist_trainer : public trainer<xpu> {
+  public:
+    std::shared_ptr<comm> c;
+    std::shared_ptr<layer::layer<xpu>> nn;
+
+    dist_trainer(std::shared_ptr<layer::datastream<xpu>> a_ds,
+                 std::shared_ptr<layer::layer<xpu>> a_nn,
+                 std::shared_ptr<comm> a_c = make_comm())
+      : trainer<xpu>(a_ds, std::make_shared<layer::stack<xpu>>(a_ds, a_nn)),
+        c(a_c), nn(a_nn) {
+      this->ds->set_shard(c->rank, c->size);
+    }
+
+    virtual Real run(std::vector<std::vector<Data<xpu>>*> dataset,
+                     Mode mode, bool train, uint epoch=1,
+                     uint max_len=std::numeric_limits<uint>::max(),
+                     uint num_iter = 0) {
+      auto& ds = this->ds;
+      auto& all = this->all;
+      all->set_mode(mode);
+      ds->max_len = max_len;
+      ds->set_data(dataset);
+      Real err = 0.;
+      Real tot = 0;
+
+      auto P = nn->params();
+      bool pending = false; // a batch from ds not processed yet
+      if (!P.empty() and (*P[0])().size(0) == 0) {
+        all->forward(); // initializes the Weights
+        pending = true;
+        broadcast_params();
+      }
+      la.resize(P.size()); // L2 once, see allreduce_grads
+      for (uint i=0; i<P.size(); i++) {
+        la[i] = P[i]->la;
+        if (train) P[i]->la = 0;
+      }
+
+      for (uint e=0; e<epoch; e++) {
+        bool done = false;
+        while (true) {
+          bool active = !done; // has a batch this step
+          if (active) {
+            if (pending) nn->forward(); // again, with the broadcast Weights
+            else all->forward();
+            pending = false;
+            err += all->error();
+            tot += ds->x[1]().size(0);
+            if (train) all->backward();
+            done = ds->count == num_iter;
+          }
+          if (!train) {
+            if (done) break;
+            continue;
+          }
+          if (!allreduce_grads(active)) break; // every rank was done already
+          all->update();
+        }
+      }
+
+      for (uint i=0; i<P.size(); i++) P[i]->la = la[i];
+
+      Real sums[2] = {err, tot};
+      c->allreduce(sums, 2);
+      return sums[0]/sums[1];
+    }
+
+  private:
+    std::vector<Real> buf;
+    std::vector<Real> la; // of params(), while backward runs without
+
+    // values of params() and updater histories of rank 0 on every rank
+    void broadcast_params() {
+      std::vector<Matrix<xpu>> m;
+      for (auto W : nn->params()) {
+        m.push_back((*W)());
+        for (auto h : W->u->history()) m.push_back(*h);
+      }
+      flat(m, true);
+      c->broadcast(buf.data(), buf.size());
+      flat(m, false);
+    }
+
+    // sums gradients over the ranks and adds L2 once. returns whether any
+    // rank was active, i.e. had a batch this step. for proj the touched rows
+    // of all ranks are gathered first (a count per rank, then the rows), and
+    // only their union is summed; it becomes touched on every rank.
+    bool allreduce_grads(bool active) {
+      auto P = nn->params();
+      auto G = nn->grad_rows();
+      std::vector<layer::proj<xpu>*> projs;
+      for (auto l : nn->leaves())
+        if (auto p = dynamic_cast<layer::proj<xpu>*>(l))
+          if (!p->params().empty()) projs.push_back(p); // not served
+      uint np = projs.size(), size = c->size;
+
+      // counts and ids through the integer allreduce: ids past 2^24 are
+      // not exact as float Reals
+      std::vector<uint64_t> count(np * size + 1, 0);
+      for (uint i=0; i<np; i++) count[i*size + c->rank] = projs[i]->touched.size();
+      count.back() = active;
+      c->allreduce(count.data(), count.size());
+      if (count.back() == 0) return false;
+
+      std::vector<size_t> begin(np * size + 1, 0); // of each list in ids
+      for (uint k=0; k<np*size; k++) begin[k+1] = begin[k] + count[k];
+      std::vector<uint64_t> ids(begin.back(), 0);
+      for (uint i=0; i<np; i++) {
+        auto& t = projs[i]->touched;
+        std::copy(t.begin(), t.end(), ids.begin() + begin[i*size + c->rank]);
+      }
+      c->allreduce(ids.data(), ids.size());
+
+      std::vector<Matrix<xpu>> m;
+      for (uint w=0; w<P.size(); w++)
+        if (!G[w]) m.push_back(P[w]->d());
+      std::vector<std::shared_ptr<MatrixContainer<xpu>>> index(np), rows(np);
+      for (uint i=0; i<np; i++) {
+        std::vector<uint> u(ids.begin() + begin[i*size],
+                            ids.begin() + begin[(i+1)*size]);
+        std::sort(u.begin(), u.end());
+        u.erase(std::unique(u.begin(), u.end()), u.end());
+        projs[i]->touched.swap(u);
+        auto& t = projs[i]->touched;
+        if (t.empty()) continue; // e.g. not trained, W.d() may be unset
+        index[i] = make_MC<xpu>(std::vector<Real>(t.begin(), t.end()));
+        rows[i] = take_rows(vec(*index[i]), projs[i]->W.d());
+        m.push_back(*rows[i]);
+      }
+      flat(m, true);
+      c->allreduce(buf.data(), buf.size());
+      flat(m, false);
+      for (uint i=0; i<np; i++)
+        if (rows[i]) IndexFill(projs[i]->W.d(), vec(*index[i]), *rows[i]);
+
+      for (uint w=0; w<P.size(); w++) add_l2(P[w], la[w], G[w]);
+      return true;
+    }
+
+    // m to buf (to_buf) or back, returns the number of Reals
+    size_t flat(std::vector<Matrix<xpu>>& m, bool to_buf) {
+      size_t n = 0;
+      for (auto& x : m) n += x.size(0) * x.size(1);
+      if (to_buf) buf.resize(n);
+      n = 0;
+      for (auto& x : m) {
+        Matrix<cpu> b(buf.data() + n, x.shape_);
+        if (to_buf) Copy(b, x, Data<xpu>::s);
+        else Copy(x, b, Data<xpu>::s);
+        n += x.size(0) * x.size(1);
+      }
+      Data<xpu>::s->Wait();
+      return n;
+    }
+};
+
 } // end namespace milk
 
 #endif
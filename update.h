@@ -6,6 +6,8 @@
 
 namespace milk {
 
+class row_clock;
+
 template <typename xpu>
 class updater {
   public:
@@ -15,8 +17,86 @@ class updater {
     virtual void update(Matrix<xpu> w, Matrix<xpu> g) = 0;
     virtual void init(uint rows, uint cols) = 0;
     virtual std::vector<MatrixContainer<xpu>*> history() = 0;
+
+    // update when g is zero outside of the given rows (sorted, unique), also
+    // given as a vector of Reals for take(). the default is a dense update;
+    // updaters that can (adagrad, lazy_*) only touch the given rows.
+    virtual void update_rows(Matrix<xpu> w, Matrix<xpu> g,
+                             const std::vector<uint>&,
+                             Vector<xpu>) {
+      update(w, g);
+    }
+    // whether update_rows() leaves w and history() outside of rows alone
+    virtual bool sparse_rows() { return false; }
+    // bring rows skipped by update_rows() up to date, e.g. before saving.
+    // returns the rows whose value in w or history() it changed (sorted).
+    virtual std::vector<uint> sync(Matrix<xpu>) { return {}; }
+    // step bookkeeping of lazy updaters, or nullptr. checkpoints save it, so
+    // deltas can skip sync() (see save_delta).
+    virtual row_clock* step_clock() { return nullptr; }
+    // whether threads may update through it at once (hogwild_trainer): races
+    // then only lose some writes to w and history(). not so for updaters
+    // that count steps (adam, lazy_*), whose counters would go wrong.
+    virtual bool lock_free() { return true; }
 };
 
+// rows of m listed in index, as a new container
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> take_rows(Vector<xpu> index,
+                                                Matrix<xpu> m) {
+  auto x = make_MC<xpu>(index.size(0), m.size(1));
+  *x = take(index, m);
+  return x;
+}
+
+// step bookkeeping for lazy updaters: rows skipped by update_rows() are
+// caught up, as if they had seen zero gradients, when they are next touched.
+class row_clock {
+  public:
+    uint step = 0;
+    uint dense = 0;         // step of the last dense update (all rows)
+    std::vector<uint> last; // step of the last sparse update, per row
+    bool any_dense = false; // whether update() ever ran, besides sync()
+
+    void init(uint rows) { step = dense = 0; last.assign(rows, 0); any_dense = false; }
+    void tick() { dense = ++step; any_dense = true; }
+    // steps each of rows missed, then marks them as current
+    std::vector<uint> tick(const std::vector<uint>& rows) {
+      step++;
+      std::vector<uint> missed(rows.size());
+      for (uint i=0; i<rows.size(); i++) {
+        missed[i] = step - 1 - std::max(last[rows[i]], dense);
+        last[rows[i]] = step;
+      }
+      return missed;
+    }
+    // steps every row missed so far, then marks all rows as current
+    std::vector<uint> sync() {
+      std::vector<uint> missed(last.size());
+      for (uint r=0; r<last.size(); r++)
+        missed[r] = step - std::max(last[r], dense);
+      dense = step;
+      return missed;
+    }
+    // rows of missed (from sync) that skipped steps after an update reached
+    // them, so their state may have changed
+    std::vector<uint> stale(const std::vector<uint>& missed) {
+      std::vector<uint> rows;
+      for (uint r=0; r<missed.size(); r++)
+        if (missed[r] > 0 and (any_dense or last[r] > 0)) rows.push_back(r);
+      return rows;
+    }
+};
+
+// per row factors f(k) for k missed steps, as a [1 x n] container
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> row_factors(
+    const std::vector<uint>& missed, std::function<Real(uint)> f) {
+  std::vector<Real> v(missed.size());
+  for (uint i=0; i<missed.size(); i++) v[i] = f(missed[i]);
+  return make_MC<xpu>(v);
+}
+
 template <typename xpu>
 class adagrad : public updater<xpu> {
   public:
@@ -32,6 +112,18 @@ class adagrad : public updater<xpu> {
       h += g * g;
       w -= this->lr * g / F<Sqrt>(h + eps);
     }
+    // zero gradients leave h as is, so there is nothing to catch up
+    bool sparse_rows() { return true; }
+    void update_rows(Matrix<xpu> w, Matrix<xpu> g,
+                     const std::vector<uint>& rows, Vector<xpu> index) {
+      auto g_ = take_rows(index, g), h_ = take_rows(index, Matrix<xpu>(h));
+      auto w_ = take_rows(index, w);
+      clip(*g_, *g_);
+      *h_ += *g_ * *g_;
+      *w_ -= this->lr * *g_ / F<Sqrt>(*h_ + eps);
+      IndexFill(h, index, *h_);
+      IndexFill(w, index, *w_);
+    }
 };
 
 template <typename xpu>
@@ -89,6 +181,141 @@ class adam : public updater<xpu> {
       Real alpha_t = this->lr * std::sqrt(1.-beta2_t) / (1.-beta1_t);
       w -= alpha_t * m / (F<Sqrt>(v) + epsh);
     }
+    bool lock_free() { return false; } // beta1_t, beta2_t
+};
+
+/* Lazy variants for sparse gradients (e.g. proj): update_rows() only reads
+ * and writes the given rows. The optimizer state of a row that skipped k steps
+ * is first decayed as k steps of zero gradient would have (exact for rmsprop
+ * and momentum, which also moves w). sync() does the same for every row, so
+ * saved histories are current. For adam the skipped weight steps are dropped,
+ * as in lazy adam elsewhere; only the moments are decayed. adagrad is exact
+ * as is. With la > 0 a stale row is regularized before it is caught up.
+ */
+template <typename xpu>
+using lazy_adagrad = adagrad<xpu>;
+
+template <typename xpu>
+class lazy_rmsprop : public rmsprop<xpu> {
+  public:
+    row_clock clock;
+
+    void init(uint rows, uint cols) { rmsprop<xpu>::init(rows, cols); clock.init(rows); }
+    row_clock* step_clock() { return &clock; }
+    void update(Matrix<xpu> w, Matrix<xpu> g) { rmsprop<xpu>::update(w, g); clock.tick(); }
+    bool sparse_rows() { return true; }
+    bool lock_free() { return false; }
+    void update_rows(Matrix<xpu> w, Matrix<xpu> g,
+                     const std::vector<uint>& rows, Vector<xpu> index) {
+      Real rho = this->rho;
+      auto decay = row_factors<xpu>(clock.tick(rows),
+                                    [&](uint k) { return std::pow(rho, k); });
+      auto g_ = take_rows(index, g), h_ = take_rows(index, Matrix<xpu>(this->h));
+      auto w_ = take_rows(index, w);
+      *h_ *= broadcast<0>(vec(*decay), h_->shape_);
+      clip(*g_, *g_);
+      *h_ = *h_ * rho + *g_ * *g_ * (1.-rho);
+      *w_ -= this->lr * *g_ / F<Sqrt>(*h_ + this->eps);
+      IndexFill(this->h, index, *h_);
+      IndexFill(w, index, *w_);
+    }
+    std::vector<uint> sync(Matrix<xpu> w) { // decay h of every row, w stays
+      Real rho = this->rho;
+      auto missed = clock.sync();
+      auto decay = row_factors<xpu>(missed,
+                                    [&](uint k) { return std::pow(rho, k); });
+      this->h *= broadcast<0>(vec(*decay), w.shape_);
+      return clock.stale(missed);
+    }
+};
+
+template <typename xpu>
+class lazy_momentum : public momentum<xpu> {
+  public:
+    row_clock clock;
+
+    void init(uint rows, uint cols) { momentum<xpu>::init(rows, cols); clock.init(rows); }
+    row_clock* step_clock() { return &clock; }
+    void update(Matrix<xpu> w, Matrix<xpu> g) { momentum<xpu>::update(w, g); clock.tick(); }
+    bool sparse_rows() { return true; }
+    bool lock_free() { return false; }
+    void update_rows(Matrix<xpu> w, Matrix<xpu> g,
+                     const std::vector<uint>& rows, Vector<xpu> index) {
+      Real rho = this->rho;
+      auto missed = clock.tick(rows);
+      // k skipped steps: w -= (rho + .. + rho^k) v, v *= rho^k
+      auto drift = row_factors<xpu>(missed, [&](uint k) {
+        return rho * (1. - std::pow(rho, k)) / (1. - rho);
+      });
+      auto decay = row_factors<xpu>(missed,
+                                    [&](uint k) { return std::pow(rho, k); });
+      auto g_ = take_rows(index, g), v_ = take_rows(index, Matrix<xpu>(this->v));
+      auto w_ = take_rows(index, w);
+      *w_ -= *v_ * broadcast<0>(vec(*drift), v_->shape_);
+      *v_ *= broadcast<0>(vec(*decay), v_->shape_);
+      clip(*g_, *g_);
+      *v_ = *v_ * rho + this->lr * *g_;
+      *w_ -= *v_;
+      IndexFill(this->v, index, *v_);
+      IndexFill(w, index, *w_);
+    }
+    std::vector<uint> sync(Matrix<xpu> w) { // catch up every row without taking a step
+      Real rho = this->rho;
+      auto missed = clock.sync();
+      auto drift = row_factors<xpu>(missed, [&](uint k) {
+        return rho * (1. - std::pow(rho, k)) / (1. - rho);
+      });
+      auto decay = row_factors<xpu>(missed,
+                                    [&](uint k) { return std::pow(rho, k); });
+      w -= this->v * broadcast<0>(vec(*drift), w.shape_);
+      this->v *= broadcast<0>(vec(*decay), w.shape_);
+      return clock.stale(missed);
+    }
+};
+
+template <typename xpu>
+class lazy_adam : public adam<xpu> {
+  public:
+    row_clock clock;
+
+    void init(uint rows, uint cols) { adam<xpu>::init(rows, cols); clock.init(rows); }
+    row_clock* step_clock() { return &clock; }
+    void update(Matrix<xpu> w, Matrix<xpu> g) { adam<xpu>::update(w, g); clock.tick(); }
+    bool sparse_rows() { return true; }
+    void update_rows(Matrix<xpu> w, Matrix<xpu> g,
+                     const std::vector<uint>& rows, Vector<xpu> index) {
+      Real beta1 = this->beta1, beta2 = this->beta2;
+      auto missed = clock.tick(rows);
+      auto decay1 = row_factors<xpu>(missed,
+                                     [&](uint k) { return std::pow(beta1, k); });
+      auto decay2 = row_factors<xpu>(missed,
+                                     [&](uint k) { return std::pow(beta2, k); });
+      auto g_ = take_rows(index, g), w_ = take_rows(index, w);
+      auto m_ = take_rows(index, Matrix<xpu>(this->m));
+      auto v_ = take_rows(index, Matrix<xpu>(this->v));
+      *m_ *= broadcast<0>(vec(*decay1), m_->shape_);
+      *v_ *= broadcast<0>(vec(*decay2), v_->shape_);
+      clip(*g_, *g_);
+      this->beta1_t *= beta1; this->beta2_t *= beta2;
+      *m_ = beta1 * *m_ + (1.-beta1) * *g_;
+      *v_ = beta2 * *v_ + (1.-beta2) * *g_ * *g_;
+      Real alpha_t = this->lr * std::sqrt(1.-this->beta2_t) / (1.-this->beta1_t);
+      *w_ -= alpha_t * *m_ / (F<Sqrt>(*v_) + this->epsh);
+      IndexFill(this->m, index, *m_);
+      IndexFill(this->v, index, *v_);
+      IndexFill(w, index, *w_);
+    }
+    std::vector<uint> sync(Matrix<xpu> w) { // decay m and v of every row
+      Real beta1 = this->beta1, beta2 = this->beta2;
+      auto missed = clock.sync();
+      auto decay1 = row_factors<xpu>(missed,
+                                     [&](uint k) { return std::pow(beta1, k); });
+      auto decay2 = row_factors<xpu>(missed,
+                                     [&](uint k) { return std::pow(beta2, k); });
+      this->m *= broadcast<0>(vec(*decay1), w.shape_);
+      this->v *= broadcast<0>(vec(*decay2), w.shape_);
+      return clock.stale(missed);
+    }
 };
 
 //} // end namespace update
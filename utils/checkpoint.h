@@ -0,0 +1,690 @@
+#ifndef MILK_UTILS_CHECKPOINT_H
+#define MILK_UTILS_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include "mmap.h"
+#include "parallel.h"
+
+namespace milk {
+
+/* Binary checkpoint of a list of Weights (layer::params()) and their updater
+ * histories:
+ *
+ *   header   ckpt_header
+ *   arch     optional architecture description, arch_bytes of text
+ *   base     name of the checkpoint a delta applies to, base_bytes of text
+ *   table    num_tensors ckpt_entry, in params() order, each value followed
+ *            by its history()
+ *   data     row-major Reals of each tensor at its (aligned) offset, and for
+ *            rows of a delta their uint64 row numbers at index_offset
+ *
+ * Loading maps the file and, on cpu, aliases the values straight into the
+ * Weights (copy-on-write, so training never writes to the file); on other
+ * devices they take one copy each. No initializer runs. Files are written to
+ * fname.tmp, fsynced and renamed over fname, so a checkpoint is never
+ * truncated under a mapping of it (e.g. saving the params it was loaded
+ * into). Malformed or corrupted files throw std::runtime_error.
+ *
+ * A delta (save_delta) holds only the rows of each Weight that changed since
+ * the previous checkpoint, its base. Loading one replays the chain down to
+ * the last full checkpoint; compact_checkpoint merges a chain into one file.
+ * Lazy updaters also save their row clock (see clock_tensor), so rows that
+ * skipped steps are caught up after loading as they would have been without.
+ */
+struct ckpt_header {
+  char magic[8];          // ckpt_magic
+  uint32_t version;       // ckpt_version
+  uint32_t real_size;     // sizeof(Real) of the data
+  uint64_t num_tensors;
+  uint64_t arch_bytes;    // right after the header
+  uint64_t base_bytes;    // right after arch, 0 unless a delta
+  uint64_t table_offset;
+  uint64_t table_checksum;
+};
+
+struct ckpt_entry {
+  uint64_t rows, cols;
+  uint64_t offset;        // of the data from the start of the file
+  uint32_t weight;        // index of the Weight in params()
+  uint32_t role;          // 0 for the value, k+1 for history()[k], then
+                          // the row clock if any
+  uint64_t full_rows;     // of the tensor, more than rows for delta rows
+  uint64_t index_offset;  // of the row numbers, 0 when all rows are here
+  uint64_t checksum;      // of the data and row numbers
+};
+
+// version 1, before deltas: no base and whole tensors only. still read.
+struct ckpt_header_v1 {
+  char magic[8];
+  uint32_t version, real_size;
+  uint64_t num_tensors, arch_bytes, table_offset, table_checksum;
+};
+
+struct ckpt_entry_v1 {
+  uint64_t rows, cols, offset;
+  uint32_t weight, role;
+  uint64_t checksum;
+};
+
+const char ckpt_magic[8] = {'m','i','l','k','c','k','p','t'};
+const uint32_t ckpt_version = 2; // written; 1 and 2 are read
+const uint64_t ckpt_align = 64;
+
+// 64 bit fnv-1a
+inline uint64_t checksum(const void* data, size_t bytes,
+                         uint64_t h = 14695981039346656037ull) {
+  auto p = (const unsigned char*)data;
+  for (size_t i=0; i<bytes; i++) { h ^= p[i]; h *= 1099511628211ull; }
+  return h;
+}
+
+inline bool is_checkpoint(const std::string& fname) {
+  std::ifstream in(fname, std::ios::binary);
+  char magic[8] = {0};
+  in.read(magic, sizeof(magic));
+  return in and std::memcmp(magic, ckpt_magic, sizeof(magic)) == 0;
+}
+
+// a tensor to be written, with a host view of its values. for delta rows
+// also the row numbers of data in the full tensor (sorted).
+struct ckpt_tensor {
+  uint32_t weight, role;
+  Matrix<cpu> data;
+  const std::vector<uint64_t>* rows; // nullptr for whole tensors
+  uint64_t full_rows;
+
+  ckpt_tensor(uint32_t a_weight, uint32_t a_role, Matrix<cpu> a_data,
+              const std::vector<uint64_t>* a_rows = nullptr,
+              uint64_t a_full_rows = 0)
+    : weight(a_weight), role(a_role), data(a_data), rows(a_rows),
+      full_rows(a_full_rows) {}
+};
+
+// host view of m: m itself on cpu, otherwise a copy that keep holds on to
+template <typename xpu>
+Matrix<cpu> host_view(Matrix<xpu> m,
+                      std::vector<std::shared_ptr<MatrixContainer<cpu>>>& keep) {
+  keep.push_back(std::make_shared<MatrixContainer<cpu>>(m.shape_));
+  Copy(*keep.back(), m, Data<xpu>::s);
+  return *keep.back();
+}
+
+template <>
+inline Matrix<cpu> host_view<cpu>(Matrix<cpu> m,
+    std::vector<std::shared_ptr<MatrixContainer<cpu>>>& keep) {
+  if (m.stride_ == m.size(1)) return m;
+  keep.push_back(std::make_shared<MatrixContainer<cpu>>(m.shape_));
+  Copy(*keep.back(), m);
+  return *keep.back();
+}
+
+// the row clock of a lazy updater (update.h) as a [rows+3 x 1] tensor: last
+// of each row, then step, dense and any_dense, each as the bits of a uint32
+// in a Real so that step counts stay exact
+inline Matrix<cpu> clock_tensor(const row_clock& c,
+                                std::vector<std::shared_ptr<MatrixContainer<cpu>>>& keep) {
+  uint n = c.last.size();
+  keep.push_back(std::make_shared<MatrixContainer<cpu>>(Shape2(n + 3, 1), Real(0)));
+  Matrix<cpu> m = *keep.back();
+  auto put = [&](uint r, uint32_t v) { std::memcpy(m[r].dptr_, &v, sizeof(v)); };
+  for (uint r=0; r<n; r++) put(r, c.last[r]);
+  put(n, c.step); put(n + 1, c.dense); put(n + 2, c.any_dense);
+  return m;
+}
+
+// c from a clock_tensor
+inline void set_clock(row_clock& c, Matrix<cpu> m) {
+  auto get = [&](uint r) {
+    uint32_t v;
+    std::memcpy(&v, m[r].dptr_, sizeof(v));
+    return v;
+  };
+  uint n = m.size(0) - 3;
+  c.last.resize(n);
+  for (uint r=0; r<n; r++) c.last[r] = get(r);
+  c.step = get(n); c.dense = get(n + 1); c.any_dense = get(n + 2);
+}
+
+// throws a checkpoint error about fname unless ok
+inline void ckpt_check(bool ok, const std::string& fname, const char* what) {
+  if (!ok) throw std::runtime_error("checkpoint " + fname + ": " + what);
+}
+
+// flushes fname to disk
+inline void sync_file(const std::string& fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  ckpt_check(fd != -1, fname, "cannot open to sync");
+  int err = fsync(fd);
+  close(fd);
+  ckpt_check(err == 0, fname, "fsync failed");
+}
+
+inline uint64_t align_ckpt(uint64_t offset) {
+  return (offset + ckpt_align - 1) / ckpt_align * ckpt_align;
+}
+
+// writes fname.tmp, then syncs and renames it to fname
+inline void write_checkpoint(const std::string& fname,
+                             const std::vector<ckpt_tensor>& tensors,
+                             const std::string& arch = "",
+                             const std::string& base = "") {
+  ckpt_header hdr;
+  std::memcpy(hdr.magic, ckpt_magic, sizeof(hdr.magic));
+  hdr.version = ckpt_version;
+  hdr.real_size = sizeof(Real);
+  hdr.num_tensors = tensors.size();
+  hdr.arch_bytes = arch.size();
+  hdr.base_bytes = base.size();
+  hdr.table_offset = sizeof(hdr) + arch.size() + base.size();
+
+  std::vector<ckpt_entry> table(tensors.size());
+  uint64_t offset = hdr.table_offset + table.size() * sizeof(ckpt_entry);
+  for (uint i=0; i<tensors.size(); i++) {
+    auto& t = tensors[i];
+    auto& m = t.data;
+    assert(m.stride_ == m.size(1)); // contiguous, see host_view
+    auto& e = table[i];
+    e.rows = m.size(0); e.cols = m.size(1);
+    e.offset = offset = align_ckpt(offset);
+    e.weight = t.weight; e.role = t.role;
+    e.checksum = checksum(m.dptr_, e.rows * e.cols * sizeof(Real));
+    offset += e.rows * e.cols * sizeof(Real);
+    e.full_rows = e.rows;
+    e.index_offset = 0;
+    if (t.rows) {
+      assert(t.rows->size() == e.rows and t.full_rows >= e.rows);
+      e.full_rows = t.full_rows;
+      e.index_offset = offset = align_ckpt(offset);
+      e.checksum = checksum(t.rows->data(), e.rows * sizeof(uint64_t), e.checksum);
+      offset += e.rows * sizeof(uint64_t);
+    }
+  }
+  hdr.table_checksum = checksum(table.data(), table.size() * sizeof(ckpt_entry));
+
+  std::string tmp = fname + ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  ckpt_check(out.is_open(), tmp, "cannot open for writing");
+  out.write((const char*)&hdr, sizeof(hdr));
+  out.write(arch.data(), arch.size());
+  out.write(base.data(), base.size());
+  out.write((const char*)table.data(), table.size() * sizeof(ckpt_entry));
+  for (uint i=0; i<tensors.size(); i++) {
+    auto& m = tensors[i].data;
+    out.seekp(table[i].offset);
+    out.write((const char*)m.dptr_, m.size(0) * m.size(1) * sizeof(Real));
+    if (tensors[i].rows) {
+      out.seekp(table[i].index_offset);
+      out.write((const char*)tensors[i].rows->data(),
+                table[i].rows * sizeof(uint64_t));
+    }
+  }
+  out.close();
+  ckpt_check(!out.fail(), tmp, "write failed");
+  sync_file(tmp);
+  ckpt_check(std::rename(tmp.c_str(), fname.c_str()) == 0, fname,
+             "cannot rename the .tmp file to it");
+}
+
+template <typename xpu>
+void save_checkpoint(const std::vector<Weight<xpu>*>& params,
+                     const std::string& fname, const std::string& arch = "") {
+  std::vector<std::shared_ptr<MatrixContainer<cpu>>> keep;
+  std::vector<ckpt_tensor> tensors;
+  for (uint i=0; i<params.size(); i++) {
+    auto W = params[i];
+    W->u->sync((*W)());
+    W->mark_clean();
+    tensors.push_back({i, 0, host_view<xpu>((*W)(), keep)});
+    auto hist = W->u->history();
+    for (uint k=0; k<hist.size(); k++)
+      tensors.push_back({i, k+1, host_view<xpu>(*hist[k], keep)});
+    if (auto c = W->u->step_clock())
+      tensors.push_back({i, uint32_t(hist.size() + 1), clock_tensor(*c, keep)});
+  }
+  Data<xpu>::s->Wait();
+  write_checkpoint(fname, tensors, arch);
+}
+
+// name of base as stored in a delta at fname: relative when they share a
+// directory, so the chain can be moved as a whole, else absolute
+inline std::string base_name(const std::string& fname, const std::string& base) {
+  auto dir = fname.substr(0, fname.rfind('/') + 1);
+  if (!dir.empty() and base.compare(0, dir.size(), dir) == 0)
+    return base.substr(dir.size());
+  if (dir.empty() and base.find('/') == std::string::npos) return base;
+  char* p = realpath(base.c_str(), nullptr);
+  ckpt_check(p != nullptr, base, "cannot resolve the path of the base");
+  std::string abs(p);
+  std::free(p);
+  return abs;
+}
+
+// path of base, as stored in the delta at fname
+inline std::string base_path(const std::string& fname, const std::string& base) {
+  if (base.empty() or base[0] == '/') return base;
+  return fname.substr(0, fname.rfind('/') + 1) + base;
+}
+
+// the rows of each Weight changed since the last checkpoint, which must be
+// base (full or delta). Weights that were updated densely are saved whole.
+// lazy updaters are not synced, rows that skipped steps stay as they are and
+// their row clock is saved along (rows of the changed rows, and the steps).
+template <typename xpu>
+void save_delta(const std::vector<Weight<xpu>*>& params,
+                const std::string& fname, const std::string& base,
+                const std::string& arch = "") {
+  std::vector<std::shared_ptr<MatrixContainer<cpu>>> keep;
+  std::vector<std::vector<uint64_t>> rows(params.size()), clock_rows(params.size());
+  std::vector<ckpt_tensor> tensors;
+  for (uint i=0; i<params.size(); i++) {
+    auto W = params[i];
+    auto hist = W->u->history();
+    auto c = W->u->step_clock();
+    uint32_t clock_role = hist.size() + 1;
+    if (W->all_dirty) {
+      tensors.push_back({i, 0, host_view<xpu>((*W)(), keep)});
+      for (uint k=0; k<hist.size(); k++)
+        tensors.push_back({i, k+1, host_view<xpu>(*hist[k], keep)});
+      if (c) tensors.push_back({i, clock_role, clock_tensor(*c, keep)});
+    } else {
+      rows[i].assign(W->dirty.begin(), W->dirty.end());
+      uint64_t n = (*W)().size(0);
+      std::vector<Matrix<xpu>> m = {(*W)()};
+      for (auto h : hist) m.push_back(*h);
+      if (W->dirty.empty()) { // still listed, so the tables line up
+        for (uint k=0; k<m.size(); k++)
+          tensors.push_back({i, k, Matrix<cpu>(nullptr, Shape2(0, m[k].size(1))),
+                             &rows[i], n});
+      } else {
+        auto index = make_MC<xpu>(std::vector<Real>(W->dirty.begin(),
+                                                    W->dirty.end()));
+        for (uint k=0; k<m.size(); k++) {
+          auto r = take_rows(vec(*index), m[k]);
+          keep.push_back(std::make_shared<MatrixContainer<cpu>>(r->shape_));
+          Copy(*keep.back(), *r, Data<xpu>::s);
+          tensors.push_back({i, k, *keep.back(), &rows[i], n});
+        }
+      }
+      if (c) {
+        auto t = clock_tensor(*c, keep);
+        auto& r = clock_rows[i];
+        r = rows[i];
+        for (uint64_t k=n; k<n+3; k++) r.push_back(k);
+        keep.push_back(std::make_shared<MatrixContainer<cpu>>(Shape2(r.size(), 1)));
+        for (uint k=0; k<r.size(); k++) Copy((*keep.back())[k], t[r[k]]);
+        tensors.push_back({i, clock_role, *keep.back(), &r, n + 3});
+      }
+    }
+    W->mark_clean();
+  }
+  Data<xpu>::s->Wait();
+  write_checkpoint(fname, tensors, arch, base_name(fname, base));
+}
+
+/* Checkpoints written by a background thread. save() only copies params()
+ * and their histories into a host staging buffer (a memcpy on cpu), so the
+ * training loop stalls for the snapshot, not for serialization. fname is
+ * always a complete checkpoint (see write_checkpoint). At most depth
+ * snapshots are in flight (double-buffered by default); save() blocks while
+ * they all are. A write that fails (e.g. a full disk) is thrown from the next
+ * save() or wait(), not on the writer.
+ */
+template <typename xpu>
+class async_checkpointer {
+  public:
+    async_checkpointer(uint depth = 2) : free(depth) {
+      for (auto& s : free) s = std::make_shared<stage>();
+      writer = std::thread([this]() { run(); });
+    }
+    ~async_checkpointer() {
+      drain(); // a pending error is dropped, destructors do not throw
+      {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+      }
+      cv.notify_all();
+      writer.join();
+    }
+
+    async_checkpointer(const async_checkpointer&) = delete;
+    async_checkpointer& operator=(const async_checkpointer&) = delete;
+
+    void save(const std::vector<Weight<xpu>*>& params,
+              const std::string& fname, const std::string& arch = "") {
+      std::shared_ptr<stage> s;
+      {
+        std::unique_lock<std::mutex> g(lock);
+        cv.wait(g, [this]() { return !free.empty(); }); // back-pressure
+        rethrow();
+        s = free.back();
+        free.pop_back();
+      }
+      s->fname = fname; s->arch = arch;
+      s->tensors.clear();
+      s->clocks.clear();
+      uint n = 0;
+      for (uint i=0; i<params.size(); i++) {
+        auto W = params[i];
+        W->u->sync((*W)());
+        W->mark_clean();
+        s->tensors.push_back({i, 0, s->copy(n++, (*W)())});
+        auto hist = W->u->history();
+        for (uint k=0; k<hist.size(); k++)
+          s->tensors.push_back({i, k+1, s->copy(n++, *hist[k])});
+        if (auto c = W->u->step_clock())
+          s->tensors.push_back({i, uint32_t(hist.size() + 1),
+                                clock_tensor(*c, s->clocks)});
+      }
+      Data<xpu>::s->Wait();
+      {
+        std::lock_guard<std::mutex> g(lock);
+        queue.push_back(s);
+      }
+      cv.notify_all();
+    }
+
+    // blocks until every saved checkpoint is on disk, throws the first
+    // write that failed since the last save() or wait()
+    void wait() {
+      std::unique_lock<std::mutex> g(lock);
+      cv.wait(g, [this]() { return queue.empty() and !busy; });
+      rethrow();
+    }
+
+  private:
+    struct stage {
+      std::string fname, arch;
+      std::vector<ckpt_tensor> tensors;
+      std::vector<std::shared_ptr<MatrixContainer<cpu>>> buf; // reused
+      std::vector<std::shared_ptr<MatrixContainer<cpu>>> clocks; // see clock_tensor
+
+      Matrix<cpu> copy(uint n, Matrix<xpu> m) {
+        if (buf.size() <= n) buf.resize(n+1);
+        if (!buf[n] or buf[n]->shape_ != m.shape_)
+          buf[n] = std::make_shared<MatrixContainer<cpu>>(m.shape_);
+        Copy(*buf[n], m, Data<xpu>::s);
+        return *buf[n];
+      }
+    };
+
+    std::vector<std::shared_ptr<stage>> free;
+    std::deque<std::shared_ptr<stage>> queue;
+    bool busy = false, stopping = false;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread writer;
+    std::exception_ptr error; // of a failed write, see rethrow
+
+    void drain() {
+      std::unique_lock<std::mutex> g(lock);
+      cv.wait(g, [this]() { return queue.empty() and !busy; });
+    }
+
+    // with lock held
+    void rethrow() {
+      if (!error) return;
+      auto e = error;
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+
+    void run() {
+      while (true) {
+        std::shared_ptr<stage> s;
+        {
+          std::unique_lock<std::mutex> g(lock);
+          cv.wait(g, [this]() { return stopping or !queue.empty(); });
+          if (queue.empty()) return; // stopping
+          s = queue.front();
+          queue.pop_front();
+          busy = true;
+        }
+        std::exception_ptr e;
+        try {
+          write_checkpoint(s->fname, s->tensors, s->arch);
+        } catch (...) {
+          e = std::current_exception();
+        }
+        {
+          std::lock_guard<std::mutex> g(lock);
+          if (e and !error) error = e; // later ones are dropped
+          free.push_back(s);
+          busy = false;
+        }
+        cv.notify_all();
+      }
+    }
+};
+
+// a mapped checkpoint file, checked for consistency
+class ckpt_file {
+  public:
+    ckpt_header header;
+    std::string arch;
+    std::string base; // path of the checkpoint this delta applies to, or ""
+    std::vector<ckpt_entry> table;
+
+    ckpt_file(const std::string& fname, bool verify = true)
+        : f(std::make_shared<mapped_file>(fname, true)) {
+      auto check = [&](bool ok, const char* what) { ckpt_check(ok, fname, what); };
+      check(f->size() >= sizeof(ckpt_header_v1), "truncated header");
+      check(std::memcmp(f->data(), ckpt_magic, sizeof(ckpt_magic)) == 0,
+            "not a checkpoint");
+      uint32_t version;
+      std::memcpy(&version, f->data() + sizeof(ckpt_magic), sizeof(version));
+      if (version == 1) read_v1(check);
+      else {
+        check(version == ckpt_version, "unknown version");
+        check(f->size() >= sizeof(header), "truncated header");
+        std::memcpy(&header, f->data(), sizeof(header));
+      }
+      check(header.real_size == sizeof(Real), "saved with another Real");
+      uint64_t start = (version == 1) ? sizeof(ckpt_header_v1) : sizeof(header);
+      check(f->size() >= start + header.arch_bytes + header.base_bytes,
+            "truncated arch");
+      arch.assign(f->data() + start, header.arch_bytes);
+      base = base_path(fname, std::string(f->data() + start + header.arch_bytes,
+                                          header.base_bytes));
+      if (version != 1) {
+        check(f->size() / sizeof(ckpt_entry) >= header.num_tensors and
+              f->size() >= header.table_offset +
+                           header.num_tensors * sizeof(ckpt_entry),
+              "truncated table");
+        table.resize(header.num_tensors);
+        std::memcpy(table.data(), f->data() + header.table_offset,
+                    table.size() * sizeof(ckpt_entry));
+        check(checksum(table.data(), table.size() * sizeof(ckpt_entry)) ==
+              header.table_checksum, "table checksum mismatch");
+      }
+      for (auto& e : table) {
+        check(f->size() >= e.offset + e.rows * e.cols * sizeof(Real),
+              "truncated data");
+        check(e.index_offset or e.rows == e.full_rows, "bad entry");
+        check(!e.index_offset or
+              f->size() >= e.index_offset + e.rows * sizeof(uint64_t),
+              "truncated row numbers");
+        if (!verify) continue;
+        auto h = checksum(f->data() + e.offset, e.rows * e.cols * sizeof(Real));
+        if (e.index_offset)
+          h = checksum(f->data() + e.index_offset, e.rows * sizeof(uint64_t), h);
+        check(h == e.checksum, "data checksum mismatch");
+      }
+    }
+
+    // row numbers of the rows of tensor i, for delta rows
+    const uint64_t* rows(uint i) {
+      assert(table[i].index_offset);
+      return (const uint64_t*)(f->data() + table[i].index_offset);
+    }
+
+    // [rows x cols] view of tensor i into the (private) mapping
+    Matrix<cpu> tensor(uint i) {
+      return Matrix<cpu>((Real*)(f->data() + table[i].offset),
+                         Shape2(table[i].rows, table[i].cols));
+    }
+
+    // tensor i as Weight storage: an alias on cpu (keeps the mapping alive),
+    // otherwise a copy
+    template <typename xpu>
+    std::shared_ptr<MatrixContainer<xpu>> value(uint i);
+
+  private:
+    std::shared_ptr<mapped_file> f;
+
+    // header and table of a version 1 file, in the current layout
+    template <typename C>
+    void read_v1(C check) {
+      ckpt_header_v1 h;
+      std::memcpy(&h, f->data(), sizeof(h));
+      std::memcpy(header.magic, h.magic, sizeof(h.magic));
+      header.version = h.version;
+      header.real_size = h.real_size;
+      header.num_tensors = h.num_tensors;
+      header.arch_bytes = h.arch_bytes;
+      header.base_bytes = 0;
+      header.table_offset = h.table_offset;
+      header.table_checksum = h.table_checksum;
+      check(f->size() / sizeof(ckpt_entry_v1) >= h.num_tensors and
+            f->size() >= h.table_offset + h.num_tensors * sizeof(ckpt_entry_v1),
+            "truncated table");
+      std::vector<ckpt_entry_v1> t(h.num_tensors);
+      std::memcpy(t.data(), f->data() + h.table_offset,
+                  t.size() * sizeof(ckpt_entry_v1));
+      check(checksum(t.data(), t.size() * sizeof(ckpt_entry_v1)) ==
+            h.table_checksum, "table checksum mismatch");
+      for (auto& e : t)
+        table.push_back({e.rows, e.cols, e.offset, e.weight, e.role, e.rows, 0,
+                         e.checksum});
+    }
+};
+
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> ckpt_file::value(uint i) {
+  auto m = tensor(i);
+  auto W = make_MC<xpu>(m.size(0), m.size(1));
+  Copy(*W, m, Data<xpu>::s);
+  return W;
+}
+
+template <>
+inline std::shared_ptr<MatrixContainer<cpu>> ckpt_file::value<cpu>(uint i) {
+  auto m = tensor(i);
+  auto W = new MatrixContainer<cpu>(Shape2(0, m.size(1)));
+  W->dptr_ = m.dptr_; W->shape_ = m.shape_; W->stride_ = m.stride_;
+  W->set_stream(Data<cpu>::s);
+  auto keep = f;
+  return std::shared_ptr<MatrixContainer<cpu>>(W,
+      [keep](MatrixContainer<cpu>* m) { delete m; });
+}
+
+// tensors of fname with its chain of deltas applied, as host copies in table
+// order. table gets the entries of the last full checkpoint in the chain.
+inline std::vector<std::shared_ptr<MatrixContainer<cpu>>> read_chain(
+    const std::string& fname, std::vector<ckpt_entry>& table,
+    bool verify = true) {
+  ckpt_file f(fname, verify);
+  std::vector<std::shared_ptr<MatrixContainer<cpu>>> T;
+  if (!f.base.empty()) T = read_chain(f.base, table, verify);
+  else table = f.table;
+  T.resize(f.table.size());
+  ckpt_check(table.size() == f.table.size(), fname,
+             "table does not match its base"); // same params()
+  for (uint i=0; i<f.table.size(); i++) {
+    auto& e = f.table[i];
+    ckpt_check(e.weight == table[i].weight and e.role == table[i].role, fname,
+               "table does not match its base");
+    if (!e.index_offset) { // whole
+      table[i] = e;
+      T[i] = std::make_shared<MatrixContainer<cpu>>(f.tensor(i).shape_);
+      Copy(*T[i], f.tensor(i));
+      continue;
+    }
+    ckpt_check(T[i] and e.full_rows == T[i]->size(0) and
+               e.cols == T[i]->size(1), fname, "rows do not fit their base");
+    auto m = f.tensor(i);
+    auto rows = f.rows(i);
+    for (uint r=0; r<e.rows; r++) {
+      ckpt_check(rows[r] < e.full_rows, fname, "row number out of range");
+      Copy((*T[i])[rows[r]], m[r]);
+    }
+  }
+  return T;
+}
+
+// loads fname into params. W->adopt(value(i)) then history (and row clock)
+// copies from tensor(i) for each Weight, with the tables checked to line up.
+template <typename xpu, typename V, typename T>
+void load_tensors(const std::vector<Weight<xpu>*>& params,
+                  const std::vector<ckpt_entry>& table, V value, T tensor,
+                  const std::string& fname) {
+  auto check = [&](bool ok, const char* what) { ckpt_check(ok, fname, what); };
+  uint i = 0;
+  for (uint k=0; k<params.size(); k++) {
+    auto W = params[k];
+    check(i < table.size() and table[i].weight == k and table[i].role == 0,
+          "table does not match the params");
+    W->adopt(value(i++));
+    for (auto& h : W->u->history()) {
+      check(i < table.size() and table[i].weight == k,
+            "table does not match the updater");
+      check(tensor(i).shape_ == h->shape_,
+            "shape does not match the updater"); // same kind of updater
+      Copy(*h, tensor(i++), Data<xpu>::s);
+    }
+    auto c = W->u->step_clock();
+    if (i < table.size() and table[i].weight == k) { // a row clock
+      if (c) {
+        check(tensor(i).shape_ == Shape2((*W)().size(0) + 3, 1),
+              "row clock does not match the Weight");
+        set_clock(*c, tensor(i));
+      }
+      i++;
+    } else if (c) {
+      c->init((*W)().size(0)); // saved synced, see save_checkpoint
+    }
+    W->mark_clean(); // deltas saved next apply to fname
+  }
+  check(i == table.size(), "table does not match the params");
+}
+
+template <typename xpu>
+void load_checkpoint(const std::vector<Weight<xpu>*>& params,
+                     const std::string& fname, bool verify = true) {
+  ckpt_file f(fname, verify);
+  if (f.base.empty()) {
+    load_tensors(params, f.table,
+                 [&](uint i) { return f.value<xpu>(i); },
+                 [&](uint i) { return f.tensor(i); }, fname);
+    return;
+  }
+  std::vector<ckpt_entry> table;
+  auto T = read_chain(fname, table, verify);
+  load_tensors(params, table,
+               [&](uint i) {
+                 auto W = make_MC<xpu>(T[i]->size(0), T[i]->size(1));
+                 Copy(*W, *T[i], Data<xpu>::s);
+                 return W;
+               },
+               [&](uint i) { return Matrix<cpu>(*T[i]); }, fname);
+}
+
+// merges the chain of deltas ending at fname into a full checkpoint at out
+// (which may be fname itself)
+inline void compact_checkpoint(const std::string& fname, const std::string& out,
+                               bool verify = true) {
+  std::vector<ckpt_entry> table;
+  auto T = read_chain(fname, table, verify);
+  std::vector<ckpt_tensor> tensors;
+  for (uint i=0; i<T.size(); i++)
+    tensors.push_back({table[i].weight, table[i].role, *T[i]});
+  write_checkpoint(out, tensors, ckpt_file(fname, false).arch);
+}
+
+} // end namespace milk
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef MILK_UTILS_COMM_H
+#define MILK_UTILS_COMM_H
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mmap.h"
+
+namespace milk {
+
+/* Collectives between the processes (ranks) of one training job, see
+ * dist_trainer. allreduce sums n Reals (or uint64s, exactly, e.g. row ids
+ * past what a float holds) over all ranks, in place; every rank ends up
+ * with the same bits. Backends:
+ *   local_comm  a single process, nothing to do
+ *   shm_comm    ranks on one machine, through a POSIX shared memory segment
+ *   tcp_comm    ranks anywhere, ring all-reduce over TCP
+ * make_comm() picks one from the environment that launch() (or a cluster
+ * script) sets up.
+ */
+class comm {
+  public:
+    uint rank = 0, size = 1;
+
+    virtual ~comm() {}
+    virtual void allreduce(Real* data, size_t n) = 0;
+    virtual void allreduce(uint64_t* data, size_t n) = 0;
+    virtual void barrier() { Real x = 0; allreduce(&x, 1); }
+
+    // data of root on every rank (others contribute zeros, so it is exact)
+    virtual void broadcast(Real* data, size_t n, uint root = 0) {
+      if (rank != root) std::fill(data, data + n, Real(0));
+      allreduce(data, n);
+    }
+};
+
+// failures of the syscalls under the collectives are fatal: a rank cannot go
+// on without its peers, and sends run on helper threads
+[[noreturn]] inline void comm_fail(const std::string& what) {
+  std::fprintf(stderr, "milk comm: %s\n", what.c_str());
+  std::abort();
+}
+
+// dies with what and errno unless ok
+inline void comm_check(bool ok, const std::string& what) {
+  if (!ok) comm_fail(what + ": " + std::strerror(errno));
+}
+
+class local_comm : public comm {
+  public:
+    void allreduce(Real*, size_t) {}
+    void allreduce(uint64_t*, size_t) {}
+    void barrier() {}
+};
+
+/* Shared memory all-reduce, in pieces of up to slot Reals: every rank copies
+ * its piece to its own slot, then sums one segment of the piece over all
+ * slots (in rank order) into the result, then copies the whole result back.
+ * That is the reduce-scatter / all-gather of a ring all-reduce, with the
+ * segment transfers done by the memory system.
+ */
+class shm_comm : public comm {
+  public:
+    shm_comm(const std::string& a_name, uint a_rank, uint a_size,
+             size_t a_slot = 1 << 20)
+        : name(a_name), slot(a_slot + a_slot % 2) { // uint64 slots stay aligned
+      rank = a_rank; size = a_size;
+      if (name.size() < 2 or name[0] != '/')
+        comm_fail("shm name " + name + " must start with /");
+      bytes = sizeof(header) + (size + 1) * slot * sizeof(Real);
+      int fd;
+      if (rank == 0) {
+        shm_unlink(name.c_str()); // leftover of a crashed run
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        comm_check(fd != -1, "shm_open " + name);
+        comm_check(ftruncate(fd, bytes) == 0, "ftruncate " + name);
+      } else { // wait for rank 0 to create it
+        struct stat st;
+        while ((fd = shm_open(name.c_str(), O_RDWR, 0600)) == -1 or
+               fstat(fd, &st) != 0 or (size_t)st.st_size < bytes) {
+          if (fd != -1) close(fd);
+          std::this_thread::yield();
+        }
+      }
+      ptr = (char*)mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      comm_check(ptr != MAP_FAILED, "mmap " + name);
+      close(fd);
+      h = (header*)ptr;
+      if (rank == 0) {
+        new (&h->arrived) std::atomic<uint32_t>(0);
+        new (&h->generation) std::atomic<uint32_t>(0);
+        h->size = size;
+        std::atomic_thread_fence(std::memory_order_release);
+        new (&h->ready) std::atomic<uint32_t>(ready_magic);
+      } else {
+        while (h->ready.load() != ready_magic)
+          std::this_thread::yield();
+        if (h->size != size) comm_fail(name + " was made for another size");
+      }
+      barrier();
+      if (rank == 0) shm_unlink(name.c_str()); // everyone has it mapped
+    }
+    ~shm_comm() { munmap(ptr, bytes); }
+
+    shm_comm(const shm_comm&) = delete;
+    shm_comm& operator=(const shm_comm&) = delete;
+
+    void barrier() { // sense reversing, by generation
+      uint32_t gen = h->generation.load();
+      if (h->arrived.fetch_add(1) == size - 1) {
+        h->arrived.store(0);
+        h->generation.fetch_add(1);
+      } else {
+        while (h->generation.load() == gen) std::this_thread::yield();
+      }
+    }
+
+    void allreduce(Real* data, size_t n) { sum(data, n); }
+    void allreduce(uint64_t* data, size_t n) { sum(data, n); }
+
+  private:
+    static const uint32_t ready_magic = 0x6d696c6b;
+    struct header {
+      std::atomic<uint32_t> arrived, generation, ready;
+      uint32_t size;
+      char pad[64 - 4 * sizeof(uint32_t)];
+    };
+
+    std::string name;
+    size_t slot, bytes;
+    char* ptr;
+    header* h;
+
+    // slot k as Ts, slot * sizeof(Real) bytes each
+    template <typename T>
+    T* slots(uint k) {
+      return (T*)(ptr + sizeof(header) + k * slot * sizeof(Real));
+    }
+
+    template <typename T>
+    void sum(T* data, size_t n) {
+      size_t cap = slot * sizeof(Real) / sizeof(T); // Ts per piece
+      for (size_t off=0; off<n; off+=cap) {
+        size_t m = std::min(cap, n - off);
+        std::copy(data + off, data + off + m, slots<T>(rank));
+        barrier();
+        size_t b = rank * m / size, e = (rank + 1) * m / size;
+        T* r = slots<T>(size);
+        std::copy(slots<T>(0) + b, slots<T>(0) + e, r + b);
+        for (uint k=1; k<size; k++)
+          for (size_t i=b; i<e; i++) r[i] += slots<T>(k)[i];
+        barrier();
+        std::copy(r, r + m, data + off);
+        barrier(); // before the next piece overwrites slots
+      }
+    }
+};
+
+// blocking socket helpers, for tcp_comm and the parameter server (ps.h)
+inline void send_all(int fd, const void* p, size_t bytes) {
+  auto c = (const char*)p;
+  while (bytes > 0) {
+    ssize_t k = send(fd, c, bytes, MSG_NOSIGNAL);
+    if (k == -1 and errno == EINTR) continue;
+    comm_check(k > 0, "send");
+    c += k; bytes -= k;
+  }
+}
+inline void recv_all(int fd, void* p, size_t bytes) {
+  auto c = (char*)p;
+  while (bytes > 0) {
+    ssize_t k = recv(fd, c, bytes, 0);
+    if (k == -1 and errno == EINTR) continue;
+    if (k == 0) comm_fail("recv: peer closed the connection");
+    comm_check(k > 0, "recv");
+    c += k; bytes -= k;
+  }
+}
+
+inline void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+inline std::string port_of(const std::string& host) {
+  return host.substr(host.rfind(':') + 1);
+}
+
+inline int listen_on(const std::string& port, int backlog = 1) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  comm_check(fd != -1, "socket");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+  a.sin_port = htons(std::stoi(port));
+  comm_check(bind(fd, (sockaddr*)&a, sizeof(a)) == 0, "bind port " + port);
+  comm_check(listen(fd, backlog) == 0, "listen port " + port);
+  return fd;
+}
+
+// connected socket to "host:port", retries until the peer listens
+inline int connect_to(const std::string& host) {
+  auto colon = host.rfind(':');
+  addrinfo hints = {}, *res;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host.substr(0, colon).c_str(),
+                        host.substr(colon + 1).c_str(), &hints, &res);
+  if (err != 0) comm_fail("resolve " + host + ": " + gai_strerror(err));
+  int fd;
+  while (true) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    comm_check(fd != -1, "socket");
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+    close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  freeaddrinfo(res);
+  set_nodelay(fd);
+  return fd;
+}
+
+/* Ring all-reduce over TCP: rank r accepts a connection from r-1 and
+ * connects to r+1 (addresses "host:port", one per rank). n Reals are cut
+ * into size chunks; in size-1 reduce-scatter steps every rank passes a chunk
+ * on and adds the one it receives, so each ends up owning one fully summed
+ * chunk, then size-1 all-gather steps pass the sums around. Sends run on a
+ * helper thread so both directions of a step overlap.
+ */
+class tcp_comm : public comm {
+  public:
+    tcp_comm(const std::vector<std::string>& hosts, uint a_rank) {
+      rank = a_rank; size = hosts.size();
+      assert(rank < size);
+      if (size == 1) return;
+      int lfd = listen_on(port_of(hosts[rank]));
+      next = connect_to(hosts[(rank + 1) % size]);
+      do prev = accept(lfd, nullptr, nullptr);
+      while (prev == -1 and errno == EINTR);
+      comm_check(prev != -1, "accept");
+      close(lfd);
+      set_nodelay(prev);
+    }
+    ~tcp_comm() {
+      if (next != -1) close(next);
+      if (prev != -1) close(prev);
+    }
+
+    tcp_comm(const tcp_comm&) = delete;
+    tcp_comm& operator=(const tcp_comm&) = delete;
+
+    void allreduce(Real* data, size_t n) { sum(data, n); }
+    void allreduce(uint64_t* data, size_t n) { sum(data, n); }
+
+  private:
+    int next = -1, prev = -1;
+
+    template <typename T>
+    void sum(T* data, size_t n) {
+      if (size == 1) return;
+      auto begin = [&](uint c) { return data + c * n / size; };
+      auto len = [&](uint c) { return size_t(begin(c + 1) - begin(c)); };
+      std::vector<T> tmp(n / size + 1);
+      for (uint s=0; s<size-1; s++) { // reduce-scatter
+        uint out = (rank + size - s) % size, in = (rank + size - s - 1) % size;
+        exchange(begin(out), len(out), tmp.data(), len(in));
+        T* d = begin(in);
+        for (size_t i=0; i<len(in); i++) d[i] += tmp[i];
+      }
+      for (uint s=0; s<size-1; s++) { // all-gather
+        uint out = (rank + 1 + size - s) % size, in = (rank + size - s) % size;
+        exchange(begin(out), len(out), begin(in), len(in));
+      }
+    }
+
+    template <typename T>
+    void exchange(const T* out, size_t n_out, T* in, size_t n_in) {
+      std::thread t([&]() { send_all(next, out, n_out * sizeof(T)); });
+      recv_all(prev, in, n_in * sizeof(T));
+      t.join();
+    }
+};
+
+inline std::string env_or(const char* var, const std::string& dflt) {
+  const char* v = std::getenv(var);
+  return v ? v : dflt;
+}
+
+// n "host:port" addresses from the comma separated list in list_var, or
+// 127.0.0.1 with consecutive ports from port_var (or port)
+inline std::vector<std::string> env_hosts(const char* list_var,
+                                          const char* port_var, uint port,
+                                          uint n) {
+  std::string list = env_or(list_var, "");
+  std::vector<std::string> hosts;
+  if (!list.empty()) {
+    hosts = split(list, ',');
+  } else {
+    port = std::stoi(env_or(port_var, std::to_string(port)));
+    for (uint r=0; r<n; r++)
+      hosts.push_back("127.0.0.1:" + std::to_string(port + r));
+  }
+  if (hosts.size() != n)
+    comm_fail(std::string(list_var) + " needs " + std::to_string(n) + " hosts");
+  return hosts;
+}
+
+/* comm of this process, from the environment:
+ *   MILK_WORLD_SIZE  number of ranks (unset: a single process)
+ *   MILK_RANK        rank of this process
+ *   MILK_COMM        "shm" (default) or "tcp"
+ *   MILK_SHM_NAME    shm segment, e.g. "/milk-job42" (shm)
+ *   MILK_HOSTS       "host:port,host:port,..", one per rank (tcp). defaults
+ *                    to 127.0.0.1 and MILK_PORT (29500) + rank
+ */
+inline std::shared_ptr<comm> make_comm() {
+  uint size = std::stoi(env_or("MILK_WORLD_SIZE", "1"));
+  uint rank = std::stoi(env_or("MILK_RANK", "0"));
+  if (size == 1) return std::make_shared<local_comm>();
+  if (env_or("MILK_COMM", "shm") == "shm")
+    return std::make_shared<shm_comm>(env_or("MILK_SHM_NAME", "/milk"), rank, size);
+  return std::make_shared<tcp_comm>(env_hosts("MILK_HOSTS", "MILK_PORT", 29500,
+                                              size), rank);
+}
+
+// runs f(rank) in n forked processes with the MILK_* environment set for
+// make_comm, and waits for them. returns the number that failed. fork before
+// starting threads (thread_pool), children only get the calling thread.
+inline uint launch(uint n, std::function<int(uint)> f,
+                   const std::string& backend = "shm") {
+  std::string job = std::to_string(getpid());
+  std::vector<pid_t> pids;
+  for (uint r=0; r<n; r++) {
+    pid_t pid = fork();
+    comm_check(pid != -1, "fork");
+    if (pid == 0) {
+      setenv("MILK_WORLD_SIZE", std::to_string(n).c_str(), 1);
+      setenv("MILK_RANK", std::to_string(r).c_str(), 1);
+      setenv("MILK_COMM", backend.c_str(), 1);
+      setenv("MILK_SHM_NAME", ("/milk-" + job).c_str(), 0);
+      int ret = f(r);
+      std::cout.flush(); std::cerr.flush();
+      std::_Exit(ret); // not exit: the parent's statics are not ours to destroy
+    }
+    pids.push_back(pid);
+  }
+  uint failed = 0;
+  for (auto pid : pids) {
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) or WEXITSTATUS(status) != 0) failed++;
+  }
+  return failed;
+}
+
+} // end namespace milk
+
+#endif
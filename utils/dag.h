@@ -1,6 +1,9 @@
 #ifndef MILK_UTILS_DAG_H
 #define MILK_UTILS_DAG_H
 
+#include <algorithm>
+#include <memory>
+
 namespace milk {
 
 // (topologically) sorted DAG (for recursive nets for now)
@@ -14,10 +17,73 @@ class sdag {
     // (node index, incoming edge label) pairs
     std::vector<std::vector<std::pair<uint,uint>>> adj_list;
 
+    // roots of the trees in a forest (see merge). empty means a single root, 0.
+    std::vector<uint> roots;
+
     std::vector<std::pair<uint,uint>>& children(uint n) { return adj_list[n]; }
     uint size() { return adj_list.size(); }
+    std::vector<uint> root_nodes() {
+      return roots.empty() ? std::vector<uint>{0} : roots;
+    }
+
+    // disjoint union (forest), nodes of dags[k] are shifted by the total size
+    // of dags[0..k). the result is still topologically sorted.
+    static std::shared_ptr<sdag> merge(
+        const std::vector<std::shared_ptr<sdag>>& dags);
+
+    // nodes grouped by height (leaves are level 0), so that everything a node
+    // depends on is in a lower level. edges are grouped by label within the
+    // level of their parent. computed on first use, build adj_list before.
+    struct level {
+      std::vector<uint> nodes;
+      std::vector<std::vector<uint>> parents, children; // [label][edge]
+    };
+    std::vector<level>& levels();
+
+  private:
+    std::vector<level> levels_;
 };
 
-}; // end namespace milk
+inline std::shared_ptr<sdag> sdag::merge(
+    const std::vector<std::shared_ptr<sdag>>& dags) {
+  auto forest = std::make_shared<sdag>();
+  for (auto& dag : dags) {
+    uint offset = forest->size();
+    for (auto r : dag->root_nodes()) forest->roots.push_back(offset + r);
+    for (auto& ch : dag->adj_list) {
+      forest->adj_list.push_back(ch);
+      for (auto& p : forest->adj_list.back()) p.first += offset;
+    }
+  }
+  return forest;
+}
+
+inline std::vector<sdag::level>& sdag::levels() {
+  if (!levels_.empty() or size() == 0) return levels_;
+  std::vector<uint> height(size(), 0);
+  uint num_labels = 0;
+  for (int n=size()-1; n>=0; n--) { // children come after their parents
+    for (auto& p : children(n)) {
+      height[n] = std::max(height[n], height[p.first] + 1);
+      num_labels = std::max(num_labels, p.second + 1);
+    }
+  }
+  levels_.resize(*std::max_element(height.begin(), height.end()) + 1);
+  for (auto& lv : levels_) {
+    lv.parents.resize(num_labels);
+    lv.children.resize(num_labels);
+  }
+  for (uint n=0; n<size(); n++) {
+    auto& lv = levels_[height[n]];
+    lv.nodes.push_back(n);
+    for (auto& p : children(n)) {
+      lv.parents[p.second].push_back(n);
+      lv.children[p.second].push_back(p.first);
+    }
+  }
+  return levels_;
+}
+
+} // end namespace milk
 
 #endif
@@ -1,7 +1,10 @@
 #ifndef MILK_UTILS_DATA_H
 #define MILK_UTILS_DATA_H
 
+#include <cstring>
+#include <functional>
 #include <random>
+#include "parallel.h"
 
 namespace milk {
 
@@ -26,191 +29,273 @@ void paired_shuffle(std::vector<Matrix<xpu>> v,
   }
 }
 
-#if MSHADOW_USE_CUDA
+// f(i) for i < n, one per batch: on the pool on cpu, otherwise in order on
+// the calling thread, as pool threads have no device set and only a
+// default stream (Data<xpu>::s is per thread)
+template <typename xpu>
+void for_each_batch(uint n, std::function<void(uint)> f) {
+  for (uint i=0; i<n; i++) f(i);
+}
 
-std::vector<Data<gpu>> to_data(const Matrix<cpu>& X, uint batch_size=1) {
-  uint N = X.size(0);
-  uint last_batch_size = N % batch_size;
-  uint num_batches = (N + batch_size - 1) / batch_size;
-  if (last_batch_size == 0) last_batch_size = batch_size;
+template <>
+inline void for_each_batch<cpu>(uint n, std::function<void(uint)> f) {
+  thread_pool::get().parallel_for(n, f);
+}
 
-  std::vector<Data<gpu>> vdat;
-  for (uint i=0; i<num_batches; i++) {
-    uint bs = (i==(num_batches-1)) ? last_batch_size : batch_size;
-    auto dat = Data<gpu>(bs, X.size(1));
-    Copy(dat(), middle_rows(X, i*batch_size, bs));
-    dat.batch_size = bs;
-    vdat.push_back(dat);
+// host storage to assemble a batch b in, then put over in one copy: b itself
+// on cpu
+template <typename xpu>
+struct host_batch {
+  MatrixContainer<cpu> buf;
+  Matrix<cpu> get(Data<xpu>& b) { buf.Resize(b().shape_); return buf; }
+  void put(Data<xpu>& b) {
+    Copy(b(), buf, Data<xpu>::s);
+    Data<xpu>::s->Wait();
   }
-  return vdat;
+};
+
+template <>
+struct host_batch<cpu> {
+  Matrix<cpu> get(Data<cpu>& b) { return b(); }
+  void put(Data<cpu>&) {}
+};
+
+// copy on xpu of the host Data h, with its batch_size and structure, made on
+// the calling thread: h itself on cpu
+template <typename xpu>
+Data<xpu> to_device(Data<cpu>& h) {
+  Data<xpu> d(h().size(0), h().size(1));
+  Copy(d(), h(), Data<xpu>::s);
+  Data<xpu>::s->Wait();
+  d.batch_size = h.batch_size;
+  d.dag = h.dag;
+  d.pack = h.pack;
+  return d;
 }
 
-void batch_seq_single_label(std::vector<Data<gpu>>* Xb,
-                            std::vector<Data<gpu>>* Lb,
-                            std::vector<Data<cpu>>& X,
-                            std::vector<Data<cpu>>& L,
-                            Real pad_value,
-                            uint batch_size = 64,
-                            bool from_right = false) {
-  uint N = X.size();
-  uint last_batch_size = N % batch_size;
-  uint num_batches = (N + batch_size - 1) / batch_size;
-  if (last_batch_size == 0) last_batch_size = batch_size;
+template <>
+inline Data<cpu> to_device<cpu>(Data<cpu>& h) { return h; }
 
-  // sort wrt length
-  std::vector<uint> index(X.size());
-  std::iota(index.begin(), index.end(), 0);
-  std::sort(index.begin(), index.end(),
-      [&](const int& a, const int& b) {
-        return (X[a]().shape_[0] > X[b]().shape_[0]);
-      }
-  );
+// packed batch (see packing) of sequences X[index[begin]] .. X[index[begin+bs-1]],
+// which have to be sorted by decreasing length. no padding rows.
+template <typename xpu>
+void pack_seq(Data<xpu>* Xb, std::vector<Data<cpu>>& X,
+              const std::vector<uint>& index, uint begin, uint bs) {
+  std::vector<uint> lengths(bs);
+  for (uint j=0; j<bs; j++) lengths[j] = X[index[begin + j]]().size(0);
+  auto pack = std::make_shared<packing>(lengths);
+
+  uint cols = X[index[begin]]().size(1);
+  Xb->init(pack->rows(), cols);
+  host_batch<xpu> h;
+  Matrix<cpu> tmp = h.get(*Xb);
+  for (uint t=0; t<pack->len(); t++)
+    for (uint j=0; j<pack->sizes[t]; j++)
+      std::memcpy(tmp[pack->offsets[t] + j].dptr_,
+                  X[index[begin + j]]()[t].dptr_, cols * sizeof(Real));
+  h.put(*Xb);
+  Xb->batch_size = bs;
+  Xb->pack = pack;
+}
+
+// sequences [begin, begin+n) of the batch x, all time steps, e.g. to split a
+// batch across replicas (see data_parallel_trainer). not for packed or tree
+// batches.
+template <typename xpu>
+void slice_batch(Data<xpu>* xs, Data<xpu>& x, uint begin, uint n) {
+  assert(!x.pack and !x.dag);
+  uint bs = x.batch_size, T = x.len();
+  assert(begin + n <= bs);
+  xs->init(T*n, x().size(1));
+  for (uint t=0; t<T; t++)
+    Copy(middle_rows((*xs)(), t*n, n), middle_rows(x(), t*bs + begin, n),
+         Data<xpu>::s);
+  xs->batch_size = n;
+}
 
+// forest batches for recursive nets: every batch_size consecutive trees are
+// merged into one sdag (see sdag::merge) and their node rows concatenated.
+// X and L are per tree, with X[k].dag set; the batch of L shares the forest.
+template <typename xpu>
+void batch_trees(std::vector<Data<xpu>>* Xb,
+                 std::vector<Data<xpu>>* Lb,
+                 std::vector<Data<xpu>>& X,
+                 std::vector<Data<xpu>>& L,
+                 uint batch_size = 32) {
+  uint N = X.size();
+  uint num_batches = (N + batch_size - 1) / batch_size;
   Xb->resize(num_batches);
   Lb->resize(num_batches);
 
   for (uint i=0; i<num_batches; i++) {
-    uint bs = (i == (num_batches-1)) ? last_batch_size : batch_size;
-    uint T = X[index[i*bs]]().size(0); // max length in batch
-    (*Xb)[i].init(bs*T, X[index[i*bs]]().size(1));
-    (*Lb)[i].init(bs,   L[index[i*bs]]().size(1));
-
-    for (uint j=0; j<bs; j++) {
-      uint T_ = X[index[i*bs + j]]().size(0);
-      for (uint t=0; t<T; t++) {
-        if (from_right) {
-          if (t < T_) {
-            Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t] );
-          } else { // pad here
-            (*Xb)[i]()[bs*t + j] = pad_value;
-          }
-        } else {
-          if (t >= T-T_) {
-            Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t-(T-T_)] );
-          } else { // or here
-            (*Xb)[i]()[bs*t + j] = pad_value;
-          }
-        }
+    uint begin = i*batch_size, end = std::min(N, begin + batch_size);
+    std::vector<std::shared_ptr<sdag>> dags;
+    uint rows = 0;
+    for (uint k=begin; k<end; k++) {
+      assert(X[k].dag and X[k].batch_size == 1);
+      dags.push_back(X[k].dag);
+      assert(L[k]().size(0) == X[k]().size(0)); // a label row per node
+      rows += X[k]().size(0);
+    }
+    auto forest = sdag::merge(dags);
+
+    for (auto p : {std::make_pair(&(*Xb)[i], &X),
+                   std::make_pair(&(*Lb)[i], &L)}) {
+      auto& b = *p.first;
+      auto& src = *p.second;
+      b.init(rows, src[begin]().size(1));
+      uint r = 0;
+      for (uint k=begin; k<end; k++) {
+        Copy( middle_rows(b(), r, src[k]().size(0)), src[k]() );
+        r += src[k]().size(0);
       }
-      Copy( (*Lb)[i]()[j], L[index[i*bs + j]]()[0] );
+      b.batch_size = 1;
+      b.dag = forest;
     }
-    (*Xb)[i].batch_size = (*Lb)[i].batch_size = bs;
   }
 }
 
-// TODO: test left / right padding
-void batch_seq_label_seq(std::vector<Data<gpu>>* Xb,
-                         std::vector<Data<gpu>>* Lb,
-                         std::vector<Data<cpu>>& X,
-                         std::vector<Data<cpu>>& L,
-                         Real pad_value,
-                         Real label_pad_value,
-                         uint batch_size = 64,
-                         bool from_right = false) {
-  uint N = X.size();
+template <typename xpu=MilkDefaultDev>
+std::vector<Data<xpu>> to_data(const Matrix<cpu>& X, uint batch_size=1) {
+  uint N = X.size(0);
   uint last_batch_size = N % batch_size;
   uint num_batches = (N + batch_size - 1) / batch_size;
   if (last_batch_size == 0) last_batch_size = batch_size;
 
-  // sort wrt length
-  std::vector<uint> index(X.size());
+  std::vector<Data<xpu>> vdat(num_batches);
+  for_each_batch<xpu>(num_batches, [&](uint i) {
+    uint bs = (i==(num_batches-1)) ? last_batch_size : batch_size;
+    auto& dat = vdat[i];
+    dat.init(bs, X.size(1));
+    Copy(dat(), middle_rows(X, i*batch_size, bs), Data<xpu>::s);
+    Data<xpu>::s->Wait();
+    dat.batch_size = bs;
+  });
+  return vdat;
+}
+
+// indices of the sequences X by decreasing length
+inline std::vector<uint> sort_by_length(std::vector<Data<cpu>>& X) {
+  std::vector<uint> index(X.size()), len(X.size());
   std::iota(index.begin(), index.end(), 0);
+  for (uint j=0; j<X.size(); j++) len[j] = X[j]().size(0); // not in the sort
   std::sort(index.begin(), index.end(),
-      [&](const int& a, const int& b) {
-        return (X[a]().shape_[0] > X[b]().shape_[0]);
-      }
-  );
+      [&](const int& a, const int& b) { return len[a] > len[b]; });
+  return index;
+}
 
+// padded batches of the sequences X[index[i*batch_size]] .. (index sorted
+// by decreasing length, see sort_by_length), step t of sequence j in row
+// bs*t + j. sequences are padded at the end (from_right) or at the start.
+// with packed no padding, see pack_seq. batches are made in parallel on cpu
+// (see for_each_batch), each in a host buffer that is copied over at once.
+template <typename xpu>
+void batch_seq(std::vector<Data<xpu>>* Xb,
+               std::vector<Data<cpu>>& X,
+               const std::vector<uint>& index,
+               Real pad_value,
+               uint batch_size = 64,
+               bool from_right = false,
+               bool packed = false) {
+  uint N = X.size();
+  uint num_batches = (N + batch_size - 1) / batch_size;
   Xb->resize(num_batches);
-  Lb->resize(num_batches);
 
-  for (uint i=0; i<num_batches; i++) {
-    uint bs = (i == (num_batches-1)) ? last_batch_size : batch_size;
-    uint T = X[index[i*bs]]().size(0); // max length in batch
-    (*Xb)[i].init(bs*T, X[index[i*bs]]().size(1));
-    (*Lb)[i].init(bs*T, L[index[i*bs]]().size(1));
-
-    for (uint j=0; j<bs; j++) {
-      uint T_ = X[index[i*bs + j]]().size(0);
-      for (uint t=0; t<T; t++) {
-        if (from_right) {
-          if (t < T_) {
-            Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t] );
-            Copy( (*Lb)[i]()[bs*t + j], L[index[i*bs + j]]()[t] );
-          } else { // pad here
-            (*Xb)[i]()[bs*t+j] = pad_value;
-            (*Lb)[i]()[bs*t+j] = label_pad_value;
-          }
-        } else {
-          if (t >= T-T_) {
-            Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t-(T-T_)] );
-            Copy( (*Lb)[i]()[bs*t + j], L[index[i*bs + j]]()[t-(T-T_)] );
-          } else { // or here
-            (*Xb)[i]()[bs*t+j] = pad_value;
-            (*Lb)[i]()[bs*t+j] = label_pad_value;
-          }
-        }
+  for_each_batch<xpu>(num_batches, [&](uint i) {
+    uint begin = i*batch_size, bs = std::min(batch_size, N - begin);
+    if (packed) {
+      pack_seq(&(*Xb)[i], X, index, begin, bs);
+      return;
+    }
+    uint T = X[index[begin]]().size(0); // max length in batch
+    uint cols = X[index[begin]]().size(1);
+    auto& b = (*Xb)[i];
+    b.init(bs*T, cols);
+    host_batch<xpu> h;
+    Matrix<cpu> m = h.get(b);
+    std::vector<Matrix<cpu>> x(bs);
+    for (uint j=0; j<bs; j++) x[j] = X[index[begin + j]]();
+    for (uint t=0; t<T; t++) { // rows of the batch in order
+      for (uint j=0; j<bs; j++) {
+        Real* row = m.dptr_ + size_t(bs*t + j) * m.stride_;
+        uint T_ = x[j].size(0), skip = from_right ? 0 : T - T_;
+        if (t >= skip and t < skip + T_)
+          std::memcpy(row, x[j].dptr_ + size_t(t - skip) * x[j].stride_,
+                      cols * sizeof(Real));
+        else // pad here
+          std::fill(row, row + cols, pad_value);
       }
     }
-    (*Xb)[i].batch_size = (*Lb)[i].batch_size = bs;
-  }
+    h.put(b);
+    b.batch_size = bs;
+  });
 }
 
-void batch_seq_no_label(std::vector<Data<gpu>>* Xb,
-                        std::vector<Data<cpu>>& X,
-                        Real pad_value,
-                        uint batch_size = 64,
-                        bool from_right = false) {
-  uint N = X.size();
-  uint last_batch_size = N % batch_size;
+// batches of the first rows of L[index[i*batch_size]] .., e.g. a label per
+// sequence along batch_seq
+template <typename xpu>
+void batch_first_rows(std::vector<Data<xpu>>* Lb,
+                      std::vector<Data<cpu>>& L,
+                      const std::vector<uint>& index,
+                      uint batch_size = 64) {
+  uint N = L.size();
   uint num_batches = (N + batch_size - 1) / batch_size;
-  if (last_batch_size == 0) last_batch_size = batch_size;
+  Lb->resize(num_batches);
 
-  // sort wrt length
-  std::vector<uint> index(X.size());
-  std::iota(index.begin(), index.end(), 0);
-  std::sort(index.begin(), index.end(),
-      [&](const int& a, const int& b) {
-        return (X[a]().shape_[0] > X[b]().shape_[0]);
-      }
-  );
+  for_each_batch<xpu>(num_batches, [&](uint i) {
+    uint begin = i*batch_size, bs = std::min(batch_size, N - begin);
+    uint cols = L[index[begin]]().size(1);
+    auto& b = (*Lb)[i];
+    b.init(bs, cols);
+    host_batch<xpu> h;
+    Matrix<cpu> m = h.get(b);
+    for (uint j=0; j<bs; j++)
+      std::memcpy(m[j].dptr_, L[index[begin + j]]()[0].dptr_,
+                  cols * sizeof(Real));
+    h.put(b);
+    b.batch_size = bs;
+  });
+}
 
-  Xb->resize(num_batches);
+template <typename xpu>
+void batch_seq_single_label(std::vector<Data<xpu>>* Xb,
+                            std::vector<Data<xpu>>* Lb,
+                            std::vector<Data<cpu>>& X,
+                            std::vector<Data<cpu>>& L,
+                            Real pad_value,
+                            uint batch_size = 64,
+                            bool from_right = false,
+                            bool packed = false) { // no padding, see pack_seq
+  auto index = sort_by_length(X);
+  batch_seq(Xb, X, index, pad_value, batch_size, from_right, packed);
+  batch_first_rows(Lb, L, index, batch_size);
+}
 
-  for (uint i=0; i<num_batches; i++) {
-    uint bs = (i == (num_batches-1)) ? last_batch_size : batch_size;
-    uint T = X[index[i*bs]]().size(0); // max length in batch
-    (*Xb)[i].init(bs*T, X[index[i*bs]]().size(1));
-    MatrixContainer<cpu> tmp((*Xb)[i]().shape_);
-
-    for (uint j=0; j<bs; j++) {
-      uint T_ = X[index[i*bs + j]]().size(0);
-      for (uint t=0; t<T; t++) {
-        if (from_right) {
-          if (t < T_) {
-            //Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t] );
-            Copy( tmp[bs*t + j], X[index[i*bs + j]]()[t] );
-          } else { // pad here
-            //(*Xb)[i]()[t] = pad_value;
-            tmp[bs*t + j] = pad_value;
-          }
-        } else {
-          if (t >= T-T_) {
-            //Copy( (*Xb)[i]()[bs*t + j], X[index[i*bs + j]]()[t-(T-T_)] );
-            Copy( tmp[bs*t + j], X[index[i*bs + j]]()[t-(T-T_)] );
-          } else { // or here
-            //(*Xb)[i]()[t] = pad_value;
-            tmp[bs*t + j] = pad_value;
-          }
-        }
-      }
-    }
-    Copy( (*Xb)[i](), tmp );
-    (*Xb)[i].batch_size = bs;
-  }
+template <typename xpu>
+void batch_seq_label_seq(std::vector<Data<xpu>>* Xb,
+                         std::vector<Data<xpu>>* Lb,
+                         std::vector<Data<cpu>>& X,
+                         std::vector<Data<cpu>>& L,
+                         Real pad_value,
+                         Real label_pad_value,
+                         uint batch_size = 64,
+                         bool from_right = false,
+                         bool packed = false) { // no padding, see pack_seq
+  auto index = sort_by_length(X);
+  batch_seq(Xb, X, index, pad_value, batch_size, from_right, packed);
+  batch_seq(Lb, L, index, label_pad_value, batch_size, from_right, packed);
 }
 
-#endif
+template <typename xpu>
+void batch_seq_no_label(std::vector<Data<xpu>>* Xb,
+                        std::vector<Data<cpu>>& X,
+                        Real pad_value,
+                        uint batch_size = 64,
+                        bool from_right = false,
+                        bool packed = false) { // no padding, see pack_seq
+  auto index = sort_by_length(X);
+  batch_seq(Xb, X, index, pad_value, batch_size, from_right, packed);
+}
 
 } // end namespace milk
 
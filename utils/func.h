@@ -1,6 +1,9 @@
 #ifndef MILK_UTILS_FUNC_H
 #define MILK_UTILS_FUNC_H
 
+#include "pool.h"
+#include "shape.h"
+
 namespace milk {
 
 using namespace mshadow;
@@ -92,27 +95,27 @@ template <typename xpu>
 Real sum(Vector<xpu> m) {
   // is there really no sum routine in mshadow?
   Matrix<xpu> as_column(m.dptr_, Shape2(m.size(0),1));
-  VectorContainer<xpu> s(Shape1(1));
+  auto s = make_MC<xpu>(1, 1);
+  auto s_ = make_MC<cpu>(1, 1);
   as_column.stride_ = 1;
-  s = sum_rows(as_column);
-  VectorContainer<cpu> s_(Shape1(1));
-  Copy(s_, s);
-  return s_[0];
+  vec(*s) = sum_rows(as_column);
+  Copy(*s_, *s);
+  return (*s_)[0][0];
 }
 
 template <typename xpu>
 Real sum(Matrix<xpu> m) {
   // is there really no sum routine in mshadow?
-  VectorContainer<xpu> rs(Shape1(m.size(1)));
-  rs = sum_rows(m);
-  return sum(rs);
+  auto rs = make_MC<xpu>(1, m.size(1));
+  vec(*rs) = sum_rows(m);
+  return sum(vec(*rs));
 }
 
 template <typename xpu>
 Real sqsum(Matrix<xpu> m) {
-  MatrixContainer<xpu> m_(m.shape_);
-  m_ = m * m;
-  return sum(m_);
+  auto m_ = make_MC<xpu>(m.size(0), m.size(1));
+  *m_ = m * m;
+  return sum(*m_);
 }
 
 template<int dimkeep,  typename SrcExp, typename DType, int etype>
@@ -0,0 +1,123 @@
+#ifndef MILK_UTILS_INGEST_H
+#define MILK_UTILS_INGEST_H
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include "mmap.h"
+#include "parallel.h"
+
+namespace milk {
+
+/* Parallel text ingestion: the file is mapped, cut into line-aligned chunks
+ * and the chunks are parsed on a thread_pool. Used by read_table,
+ * read_labeled_table and load_wv_table.
+ */
+
+typedef std::pair<const char*, const char*> char_range;
+
+// about n chunks of [begin, end), each ending right after a '\n' (or at end)
+inline std::vector<char_range> line_chunks(const char* begin, const char* end,
+                                           uint n) {
+  std::vector<char_range> chunks;
+  size_t step = (end - begin) / std::max(n, 1u) + 1;
+  for (const char* p = begin; p < end; ) {
+    const char* q = p + std::min<size_t>(step, end - p);
+    if (q < end) {
+      q = (const char*)std::memchr(q, '\n', end - q);
+      q = q ? q + 1 : end;
+    }
+    chunks.emplace_back(p, q);
+    p = q;
+  }
+  return chunks;
+}
+
+// calls f(i, line_begin, line_end) for every line i of the file in parallel
+// (the line excludes its '\n' and a trailing '\r'). an exception of f stops
+// its chunk and the first one is rethrown here as a runtime_error naming the
+// file and line, so workers never throw.
+template <typename F>
+void for_each_line(const std::string& fname, F f,
+                   thread_pool& pool = thread_pool::get()) {
+  mapped_file file(fname);
+  const char* data = file.data();
+  auto chunks = line_chunks(data, data + file.size(), 4 * pool.size());
+
+  std::vector<size_t> first(chunks.size() + 1, 0); // line number of each chunk
+  pool.parallel_for(chunks.size(), [&](uint c) {
+    size_t lines = 0;
+    for (const char* p = chunks[c].first; p < chunks[c].second; lines++) {
+      p = (const char*)std::memchr(p, '\n', chunks[c].second - p);
+      p = p ? p + 1 : chunks[c].second;
+    }
+    first[c+1] = lines;
+  });
+  for (uint c=0; c<chunks.size(); c++) first[c+1] += first[c];
+
+  std::mutex lock;
+  std::exception_ptr error;
+  size_t error_line = 0;
+  pool.parallel_for(chunks.size(), [&](uint c) {
+    size_t i = first[c];
+    try {
+      for (const char* p = chunks[c].first; p < chunks[c].second; i++) {
+        const char* e = (const char*)std::memchr(p, '\n', chunks[c].second - p);
+        const char* next = e ? e + 1 : chunks[c].second;
+        if (!e) e = chunks[c].second;
+        if (e > p and e[-1] == '\r') e--;
+        f(i, p, e);
+        p = next;
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> g(lock);
+      if (!error or i < error_line) { error = std::current_exception(); error_line = i; }
+    }
+  });
+  if (!error) return;
+  try {
+    std::rethrow_exception(error);
+  } catch (const std::exception& e) {
+    throw std::runtime_error(fname + ":" + std::to_string(error_line + 1) +
+                             ": " + e.what());
+  }
+}
+
+inline bool is_separator(char c) { return std::isspace(c) or c == ','; }
+
+// next number of [p, end) after separators (whitespace or ','), p is moved
+// past it. parses with strtod from a bounded copy since the mapping is not
+// null terminated. a missing, overlong or partly numeric token throws
+// std::invalid_argument, like std::stod on a bad number.
+inline Real parse_real(const char*& p, const char* end) {
+  while (p < end and is_separator(*p)) p++;
+  const char* b = p;
+  while (p < end and !is_separator(*p)) p++;
+  char buf[64];
+  size_t n = p - b;
+  if (n == 0) throw std::invalid_argument("missing number");
+  if (n >= sizeof(buf))
+    throw std::invalid_argument("number too long: " + std::string(b, 16) + "...");
+  std::memcpy(buf, b, n);
+  buf[n] = '\0';
+  char* parsed;
+  Real x = std::strtod(buf, &parsed);
+  if (parsed != buf + n) throw std::invalid_argument("not a number: " + std::string(buf));
+  return x;
+}
+
+// first token of [p, end) up to a space, p is moved past it
+inline std::string parse_word(const char*& p, const char* end) {
+  const char* b = p;
+  while (p < end and *p != ' ') p++;
+  std::string w(b, p);
+  if (p < end) p++;
+  return w;
+}
+
+} // end namespace milk
+
+#endif
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include "ingest.h"
 
 namespace milk {
 
@@ -73,18 +74,80 @@ std::istream& operator>>(std::istream& s, milk::Matrix<cpu>& m) {
 }
 
 void read_table(std::string fname, Matrix<cpu>* X) {
-  // assume *X is allocated to proper size
-  std::string line;
-  std::ifstream in(fname.c_str());
-  assert(in.is_open());
-
-  for (uint i=0; i<X->size(0); i++) {
-    std::getline(in, line);
-    auto v = split(line);
+  // assume *X is allocated to proper size. rows past X->size(0) are ignored
+  for_each_line(fname, [&](size_t i, const char* p, const char* end) {
+    if (i >= X->size(0)) return;
     auto row = (*X)[i];
-    for (uint j=0; j<X->size(1); j++) {
-      row[j] = std::stod(v[j]);
-    }
+    for (uint j=0; j<X->size(1); j++) row[j] = parse_real(p, end);
+  });
+}
+
+// each line is Y->size(1) labels followed by X->size(1) features (e.g. mnist)
+void read_labeled_table(std::string fname, Matrix<cpu>* X, Matrix<cpu>* Y) {
+  assert(X->size(0) == Y->size(0));
+  for_each_line(fname, [&](size_t i, const char* p, const char* end) {
+    if (i >= X->size(0)) return;
+    auto y = (*Y)[i], x = (*X)[i];
+    for (uint j=0; j<Y->size(1); j++) y[j] = parse_real(p, end);
+    for (uint j=0; j<X->size(1); j++) x[j] = parse_real(p, end);
+  });
+}
+
+// parses the rows of W (on the host) whose word is in the file
+inline void parse_wv_table(std::string fname, uint d, Matrix<cpu> W,
+                           std::unordered_map<std::string,uint>& w2i) {
+  // first pass finds the line of every row, the last one if a word repeats
+  // (as a sequential read would), the second parses only those lines
+  std::vector<std::atomic<long long>> line(W.size(0));
+  for (auto& l : line) l = -1;
+  for_each_line(fname, [&](size_t i, const char* p, const char* end) {
+    auto it = w2i.find(parse_word(p, end));
+    if (it == w2i.end()) return;
+    auto& l = line[it->second];
+    long long cur = l;
+    while (cur < (long long)i and !l.compare_exchange_weak(cur, i)) {}
+  });
+
+  for_each_line(fname, [&](size_t i, const char* p, const char* end) {
+    auto it = w2i.find(parse_word(p, end));
+    if (it == w2i.end() or line[it->second] != (long long)i) return;
+    auto row = W[it->second];
+    for (uint j=0; j<d; j++) row[j] = parse_real(p, end);
+  });
+}
+
+// rows not in the file stay as they are
+template <typename xpu>
+void load_wv_table(std::string fname, uint d, Matrix<xpu>* W,
+                   std::unordered_map<std::string,uint>& w2i) {
+  MatrixContainer<cpu> tmp(W->shape_);
+  Copy(tmp, *W, Data<xpu>::s);
+  parse_wv_table(fname, d, tmp, w2i);
+  Copy(*W, tmp, Data<xpu>::s);
+}
+
+template <>
+inline void load_wv_table<cpu>(std::string fname, uint d, Matrix<cpu>* W,
+                               std::unordered_map<std::string,uint>& w2i) {
+  parse_wv_table(fname, d, *W, w2i);
+}
+
+// a vocabulary as one word per line in index order, e.g. next to a dataset
+// converted to records (examples/rec-convert.cu)
+void write_vocab(std::string fname, const std::vector<std::string>& i2w) {
+  std::ofstream out(fname);
+  assert(out.is_open());
+  for (auto& w : i2w) out << w << "\n";
+}
+
+void read_vocab(std::string fname, std::unordered_map<std::string,uint>* w2i,
+                std::vector<std::string>* i2w) {
+  std::ifstream in(fname);
+  assert(in.is_open());
+  std::string w;
+  while (std::getline(in, w)) {
+    (*w2i)[w] = i2w->size();
+    i2w->push_back(w);
   }
 }
 
@@ -111,24 +174,6 @@ std::istream& operator>>(std::istream& s, milk::Matrix<gpu>& m) {
   return s;
 }
 
-void load_wv_table(std::string fname, uint d, Matrix<gpu>* W,
-                   std::unordered_map<std::string,uint>& w2i) {
-  std::string line;
-  std::ifstream in(fname);
-  assert(in.is_open());
-  VectorContainer<cpu> tmp(Shape1(d));
-  while (std::getline(in, line)) {
-    auto v = split(line, ' ');
-    std::string w = v[0];
-    if (w2i.find(w) != w2i.end()) {
-      uint ix = w2i[w];
-      for (uint i=0; i<d; i++)
-        tmp[i] = std::stod(v[i+1]);
-      Copy((*W)[ix], tmp);
-    }
-  }
-}
-
 #endif
 
 } // end namespace milk
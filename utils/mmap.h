@@ -0,0 +1,55 @@
+#ifndef MILK_UTILS_MMAP_H
+#define MILK_UTILS_MMAP_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+namespace milk {
+
+// whole file mapped into memory (posix). read-only by default, so the pages
+// are shared with every other process mapping the same file. copy_on_write
+// makes them writable but private: writes never reach the file. throws
+// std::runtime_error if fname cannot be mapped.
+class mapped_file {
+  public:
+    mapped_file(const std::string& fname, bool a_copy_on_write = false)
+        : copy_on_write(a_copy_on_write) {
+      int fd = open(fname.c_str(), O_RDONLY);
+      if (fd == -1) throw std::runtime_error("cannot open " + fname);
+      struct stat st;
+      int err = fstat(fd, &st);
+      if (err != 0) { close(fd); throw std::runtime_error("cannot stat " + fname); }
+      len = st.st_size;
+      if (len > 0) {
+        int prot = copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        ptr = (char*)mmap(nullptr, len, prot, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+          ptr = nullptr;
+          close(fd);
+          throw std::runtime_error("cannot map " + fname);
+        }
+      }
+      close(fd); // the mapping stays valid
+    }
+    ~mapped_file() { if (ptr) munmap(ptr, len); }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    char* data() { return ptr; }
+    size_t size() { return len; }
+    const bool copy_on_write; // else the pages are read-only
+
+  private:
+    char* ptr = nullptr;
+    size_t len = 0;
+};
+
+} // end namespace milk
+
+#endif
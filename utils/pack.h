@@ -0,0 +1,44 @@
+#ifndef MILK_UTILS_PACK_H
+#define MILK_UTILS_PACK_H
+
+namespace milk {
+
+// layout of a packed batch of sequences (no padding rows).
+// sequences are sorted by decreasing length and stored time-major, so
+// timestep t holds the first sizes[t] sequences of the batch in rows
+// [offsets[t], offsets[t] + sizes[t]). sizes is non-increasing, and the
+// sequences active at t are always a prefix of the ones active at t-1.
+
+class packing {
+  public:
+    std::vector<uint> sizes;   // active sequences per timestep
+    std::vector<uint> offsets; // first row of each timestep
+
+    packing(const std::vector<uint>& lengths) { // sorted, longest first
+      uint T = lengths.empty() ? 0 : lengths[0];
+      sizes.assign(T, 0);
+      for (auto l : lengths) {
+        assert(l <= T);
+        for (uint t=0; t<l; t++) sizes[t]++;
+      }
+      offsets.assign(T, 0);
+      for (uint t=1; t<T; t++) offsets[t] = offsets[t-1] + sizes[t-1];
+    }
+
+    uint len() { return sizes.size(); }
+    uint rows() { return sizes.empty() ? 0 : offsets.back() + sizes.back(); }
+
+    // sequences that end at step t are rows [sizes[t+1], sizes[t]) of that
+    // step. calls f(t, first row, number of rows) for each nonempty range.
+    template <typename F>
+    void for_each_end(F f) {
+      for (uint t=0; t<sizes.size(); t++) {
+        uint r = (t+1 < sizes.size()) ? sizes[t+1] : 0;
+        if (sizes[t] > r) f(t, r, sizes[t] - r);
+      }
+    }
+};
+
+} // end namespace milk
+
+#endif
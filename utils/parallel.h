@@ -0,0 +1,102 @@
+#ifndef MILK_UTILS_PARALLEL_H
+#define MILK_UTILS_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace milk {
+
+// fixed set of worker threads running submitted tasks in fifo order
+class thread_pool {
+  public:
+    thread_pool(uint n = std::max(1u, std::thread::hardware_concurrency())) {
+      for (uint i=0; i<n; i++) workers.emplace_back([this]() { run(); });
+    }
+    ~thread_pool() {
+      {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+      }
+      cv.notify_all();
+      for (auto& w : workers) w.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    static thread_pool& get() { // shared pool, one thread per core
+      static thread_pool p;
+      return p;
+    }
+
+    uint size() { return workers.size(); }
+
+    void submit(std::function<void()> f) {
+      {
+        std::lock_guard<std::mutex> g(lock);
+        tasks.push_back(std::move(f));
+      }
+      cv.notify_one();
+    }
+
+    // f(i) for every i < n, spread over the workers and the calling thread.
+    // returns when all are done. the caller works too, so nested calls from
+    // inside a task cannot deadlock.
+    void parallel_for(uint n, std::function<void(uint)> f);
+
+  private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    void run() {
+      while (true) {
+        std::function<void()> f;
+        {
+          std::unique_lock<std::mutex> g(lock);
+          cv.wait(g, [this]() { return stopping or !tasks.empty(); });
+          if (tasks.empty()) return; // stopping
+          f = std::move(tasks.front());
+          tasks.pop_front();
+        }
+        f();
+      }
+    }
+};
+
+inline void thread_pool::parallel_for(uint n, std::function<void(uint)> f) {
+  struct job {
+    std::atomic<uint> next{0}, done{0};
+    uint n;
+    std::function<void(uint)> f;
+    std::mutex lock;
+    std::condition_variable cv;
+  };
+  auto j = std::make_shared<job>(); // outlives late starting helpers
+  j->n = n;
+  j->f = std::move(f);
+  auto work = [j]() {
+    for (uint i; (i = j->next++) < j->n; ) {
+      j->f(i);
+      if (++j->done == j->n) {
+        std::lock_guard<std::mutex> g(j->lock);
+        j->cv.notify_all();
+      }
+    }
+  };
+  for (uint k=1; k<std::min(n, size() + 1); k++) submit(work);
+  work();
+  std::unique_lock<std::mutex> g(j->lock);
+  j->cv.wait(g, [&]() { return j->done == j->n; });
+}
+
+} // end namespace milk
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef MILK_UTILS_POOL_H
+#define MILK_UTILS_POOL_H
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+namespace milk {
+
+using namespace mshadow;
+
+/* pool recycles MatrixContainers so that a steady-state training step does
+ * not go to the system (or cuda) allocator. Containers are binned by size
+ * class: exact number of columns, rows rounded up to a power of two. make_MC
+ * takes the smallest binned container that fits and its shared_ptr puts the
+ * container back instead of freeing it. Containers that are resized in place (Data::init)
+ * grow to the next size class, so variable length batches settle quickly.
+ *
+ * Counters only cover tensor storage; shared_ptr control blocks are still
+ * heap allocated.
+ */
+template <typename xpu>
+class pool {
+  public:
+    struct counters {
+      size_t allocs = 0;   // containers (re)allocated by the system allocator
+      size_t reuses = 0;   // requests served from a bin
+      size_t releases = 0; // containers returned to a bin
+      size_t bytes = 0;    // storage owned by the pool, in use or binned
+      size_t cached = 0;   // storage sitting in bins
+    };
+
+    static pool& get() {
+      static pool* p = new pool(); // leaked on purpose, deleters may run late
+      return *p;
+    }
+
+    std::shared_ptr<MatrixContainer<xpu>> acquire(uint rows, uint cols);
+    void resize(MatrixContainer<xpu>& m, uint rows, uint cols);
+    void trim(); // give binned containers back to the system
+
+    counters stats() { std::lock_guard<std::mutex> g(lock); return c; }
+    void reset_stats() {
+      std::lock_guard<std::mutex> g(lock);
+      c.allocs = c.reuses = c.releases = 0;
+    }
+    void print(std::ostream& out = std::cout);
+
+    static uint size_class(uint rows) {
+      uint r = 1;
+      while (r < rows) r <<= 1;
+      return rows == 0 ? 0 : r;
+    }
+
+  private:
+    typedef std::pair<uint,uint> shape; // capacity as (rows, cols)
+    struct by_cols { // bins ordered by cols first, then rows
+      bool operator()(const shape& a, const shape& b) const {
+        return std::make_pair(a.second, a.first) <
+               std::make_pair(b.second, b.first);
+      }
+    };
+
+    std::mutex lock;
+    counters c;
+    std::map<shape, std::vector<MatrixContainer<xpu>*>, by_cols> bins;
+    std::unordered_map<MatrixContainer<xpu>*, shape> capacity;
+
+    pool() {}
+    void release(MatrixContainer<xpu>* m);
+
+    static size_t bytes(shape s) {
+      return size_t(s.first) * s.second * sizeof(Real);
+    }
+};
+
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> pool<xpu>::acquire(uint rows,
+                                                         uint cols) {
+  shape cap(size_class(rows), cols);
+  MatrixContainer<xpu>* m = nullptr;
+  {
+    std::lock_guard<std::mutex> g(lock);
+    // smallest binned container with the same cols that is large enough
+    for (auto it = bins.lower_bound(cap);
+         it != bins.end() and it->first.second == cols; ++it) {
+      if (it->second.empty()) continue;
+      m = it->second.back();
+      it->second.pop_back();
+      c.reuses++;
+      c.cached -= bytes(it->first);
+      break;
+    }
+    if (!m) {
+      c.allocs++;
+      c.bytes += bytes(cap);
+    }
+  }
+  if (m) {
+    m->Resize(Shape2(rows, cols)); // within capacity, no realloc
+  } else {
+    m = new MatrixContainer<xpu>(Shape2(cap.first, cols));
+    m->Resize(Shape2(rows, cols));
+    std::lock_guard<std::mutex> g(lock);
+    capacity[m] = cap;
+  }
+  return std::shared_ptr<MatrixContainer<xpu>>(m, [](MatrixContainer<xpu>* m) {
+    pool<xpu>::get().release(m);
+  });
+}
+
+template <typename xpu>
+void pool<xpu>::release(MatrixContainer<xpu>* m) {
+  std::lock_guard<std::mutex> g(lock);
+  auto cap = capacity.at(m);
+  bins[cap].push_back(m);
+  c.releases++;
+  c.cached += bytes(cap);
+}
+
+template <typename xpu>
+void pool<xpu>::resize(MatrixContainer<xpu>& m, uint rows, uint cols) {
+  std::unique_lock<std::mutex> g(lock);
+  auto it = capacity.find(&m);
+  if (it == capacity.end()) { // not ours
+    g.unlock();
+    m.Resize(Shape2(rows, cols));
+    return;
+  }
+  auto& cap = it->second;
+  if (rows > cap.first or cols > cap.second) {
+    shape grown(size_class(std::max(rows, cap.first)), cols);
+    c.allocs++;
+    c.bytes += bytes(grown) - bytes(cap);
+    cap = grown;
+    g.unlock();
+    m.Resize(Shape2(grown.first, cols));
+  } else {
+    g.unlock();
+  }
+  m.Resize(Shape2(rows, cols));
+}
+
+template <typename xpu>
+void pool<xpu>::trim() {
+  std::lock_guard<std::mutex> g(lock);
+  for (auto& bin : bins) {
+    for (auto m : bin.second) {
+      capacity.erase(m);
+      c.bytes -= bytes(bin.first);
+      delete m;
+    }
+  }
+  bins.clear();
+  c.cached = 0;
+}
+
+template <typename xpu>
+void pool<xpu>::print(std::ostream& out) {
+  auto s = stats();
+  out << "pool: " << s.allocs << " allocs, " << s.reuses << " reuses, "
+      << s.releases << " releases, " << s.bytes << " bytes ("
+      << s.cached << " cached)" << std::endl;
+}
+
+// pooled container on the Data<xpu> stream (defined in base.h)
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> make_MC(uint rows, uint cols,
+                                              Real init_val = 0.);
+// [1 x n] pooled container holding host values, e.g. row indices for take()
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> make_MC(const std::vector<Real>& v);
+
+} // end namespace milk
+
+#endif
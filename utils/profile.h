@@ -0,0 +1,302 @@
+#ifndef MILK_UTILS_PROFILE_H
+#define MILK_UTILS_PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <cxxabi.h>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace milk {
+
+/* Per layer profiler. Containers (stack, join, timewise) call their sublayers
+ * through timed(), so when profiling is on every forward, backward,
+ * forward_step, backward_step, update and reset_grad of every node below the
+ * root is timed (steady_clock, ns), into a buffer per thread. When it is off
+ * a call costs a relaxed load and a branch.
+ *
+ *   profile::name(*all);          // paths of the nodes of the tree
+ *   profile::start();
+ *   t.train({&X, &Y});
+ *   profile::stop();
+ *   profile::report();            // per layer totals, as a tree
+ *   profile::write_trace("t.json"); // chrome://tracing, ui.perfetto.dev
+ *
+ * Calls of the root itself (e.g. by the trainer) are not timed: its totals
+ * are those of its sublayers. Nodes of trees that were not named are
+ * reported by type. Report after stop(), once timed calls have returned.
+ */
+namespace profile {
+
+enum op { FORWARD, BACKWARD, FORWARD_STEP, BACKWARD_STEP, UPDATE, RESET_GRAD,
+          NUM_OPS };
+const char* op_names[NUM_OPS] = {"forward", "backward", "forward_step",
+                                 "backward_step", "update", "reset_grad"};
+
+std::atomic<bool> enabled(false);
+
+struct event {
+  const void* node;
+  const char* type; // mangled, see type_name
+  op o;
+  int64_t begin, end; // ns since the origin
+};
+
+struct thread_events {
+  uint tid;
+  std::mutex lock; // only contended by report / write_trace
+  std::vector<event> events;
+};
+
+struct node {
+  std::string label, path;
+  std::vector<const void*> children;
+};
+
+std::mutex registry_lock;
+std::vector<std::shared_ptr<thread_events>> threads;
+std::unordered_map<const void*, node> nodes;
+std::vector<const void*> roots;
+std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+inline int64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - origin).count();
+}
+
+inline thread_events& local() {
+  static thread_local std::shared_ptr<thread_events> t;
+  if (!t) {
+    t = std::make_shared<thread_events>();
+    std::lock_guard<std::mutex> g(registry_lock);
+    t->tid = threads.size();
+    threads.push_back(t);
+  }
+  return *t;
+}
+
+// "milk::layer::stack<mshadow::cpu>" -> "stack"
+inline std::string type_name(const char* mangled) {
+  int status;
+  char* s = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+  std::string name = (status == 0) ? s : mangled;
+  std::free(s);
+  name = name.substr(0, name.find('<'));
+  return name.substr(name.rfind(':') + 1);
+}
+
+// a call of the pointee of p as op o, timed from construction until the end
+// of the full expression: timed(l, FORWARD)->forward();
+template <typename P>
+class scope {
+  public:
+    scope(const P& a_p, op a_o)
+      : p(a_p), o(a_o), on(enabled.load(std::memory_order_relaxed)) {
+      if (on) begin = now();
+    }
+    scope(scope&& other) : p(other.p), o(other.o), on(other.on),
+                           begin(other.begin) {
+      other.on = false;
+    }
+    ~scope() {
+      if (!on) return;
+      event e = {&*p, typeid(*p).name(), o, begin, now()};
+      auto& t = local();
+      std::lock_guard<std::mutex> g(t.lock);
+      t.events.push_back(e);
+    }
+    const P& operator->() const { return p; }
+
+  private:
+    const P& p;
+    op o;
+    bool on;
+    int64_t begin = 0;
+};
+
+template <typename P>
+scope<P> timed(const P& p, op o) { return scope<P>(p, o); }
+
+template <typename L>
+void name_node(L& l, const std::string& label, const std::string& path) {
+  auto& n = nodes[&l]; // references into the map survive inserts
+  n.label = label;
+  n.path = path;
+  n.children.clear();
+  auto cs = l.children();
+  std::unordered_map<std::string, uint> count;
+  for (auto c : cs) count[type_name(typeid(*c).name())]++;
+  for (uint k=0; k<cs.size(); k++) {
+    std::string t = type_name(typeid(*cs[k]).name());
+    if (count[t] > 1) t += "#" + std::to_string(k); // e.g. join of two ffs
+    n.children.push_back(cs[k]);
+    name_node(*cs[k], t, path + "/" + t);
+  }
+}
+
+// names the nodes of the tree of root by their path from it, e.g.
+// net/stack/ff, for report and write_trace
+template <typename L>
+void name(L& root, const std::string& label = "net") {
+  std::lock_guard<std::mutex> g(registry_lock);
+  if (!nodes.count(&root)) roots.push_back(&root);
+  name_node(root, label, label);
+}
+
+inline void start() { enabled = true; }
+inline void stop()  { enabled = false; }
+
+// drops the events so far, names are kept
+inline void clear() {
+  std::lock_guard<std::mutex> g(registry_lock);
+  for (auto& t : threads) {
+    std::lock_guard<std::mutex> h(t->lock);
+    t->events.clear();
+  }
+  origin = std::chrono::steady_clock::now();
+}
+
+template <typename F>
+void for_each_event(F f) {
+  std::lock_guard<std::mutex> g(registry_lock);
+  for (auto& t : threads) {
+    std::lock_guard<std::mutex> h(t->lock);
+    for (auto& e : t->events) f(*t, e);
+  }
+}
+
+struct row {
+  std::string label, path;
+  uint depth;
+  int64_t ns[NUM_OPS];   // inclusive, per op
+  uint64_t calls[NUM_OPS];
+  int64_t total, self;   // over the ops
+};
+
+// a row per node, named trees first in depth first order, then nodes of
+// other trees by type
+inline std::vector<row> summary() {
+  struct acc { const char* type; int64_t ns[NUM_OPS]; uint64_t calls[NUM_OPS]; };
+  std::unordered_map<const void*, acc> a;
+  std::vector<const void*> order; // of first appearance
+  for_each_event([&](thread_events&, event& e) {
+    auto it = a.find(e.node);
+    if (it == a.end()) {
+      it = a.emplace(e.node, acc{e.type, {}, {}}).first;
+      order.push_back(e.node);
+    }
+    it->second.ns[e.o] += e.end - e.begin;
+    it->second.calls[e.o]++;
+  });
+
+  std::vector<row> rows;
+  std::function<void(const void*, uint)> walk = [&](const void* p, uint depth) {
+    auto& n = nodes[p];
+    uint r = rows.size();
+    rows.push_back(row{n.label, n.path, depth, {}, {}, 0, 0});
+    std::vector<uint> kids;
+    for (auto c : n.children) {
+      kids.push_back(rows.size());
+      walk(c, depth + 1);
+    }
+    auto& x = rows[r];
+    auto it = a.find(p);
+    int64_t below = 0;
+    for (auto k : kids) below += rows[k].total;
+    for (uint o=0; o<NUM_OPS; o++) {
+      if (it != a.end()) {
+        x.ns[o] = it->second.ns[o];
+        x.calls[o] = it->second.calls[o];
+      } else { // not timed itself, e.g. the root
+        for (auto k : kids) x.ns[o] += rows[k].ns[o];
+      }
+      x.total += x.ns[o];
+    }
+    // e.g. timewise forward is the forward_step of its layer
+    x.self = std::max<int64_t>(x.total - below, 0);
+    if (it != a.end()) a.erase(it);
+  };
+  {
+    std::lock_guard<std::mutex> g(registry_lock);
+    for (auto p : roots) walk(p, 0);
+  }
+  for (auto p : order) {
+    auto it = a.find(p);
+    if (it == a.end()) continue;
+    row x{type_name(it->second.type), "", 0, {}, {}, 0, 0};
+    for (uint o=0; o<NUM_OPS; o++) {
+      x.ns[o] = it->second.ns[o];
+      x.calls[o] = it->second.calls[o];
+      x.total += x.ns[o];
+    }
+    x.self = x.total;
+    rows.push_back(x);
+  }
+  return rows;
+}
+
+// ms per op, total, self (without sublayers) and share of the total of the
+// first root
+inline void report(std::ostream& out = std::cout) {
+  auto rows = summary();
+  if (rows.empty()) return;
+  uint width = 5;
+  for (auto& r : rows) width = std::max<uint>(width, 2*r.depth + r.label.size());
+  auto ms = [](int64_t ns) { return ns / 1e6; };
+  out << std::left << std::setw(width + 2) << "layer" << std::right;
+  for (uint o=0; o<NUM_OPS; o++) out << std::setw(14) << op_names[o];
+  out << std::setw(12) << "total" << std::setw(12) << "self" << std::setw(8)
+      << "%" << "  (ms)" << std::endl;
+  Real all = std::max<int64_t>(rows[0].total, 1);
+  out << std::fixed << std::setprecision(3);
+  for (auto& r : rows) {
+    out << std::left << std::setw(width + 2)
+        << (std::string(2*r.depth, ' ') + r.label) << std::right;
+    for (uint o=0; o<NUM_OPS; o++) out << std::setw(14) << ms(r.ns[o]);
+    out << std::setw(12) << ms(r.total) << std::setw(12) << ms(r.self)
+        << std::setw(8) << std::setprecision(1) << 100 * r.total / all
+        << std::setprecision(3) << std::endl;
+  }
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+}
+
+// the events as a chrome trace_event file, a track per thread
+inline void write_trace(const std::string& fname) {
+  std::unordered_map<const void*, std::string> path, label;
+  {
+    std::lock_guard<std::mutex> g(registry_lock);
+    for (auto& p : nodes) {
+      path[p.first] = p.second.path;
+      label[p.first] = p.second.label;
+    }
+  }
+  std::ofstream out(fname);
+  assert(out.is_open());
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  char ts[64];
+  for_each_event([&](thread_events& t, event& e) {
+    auto it = label.find(e.node);
+    std::string name = (it != label.end()) ? it->second : type_name(e.type);
+    std::snprintf(ts, sizeof(ts), "\"ts\":%.3f,\"dur\":%.3f", e.begin / 1e3,
+                  (e.end - e.begin) / 1e3);
+    out << (first ? "\n" : ",\n") << "{\"name\":\"" << name
+        << "\",\"cat\":\"" << op_names[e.o] << "\",\"ph\":\"X\",\"pid\":0,"
+        << "\"tid\":" << t.tid << "," << ts << ",\"args\":{\"op\":\""
+        << op_names[e.o] << "\",\"path\":\"" << path[e.node] << "\"}}";
+    first = false;
+  });
+  out << "\n]}" << std::endl;
+  assert(!out.fail());
+}
+
+} // end namespace profile
+
+} // end namespace milk
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef MILK_UTILS_PS_H
+#define MILK_UTILS_PS_H
+
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include "comm.h"
+
+namespace milk {
+
+/* Parameter server for embedding tables too big for one worker (see
+ * proj::serve). Row r of a [rows x dim] table lives on server ps_shard(r, K)
+ * of K, together with its updater state; the rows of a shard are stored in
+ * the order of their ids. Workers pull the rows a batch looks up and push the
+ * gradient of those rows, which the server applies as one sparse update
+ * (Weight::update_rows), so use adagrad or a lazy_* updater.
+ *
+ * Pushes are asynchronous. Staleness is bounded by clocks (stale synchronous
+ * parallel): the clock of a worker counts its pushes, and a pull at clock c
+ * is answered once every worker has pushed at least c - staleness times.
+ * staleness 0 is synchronous training; a worker always sees its own pushes.
+ */
+
+// hashed, so ids ordered by frequency spread evenly
+inline uint ps_shard(uint r, uint K) {
+  uint32_t h = r;
+  h ^= h >> 16; h *= 0x85ebca6b;
+  h ^= h >> 13; h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h % K;
+}
+
+enum ps_op : uint32_t { PS_HELLO, PS_PULL, PS_PUSH, PS_TICK, PS_BYE };
+
+// followed by n row ids (PULL, PUSH) and n rows of gradient (PUSH). HELLO
+// sends the worker id as n. TICK is a push of a batch without rows.
+struct ps_msg {
+  uint32_t op, n;
+  uint64_t clock; // of the worker, with this message
+};
+
+/* One shard. serve() answers workers connections on port and returns when
+ * all of them said bye; W (e.g. to checkpoint it) holds the rows of the shard.
+ * A malformed message (unknown op or worker id, a worker id twice, rows of
+ * another shard) is fatal, see comm_fail.
+ */
+class ps_server {
+  public:
+    Weight<cpu> W;
+
+    ps_server(uint a_shard, uint a_K, uint rows, uint a_dim, uint a_workers,
+              uint a_staleness = 0)
+    : shard(a_shard), K(a_K), dim(a_dim), workers(a_workers),
+      staleness(a_staleness), local(rows, -1) {
+      uint n = 0;
+      for (uint r=0; r<rows; r++)
+        if (ps_shard(r, K) == shard) local[r] = n++;
+      W.init(n, dim);
+    }
+
+    // e.g. an updater or initer other than the default
+    void set_updater(std::shared_ptr<updater<cpu>> u) {
+      W.u = u;
+      W.u->init(W().size(0), dim);
+    }
+
+    void serve(const std::string& port) {
+      int lfd = listen_on(port, workers);
+      clocks.assign(workers, 0);
+      joined.assign(workers, false);
+      std::vector<std::thread> ts;
+      for (uint i=0; i<workers; i++) {
+        int fd;
+        do fd = accept(lfd, nullptr, nullptr);
+        while (fd == -1 and errno == EINTR);
+        comm_check(fd != -1, "accept");
+        set_nodelay(fd);
+        ts.emplace_back([this, fd]() { handle(fd); });
+      }
+      close(lfd);
+      for (auto& t : ts) t.join();
+    }
+
+  private:
+    uint shard, K, dim, workers, staleness;
+    std::vector<int> local; // row of W for each id, -1 on other shards
+    std::vector<uint64_t> clocks;
+    std::vector<bool> joined; // worker ids that said hello
+    std::mutex m;
+    std::condition_variable cv;
+
+    void handle(int fd) {
+      ps_msg msg;
+      recv_all(fd, &msg, sizeof(msg));
+      if (msg.op != PS_HELLO or msg.n >= workers)
+        fail("bad hello for worker " + std::to_string(msg.n));
+      uint id = msg.n;
+      {
+        std::lock_guard<std::mutex> lock(m);
+        if (joined[id]) fail("worker " + std::to_string(id) + " said hello twice");
+        joined[id] = true;
+      }
+      std::vector<uint32_t> ids;
+      std::vector<Real> rows;
+      while (true) {
+        recv_all(fd, &msg, sizeof(msg));
+        if (msg.op == PS_BYE) break;
+        if (msg.op != PS_PULL and msg.op != PS_PUSH and msg.op != PS_TICK)
+          fail("unknown op " + std::to_string(msg.op));
+        if (msg.n > W().size(0)) // ids are unique rows of this shard
+          fail(std::to_string(msg.n) + " rows in one message");
+        ids.resize(msg.n);
+        recv_all(fd, ids.data(), msg.n * sizeof(uint32_t));
+        for (auto r : ids)
+          if (r >= local.size() or local[r] == -1)
+            fail("row " + std::to_string(r) + " is not on this shard");
+        rows.resize(msg.n * dim);
+        if (msg.op == PS_PUSH)
+          recv_all(fd, rows.data(), rows.size() * sizeof(Real));
+        std::unique_lock<std::mutex> lock(m);
+        if (msg.op == PS_PULL) {
+          cv.wait(lock, [&]() {
+            return *std::min_element(clocks.begin(), clocks.end()) + staleness
+                   >= msg.clock;
+          });
+          for (uint i=0; i<msg.n; i++) {
+            auto w = W()[local[ids[i]]];
+            std::copy(w.dptr_, w.dptr_ + dim, &rows[i * dim]);
+          }
+          lock.unlock();
+          send_all(fd, rows.data(), rows.size() * sizeof(Real));
+        } else {
+          if (msg.op == PS_PUSH) apply(ids, rows);
+          clocks[id] = msg.clock;
+          cv.notify_all();
+        }
+      }
+      std::lock_guard<std::mutex> lock(m);
+      clocks[id] = std::numeric_limits<uint64_t>::max() - staleness; // done
+      cv.notify_all();
+      close(fd);
+    }
+
+    [[noreturn]] void fail(const std::string& what) {
+      comm_fail("ps shard " + std::to_string(shard) + ": " + what);
+    }
+
+    // as proj::regularize and proj::update, on the rows of this shard. every
+    // batch with rows is a step of the updater, even with none of ours.
+    void apply(const std::vector<uint32_t>& ids, const std::vector<Real>& g) {
+      std::vector<uint> rows(ids.size());
+      for (uint i=0; i<ids.size(); i++) rows[i] = local[ids[i]];
+      auto index = make_MC<cpu>(std::vector<Real>(rows.begin(), rows.end()));
+      auto idx = vec(*index);
+      Matrix<cpu> g_((Real*)g.data(), Shape2(rows.size(), dim));
+      IndexFill(W.d(), idx, g_);
+      if (W.la > 0 and !rows.empty()) {
+        auto r = take_rows(idx, W.d());
+        *r += W.la * take(idx, W());
+        IndexFill(W.d(), idx, *r);
+      }
+      if (W.u->lr > 0) W.update_rows(rows, idx);
+      auto zeros = make_MC<cpu>(rows.size(), dim);
+      IndexFill(W.d(), idx, *zeros);
+    }
+};
+
+/* A worker's connection to all K servers (hosts[k] serves shard k). Pushes
+ * are queued and sent by one thread per server; pulls wait for the rows.
+ */
+class ps_client {
+  public:
+    uint K, dim, id;
+    uint64_t clock = 0; // pushes so far
+
+    ps_client(const std::vector<std::string>& hosts, uint a_id, uint a_dim)
+    : K(hosts.size()), dim(a_dim), id(a_id), links(K) {
+      for (uint k=0; k<K; k++) {
+        links[k].fd = connect_to(hosts[k]);
+        ps_msg hello = {PS_HELLO, id, 0};
+        send_all(links[k].fd, &hello, sizeof(hello));
+        links[k].t = std::thread([this, k]() { send_loop(links[k]); });
+      }
+    }
+    ~ps_client() {
+      for (auto& l : links) enqueue(l, {PS_BYE, 0, clock}, {}, nullptr);
+      for (auto& l : links) {
+        l.t.join();
+        close(l.fd);
+      }
+    }
+
+    ps_client(const ps_client&) = delete;
+    ps_client& operator=(const ps_client&) = delete;
+
+    // rows (sorted, unique) of the table into out [rows x dim], after all
+    // pushes of this worker
+    void pull(const std::vector<uint>& rows, Matrix<cpu> out) {
+      auto parts = split_rows(rows);
+      for (uint k=0; k<K; k++)
+        enqueue(links[k], {PS_PULL, (uint32_t)parts[k].size(), clock},
+                ids_of(rows, parts[k]), nullptr);
+      std::vector<Real> buf;
+      for (uint k=0; k<K; k++) {
+        buf.resize(parts[k].size() * dim);
+        recv_all(links[k].fd, buf.data(), buf.size() * sizeof(Real));
+        for (uint i=0; i<parts[k].size(); i++)
+          std::copy(&buf[i * dim], &buf[(i + 1) * dim], out[parts[k][i]].dptr_);
+      }
+    }
+
+    // gradient g [rows x dim] of rows (sorted, unique), one step of the
+    // updater. returns once g is copied.
+    void push(const std::vector<uint>& rows, Matrix<cpu> g) {
+      clock++;
+      auto parts = split_rows(rows);
+      for (uint k=0; k<K; k++) {
+        if (rows.empty()) {
+          enqueue(links[k], {PS_TICK, 0, clock}, {}, nullptr);
+          continue;
+        }
+        std::vector<Real> grads(parts[k].size() * dim);
+        for (uint i=0; i<parts[k].size(); i++)
+          std::copy(g[parts[k][i]].dptr_, g[parts[k][i]].dptr_ + dim,
+                    &grads[i * dim]);
+        enqueue(links[k], {PS_PUSH, (uint32_t)parts[k].size(), clock},
+                ids_of(rows, parts[k]), &grads);
+      }
+    }
+
+  private:
+    struct link {
+      int fd = -1;
+      std::thread t;
+      std::mutex m;
+      std::condition_variable cv;
+      std::deque<std::string> q; // whole messages
+    };
+    std::vector<link> links;
+
+    // positions in rows of the rows of each shard
+    std::vector<std::vector<uint>> split_rows(const std::vector<uint>& rows) {
+      std::vector<std::vector<uint>> parts(K);
+      for (uint i=0; i<rows.size(); i++) parts[ps_shard(rows[i], K)].push_back(i);
+      return parts;
+    }
+    std::vector<uint32_t> ids_of(const std::vector<uint>& rows,
+                                 const std::vector<uint>& pos) {
+      std::vector<uint32_t> ids(pos.size());
+      for (uint i=0; i<pos.size(); i++) ids[i] = rows[pos[i]];
+      return ids;
+    }
+
+    void enqueue(link& l, ps_msg msg, const std::vector<uint32_t>& ids,
+                 const std::vector<Real>* grads) {
+      std::string s((const char*)&msg, sizeof(msg));
+      s.append((const char*)ids.data(), ids.size() * sizeof(uint32_t));
+      if (grads) s.append((const char*)grads->data(), grads->size() * sizeof(Real));
+      std::lock_guard<std::mutex> lock(l.m);
+      l.q.push_back(std::move(s));
+      l.cv.notify_one();
+    }
+
+    void send_loop(link& l) {
+      while (true) {
+        std::string s;
+        {
+          std::unique_lock<std::mutex> lock(l.m);
+          l.cv.wait(lock, [&]() { return !l.q.empty(); });
+          s = std::move(l.q.front());
+          l.q.pop_front();
+        }
+        send_all(l.fd, s.data(), s.size());
+        if (((const ps_msg*)s.data())->op == PS_BYE) return;
+      }
+    }
+};
+
+// server addresses from MILK_PS_HOSTS, or 127.0.0.1 and MILK_PS_PORT (29600)
+// + shard
+inline std::vector<std::string> ps_hosts(uint K) {
+  return env_hosts("MILK_PS_HOSTS", "MILK_PS_PORT", 29600, K);
+}
+
+} // end namespace milk
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef MILK_UTILS_RECORDS_H
+#define MILK_UTILS_RECORDS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "checkpoint.h"
+#include "dag.h"
+
+namespace milk {
+
+/* Binary record files: a dataset as a sequence of records, each the
+ * components of one datastream instance (e.g. X and Y of a batch). A corpus
+ * is cut into shards prefix-00000.rec, prefix-00001.rec, .. (record_shards)
+ * that stream_datastream reads out of core, or read whole with read_records.
+ *
+ *   header   record_file_header
+ *   records  per record: uint64 bytes of the rest of the record, then per
+ *            component a record_part, its rows x cols values (Reals, or
+ *            uint32 for REC_IDS) and for REC_DAG its sdag (record_dag)
+ *
+ * Every piece is padded to record_align bytes, so values are aligned in a
+ * mapping, and a record can be skipped without looking inside. Version 1
+ * files (REC_DENSE only, records padded as a whole) are still read.
+ */
+struct record_file_header {
+  char magic[8];       // record_magic
+  uint32_t version;    // record_version
+  uint32_t real_size;  // sizeof(Real) of the data
+  uint32_t components; // per record
+  uint32_t reserved;
+  uint64_t count;      // records, filled in by close()
+};
+
+enum record_kind : uint32_t {
+  REC_DENSE = 0,      // Real values, e.g. features
+  REC_IDS = 1,        // uint32 values, e.g. token ids or labels
+  REC_DAG = 2,        // with an sdag (trees, see read_tree)
+  REC_SHARED_DAG = 4, // with the sdag of the previous component
+};
+
+struct record_part {
+  uint32_t kind;       // REC_DENSE or REC_IDS, and the dag flags
+  uint32_t batch_size; // of the Data
+  uint32_t rows, cols;
+};
+
+// followed by nodes + 1 uint32 offsets into the edges, edges (child, label)
+// uint32 pairs and roots uint32 (sdag::roots, none for a single tree)
+struct record_dag {
+  uint32_t nodes, edges, roots, reserved;
+};
+
+const char record_magic[8] = {'m','i','l','k','r','e','c','s'};
+const uint32_t record_version = 2; // written; 1 and 2 are read
+const uint64_t record_align = 8;
+
+inline uint64_t align_record(uint64_t bytes) {
+  return (bytes + record_align - 1) / record_align * record_align;
+}
+
+class record_writer {
+  public:
+    uint64_t count = 0;
+
+    // kinds of the components, REC_DENSE unless given
+    record_writer(const std::string& fname, uint a_components,
+                  const std::vector<record_kind>& a_kinds = {})
+    : out(fname, std::ios::binary), components(a_components), kinds(a_kinds) {
+      assert(out.is_open());
+      kinds.resize(components, REC_DENSE);
+      write_header();
+    }
+    ~record_writer() { close(); }
+
+    record_writer(const record_writer&) = delete;
+    record_writer& operator=(const record_writer&) = delete;
+
+    template <typename xpu>
+    void write(std::vector<Data<xpu>>& rec) {
+      assert(rec.size() == components);
+      buf.clear();
+      std::vector<std::shared_ptr<MatrixContainer<cpu>>> keep;
+      for (uint i=0; i<rec.size(); i++) {
+        auto m = host_view(rec[i](), keep);
+        Data<xpu>::s->Wait();
+        uint32_t kind = kinds[i];
+        if (rec[i].dag)
+          kind |= (i > 0 and rec[i].dag == rec[i-1].dag) ? REC_SHARED_DAG
+                                                         : REC_DAG;
+        record_part p = {kind, rec[i].batch_size, m.size(0), m.size(1)};
+        append(&p, sizeof(p));
+        if (kinds[i] == REC_IDS) {
+          std::vector<uint32_t> ids(m.shape_.Size());
+          for (size_t k=0; k<ids.size(); k++) {
+            ids[k] = m.dptr_[k];
+            assert(ids[k] == m.dptr_[k]); // a non-negative integer
+          }
+          append(ids.data(), ids.size() * sizeof(uint32_t));
+        } else {
+          append(m.dptr_, m.shape_.Size() * sizeof(Real));
+        }
+        if (kind & REC_DAG) append_dag(*rec[i].dag);
+      }
+      uint64_t bytes = buf.size();
+      out.write((const char*)&bytes, sizeof(bytes));
+      out.write(buf.data(), buf.size());
+      count++;
+    }
+
+    void close() {
+      if (!out.is_open()) return;
+      out.seekp(0);
+      write_header();
+      out.close();
+      assert(!out.fail());
+    }
+
+  private:
+    std::ofstream out;
+    uint components;
+    std::vector<record_kind> kinds;
+    std::string buf; // the record being written
+
+    void append(const void* p, size_t bytes) { // padded
+      buf.append((const char*)p, bytes);
+      buf.resize(align_record(buf.size()), '\0');
+    }
+
+    void append_dag(sdag& dag) {
+      std::vector<uint32_t> offsets(1, 0), edges;
+      for (uint n=0; n<dag.size(); n++) {
+        for (auto& e : dag.children(n)) {
+          edges.push_back(e.first);
+          edges.push_back(e.second);
+        }
+        offsets.push_back(edges.size() / 2);
+      }
+      record_dag h = {dag.size(), offsets.back(),
+                      (uint32_t)dag.roots.size(), 0};
+      append(&h, sizeof(h));
+      append(offsets.data(), offsets.size() * sizeof(uint32_t));
+      append(edges.data(), edges.size() * sizeof(uint32_t));
+      append(dag.roots.data(), dag.roots.size() * sizeof(uint32_t));
+    }
+
+    void write_header() {
+      record_file_header h = {};
+      std::memcpy(h.magic, record_magic, sizeof(h.magic));
+      h.version = record_version;
+      h.real_size = sizeof(Real);
+      h.components = components;
+      h.count = count;
+      out.write((const char*)&h, sizeof(h));
+    }
+};
+
+inline std::shared_ptr<sdag> parse_record_dag(const char*& p) {
+  auto h = (const record_dag*)p;
+  p += sizeof(record_dag);
+  auto offsets = (const uint32_t*)p;
+  p += align_record((h->nodes + 1) * sizeof(uint32_t));
+  auto edges = (const uint32_t*)p;
+  p += align_record(h->edges * 2 * sizeof(uint32_t));
+  auto roots = (const uint32_t*)p;
+  p += align_record(h->roots * sizeof(uint32_t));
+  auto dag = std::make_shared<sdag>();
+  dag->adj_list.resize(h->nodes);
+  for (uint n=0; n<h->nodes; n++)
+    for (uint e=offsets[n]; e<offsets[n+1]; e++)
+      dag->adj_list[n].emplace_back(edges[2*e], edges[2*e+1]);
+  dag->roots.assign(roots, roots + h->roots);
+  return dag;
+}
+
+// the record at p (past its length) of a file with header h into rec, one
+// fresh Data per component, through Data<xpu>::s of the calling thread
+template <typename xpu>
+void parse_record(const record_file_header& h, const char* p,
+                  std::vector<Data<xpu>>& rec) {
+  rec = std::vector<Data<xpu>>(h.components);
+  std::vector<Real> vals;
+  for (uint i=0; i<rec.size(); i++) {
+    auto& d = rec[i];
+    auto part = (const record_part*)p;
+    p += sizeof(record_part);
+    uint rows = part->rows, cols = part->cols;
+    size_t n = size_t(rows) * cols;
+    d.init(rows, cols);
+    d.batch_size = part->batch_size;
+    const Real* v = (const Real*)p;
+    if (part->kind & REC_IDS) {
+      auto ids = (const uint32_t*)p;
+      vals.assign(ids, ids + n);
+      v = vals.data();
+      p += align_record(n * sizeof(uint32_t));
+    } else if (h.version == 1) { // pieces not padded, maybe unaligned
+      assert(h.real_size == sizeof(Real));
+      vals.resize(n);
+      std::memcpy(vals.data(), p, n * sizeof(Real));
+      v = vals.data();
+      p += n * sizeof(Real);
+    } else {
+      assert(h.real_size == sizeof(Real)); // ids read into any Real
+      p += align_record(n * sizeof(Real));
+    }
+    Copy(d(), Matrix<cpu>((Real*)v, Shape2(rows, cols)), Data<xpu>::s);
+    Data<xpu>::s->Wait(); // before vals is reused
+    if (part->kind & REC_DAG) d.dag = parse_record_dag(p);
+    if (part->kind & REC_SHARED_DAG) d.dag = rec[i-1].dag;
+  }
+}
+
+// the bytes of a record as read (see record_reader::next), parsed later, e.g.
+// on the thread that owns the device
+struct raw_record {
+  record_file_header header; // of its file
+  std::vector<char> bytes;
+
+  template <typename xpu>
+  void parse(std::vector<Data<xpu>>& rec) const {
+    parse_record(header, bytes.data(), rec);
+  }
+};
+
+/* Records of one file, in order, through a mapping (advised sequential, so
+ * read pages can go) or, without use_mmap, with reads into a buffer.
+ */
+class record_reader {
+  public:
+    record_file_header header;
+
+    record_reader(const std::string& fname, bool use_mmap = true) {
+      if (use_mmap) {
+        map = std::make_shared<mapped_file>(fname);
+        assert(map->size() >= sizeof(header));
+        std::memcpy(&header, map->data(), sizeof(header));
+        madvise(map->data(), map->size(), MADV_SEQUENTIAL);
+      } else {
+        in.open(fname, std::ios::binary);
+        assert(in.is_open());
+        in.read((char*)&header, sizeof(header));
+      }
+      if (std::memcmp(header.magic, record_magic, sizeof(header.magic)) != 0)
+        throw std::runtime_error(fname + ": not a record file");
+      if (header.version != 1 and header.version != record_version)
+        throw std::runtime_error(fname + ": unknown record version " +
+                                 std::to_string(header.version));
+      pos = sizeof(header);
+    }
+
+    // the next record whose first component is at most max_len long (see
+    // Data::len) into rec, one fresh Data per component. false at the end.
+    template <typename xpu>
+    bool next(std::vector<Data<xpu>>& rec,
+              uint max_len = std::numeric_limits<uint>::max()) {
+      const char* p = skip_to(max_len);
+      if (p) parse_record(header, p, rec);
+      return p != nullptr;
+    }
+
+    // the same, but only the bytes of the record, to parse later with
+    // raw_record::parse. no Data is made, so readers can run on any thread.
+    bool next(raw_record& raw,
+              uint max_len = std::numeric_limits<uint>::max()) {
+      const char* p = skip_to(max_len);
+      if (!p) return false;
+      raw.header = header;
+      raw.bytes.assign(p, p + last_bytes);
+      return true;
+    }
+
+    // all (remaining) records on the host, parsed in parallel. needs the
+    // mapping. see read_records to put them on a device.
+    std::vector<std::vector<Data<cpu>>> read_all(
+        thread_pool& pool = thread_pool::get()) {
+      assert(map);
+      std::vector<const char*> ps;
+      for (const char* p; (p = fetch()); ) ps.push_back(p);
+      std::vector<std::vector<Data<cpu>>> recs(ps.size());
+      pool.parallel_for(ps.size(), [&](uint i) {
+        parse_record(header, ps[i], recs[i]);
+      });
+      return recs;
+    }
+
+  private:
+    std::shared_ptr<mapped_file> map;
+    std::ifstream in;
+    std::vector<char> buf;
+    size_t pos;
+    uint64_t read = 0; // records so far
+    uint64_t last_bytes = 0; // of the record fetch() returned
+
+    const char* skip_to(uint max_len) {
+      const char* p;
+      while ((p = fetch())) {
+        auto first = (const record_part*)p;
+        if (first->rows / first->batch_size <= max_len) return p;
+      }
+      return nullptr;
+    }
+
+    // the next record past its length, or nullptr at the end
+    const char* fetch() {
+      if (read == header.count) return nullptr;
+      read++;
+      uint64_t& bytes = last_bytes;
+      if (map) {
+        std::memcpy(&bytes, map->data() + pos, sizeof(bytes));
+        pos += sizeof(bytes) + bytes;
+        assert(pos <= map->size()); // truncated
+        return map->data() + pos - bytes;
+      }
+      in.read((char*)&bytes, sizeof(bytes));
+      buf.resize(bytes);
+      in.read(buf.data(), bytes);
+      assert(in.good());
+      return buf.data();
+    }
+};
+
+inline std::string record_shard(const std::string& prefix, uint k) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "-%05u.rec", k);
+  return prefix + name;
+}
+
+// existing shards of prefix, in order
+inline std::vector<std::string> record_shards(const std::string& prefix) {
+  std::vector<std::string> files;
+  for (uint k=0; std::ifstream(record_shard(prefix, k)).good(); k++)
+    files.push_back(record_shard(prefix, k));
+  return files;
+}
+
+// an in-memory dataset (as datastream::set_data takes it) as shards of
+// prefix, instance j in shard j % shards. returns the file names.
+template <typename xpu>
+std::vector<std::string> write_records(
+    const std::string& prefix, uint shards,
+    const std::vector<std::vector<Data<xpu>>*>& datalist,
+    const std::vector<record_kind>& kinds = {}) {
+  std::vector<std::shared_ptr<record_writer>> w;
+  std::vector<std::string> files;
+  for (uint k=0; k<shards; k++) {
+    files.push_back(record_shard(prefix, k));
+    w.push_back(std::make_shared<record_writer>(files.back(), datalist.size(),
+                                                kinds));
+  }
+  std::vector<Data<xpu>> rec(datalist.size());
+  for (uint j=0; j<datalist[0]->size(); j++) {
+    for (uint i=0; i<datalist.size(); i++) rec[i] = (*datalist[i])[j];
+    w[j % shards]->write(rec);
+  }
+  return files;
+}
+
+// all records of files into datalist (one vector per component, appended
+// to), from mappings. records are parsed on the host, in parallel, and put
+// on xpu on the calling thread (see to_device).
+template <typename xpu>
+void read_records(const std::vector<std::string>& files,
+                  const std::vector<std::vector<Data<xpu>>*>& datalist) {
+  for (auto& f : files) {
+    record_reader in(f);
+    assert(in.header.components == datalist.size());
+    for (auto& rec : in.read_all())
+      for (uint i=0; i<rec.size(); i++)
+        datalist[i]->push_back(to_device<xpu>(rec[i]));
+  }
+}
+
+} // end namespace milk
+
+#endif
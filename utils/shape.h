@@ -11,6 +11,14 @@ Matrix<xpu> middle_rows(Matrix<xpu> x, uint begin, uint rows) { // why not use s
                      x.stream_);
 }
 
+template <typename xpu>
+Matrix<xpu> top_rows(Matrix<xpu> x, uint rows) {
+  return Matrix<xpu>(x.dptr_,
+                     Shape2(rows, x.size(1)),
+                     x.stride_,
+                     x.stream_);
+}
+
 template <typename xpu>
 Matrix<xpu> bottom_rows(Matrix<xpu> x, uint rows) { // why not use slice? is this more efficient?
   return Matrix<xpu>(x[x.size(0)-rows].dptr_,
@@ -19,6 +27,14 @@ Matrix<xpu> bottom_rows(Matrix<xpu> x, uint rows) { // why not use slice? is thi
                      x.stream_);
 }
 
+template <typename xpu>
+Matrix<xpu> middle_cols(Matrix<xpu> x, uint begin, uint cols) {
+  return Matrix<xpu>(x.dptr_ + begin,
+                     Shape2(x.size(0), cols),
+                     x.stride_,
+                     x.stream_);
+}
+
 template <typename xpu>
 Vector<xpu> vec(Matrix<xpu> x) {
   if (x.size(0) > 1) { // col vector case
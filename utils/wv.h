@@ -0,0 +1,149 @@
+#ifndef MILK_UTILS_WV_H
+#define MILK_UTILS_WV_H
+
+#include <cstdint>
+#include <cstring>
+#include "mmap.h"
+
+namespace milk {
+
+/* Binary word vector table, made from the text (GloVe) format by
+ * convert_wv_table and read by mapping the file (see wv_file):
+ *
+ *   header  wv_header
+ *   vocab   one word per row, in row order, each terminated by '\n'
+ *   data    [rows x dim] Reals, row-major, from data_offset (page aligned)
+ *
+ * The data block can be used as a proj table in place (proj::map).
+ */
+struct wv_header {
+  char magic[8];        // wv_magic
+  uint32_t real_size;   // sizeof(Real) of the data block
+  uint32_t reserved;
+  uint64_t rows, dim;
+  uint64_t vocab_bytes;
+  uint64_t data_offset;
+};
+
+const char wv_magic[8] = {'m','i','l','k','w','v','0','1'};
+const uint64_t wv_align = 4096;
+
+// text table (word followed by d values per line) to binary. reads the text
+// twice, first for the vocabulary only, so the table is never held in memory.
+void convert_wv_table(std::string txt_fname, std::string bin_fname, uint d) {
+  std::string line;
+  wv_header hdr;
+  std::memcpy(hdr.magic, wv_magic, sizeof(hdr.magic));
+  hdr.real_size = sizeof(Real);
+  hdr.reserved = 0;
+  hdr.rows = hdr.vocab_bytes = 0;
+  hdr.dim = d;
+
+  std::ifstream in(txt_fname);
+  assert(in.is_open());
+  std::ofstream out(bin_fname, std::ios::binary);
+  assert(out.is_open());
+  out.seekp(sizeof(hdr));
+  while (std::getline(in, line)) {
+    if (is_whitespace(line)) continue;
+    std::string w = line.substr(0, line.find(' '));
+    out << w << '\n';
+    hdr.rows++;
+    hdr.vocab_bytes += w.size() + 1;
+  }
+  uint64_t end = sizeof(hdr) + hdr.vocab_bytes;
+  hdr.data_offset = (end + wv_align - 1) / wv_align * wv_align;
+
+  out.seekp(0);
+  out.write((const char*)&hdr, sizeof(hdr));
+  out.seekp(hdr.data_offset);
+
+  in.clear(); in.seekg(0);
+  std::vector<Real> row(d);
+  while (std::getline(in, line)) {
+    if (is_whitespace(line)) continue;
+    auto v = split(line, ' ');
+    assert(v.size() >= d + 1);
+    for (uint i=0; i<d; i++) row[i] = std::stod(v[i+1]);
+    out.write((const char*)row.data(), d * sizeof(Real));
+  }
+  assert(out.good());
+}
+
+class wv_file {
+  public:
+    wv_header header;
+    std::vector<std::string> i2w;                  // file row -> word
+    std::unordered_map<std::string, uint> w2i;     // first row of each word
+
+    wv_file(const std::string& fname, bool copy_on_write = false)
+        : f(fname, copy_on_write) {
+      assert(f.size() >= sizeof(header));
+      std::memcpy(&header, f.data(), sizeof(header));
+      assert(std::memcmp(header.magic, wv_magic, sizeof(wv_magic)) == 0);
+      assert(header.real_size == sizeof(Real)); // converted with another Real
+      assert(f.size() >= header.data_offset +
+                         header.rows * header.dim * sizeof(Real));
+
+      const char* p = f.data() + sizeof(header);
+      for (uint i=0; i<header.rows; i++) {
+        const char* e = (const char*)std::memchr(p, '\n', f.data() + f.size() - p);
+        assert(e);
+        i2w.emplace_back(p, e);
+        w2i.emplace(i2w.back(), i); // keeps the first if repeated
+        p = e + 1;
+      }
+    }
+
+    // whether table() may be written to (privately)
+    bool copy_on_write() { return f.copy_on_write; }
+
+    // [rows x dim] view into the mapping
+    Matrix<cpu> table() {
+      return Matrix<cpu>((Real*)(f.data() + header.data_offset),
+                         Shape2(header.rows, header.dim));
+    }
+
+  private:
+    mapped_file f;
+};
+
+// like load_wv_table: rows of W for the words in w2i that are in the file
+template <typename xpu>
+void load_wv_table_bin(std::string fname, Matrix<xpu>* W,
+                       std::unordered_map<std::string,uint>& w2i) {
+  wv_file f(fname);
+  assert(f.header.dim == W->size(1));
+  auto table = f.table();
+  for (auto& p : w2i) {
+    auto it = f.w2i.find(p.first);
+    if (it != f.w2i.end()) Copy((*W)[p.second], table[it->second]);
+  }
+}
+
+// table of f as Weight storage. on cpu a view into the mapping (the container
+// keeps f alive and only ever frees its own, empty buffer), otherwise a copy.
+template <typename xpu>
+std::shared_ptr<MatrixContainer<xpu>> mapped_table(std::shared_ptr<wv_file> f) {
+  auto table = f->table();
+  auto W = make_MC<xpu>(table.size(0), table.size(1));
+  Copy(*W, table, Data<xpu>::s);
+  return W;
+}
+
+template <>
+inline std::shared_ptr<MatrixContainer<cpu>> mapped_table<cpu>(
+    std::shared_ptr<wv_file> f) {
+  auto table = f->table();
+  auto W = new MatrixContainer<cpu>(Shape2(0, table.size(1)));
+  W->dptr_ = table.dptr_;
+  W->shape_ = table.shape_;
+  W->stride_ = table.stride_;
+  W->set_stream(Data<cpu>::s);
+  return std::shared_ptr<MatrixContainer<cpu>>(W,
+      [f](MatrixContainer<cpu>* m) { delete m; });
+}
+
+} // end namespace milk
+
+#endif